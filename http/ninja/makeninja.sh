@@ -17,3 +17,5 @@ find src/main/cpp ! -name "TestMain.cpp" -and -name "*.cpp" -or -name "*.c" -or
 
 cat .ninja/src_files | ${HELPER} libfathomdb-http.a >> build.ninja
 
+echo "src/main/cpp/TestMain.cpp"  | ${HELPER} test-fathomdb-http "+bin/libfathomdb-http.a"  "extralibs = -lfathomdb-http" >> build.ninja
+
@@ -0,0 +1,677 @@
+// See COPYRIGHT for copyright
+#include "TestMain.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <algorithm>
+
+#include <boost/asio.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/logic/tribool.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/lexical_cast.hpp>
+#include <glog/logging.h>
+
+#include "fathomdb/http/HttpRequest.h"
+#include "fathomdb/http/HttpRequestHandler.h"
+#include "fathomdb/http/HttpRequestParser.h"
+#include "fathomdb/http/HttpResponse.h"
+#include "fathomdb/http/HttpServer.h"
+
+using namespace std;
+
+using boost::logic::tribool;
+using fathomdb::http::HttpHeader;
+using fathomdb::http::HttpRequest;
+using fathomdb::http::HttpRequestParser;
+using fathomdb::http::HttpRequestHandler;
+using fathomdb::http::HttpResponse;
+using fathomdb::http::HttpServer;
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Feeds input to the parser in reads of at most readSize bytes, as HttpConnection does, starting a new
+// request after each one completes. Describes each request on a line, then "invalid" if the parser
+// rejected the input, or "incomplete" if it was waiting for more.
+static string parseAll(const string& input, size_t readSize) {
+	vector<char> buffer(input.begin(), input.end());
+
+	ostringstream out;
+	HttpRequestParser parser;
+	unique_ptr<HttpRequest> req(new HttpRequest());
+
+	tribool result = true;
+	size_t pos = 0;
+	while (pos < buffer.size()) {
+		char * begin = &buffer[pos];
+		char * end = &buffer[0] + min(buffer.size(), pos + readSize);
+		pos = end - &buffer[0];
+
+		// One read can hold the end of one request and the start of the next
+		while (begin != end) {
+			boost::tie(result, begin) = parser.parse(*req, begin, end);
+			if (!result) {
+				out << "invalid\n";
+				return out.str();
+			}
+			if (boost::indeterminate(result)) {
+				continue;
+			}
+
+			out << req->method << " " << req->uri << " HTTP/" << req->http_version_major << "." << req->http_version_minor;
+			for (auto it = req->headers.begin(); it != req->headers.end(); it++) {
+				out << " [" << it->name << ": " << it->value << "]";
+			}
+			if (!req->post_data.empty()) {
+				out << " body=" << req->post_data;
+			}
+			out << "\n";
+
+			parser.reset();
+			req.reset(new HttpRequest());
+		}
+	}
+
+	if (boost::indeterminate(result)) {
+		out << "incomplete\n";
+	}
+	return out.str();
+}
+
+// Every way of splitting input into reads should give the same result
+static void checkParse(const string& input, const string& expected) {
+	size_t readSizes[] = { 1, 2, 3, 7, 64, input.size() };
+	for (size_t i = 0; i < sizeof(readSizes) / sizeof(readSizes[0]); i++) {
+		string actual = parseAll(input, max((size_t) 1, readSizes[i]));
+		CHECK_EQ(expected, actual) << "parsing in reads of " << readSizes[i] << " bytes: " << input;
+	}
+}
+
+void TestHttpRequestParser() {
+	// A head split across reads (at every read size), including through the final blank line
+	checkParse("GET /pprof/cmdline HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n",
+			"GET /pprof/cmdline HTTP/1.1 [Host: localhost] [Accept: */*]\n");
+
+	checkParse("GET /pprof/heap?seconds=5 HTTP/1.0\r\n\r\n", "GET /pprof/heap?seconds=5 HTTP/1.0\n");
+
+	// Pipelined requests in one buffer
+	checkParse("GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /b HTTP/1.1\r\n\r\nPOST /c HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET /d HTTP/1.1\r\n\r\n",
+			"GET /a HTTP/1.1 [Host: x]\nGET /b HTTP/1.1\nPOST /c HTTP/1.1 [Content-Length: 3] body=abc\nGET /d HTTP/1.1\n");
+
+	// A POST body split across reads, and one that never finishes
+	checkParse("POST /pprof/symbol HTTP/1.1\r\nContent-Length: 23\r\n\r\n0x7f0000001000+0x401000",
+			"POST /pprof/symbol HTTP/1.1 [Content-Length: 23] body=0x7f0000001000+0x401000\n");
+	checkParse("POST /pprof/symbol HTTP/1.1\r\nContent-Length: 100\r\n\r\n0x401000", "incomplete\n");
+
+	// An empty POST body doesn't wait for more
+	checkParse("POST /x HTTP/1.1\r\nContent-Length: 0\r\n\r\nGET /y HTTP/1.1\r\n\r\n",
+			"POST /x HTTP/1.1 [Content-Length: 0]\nGET /y HTTP/1.1\n");
+
+	// Continuation lines are folded into the previous header's value, without the leading whitespace
+	// (as the original parser did)
+	checkParse("GET / HTTP/1.1\r\nX-Long: first\r\n  second\r\n\tthird\r\nHost: x\r\n\r\n",
+			"GET / HTTP/1.1 [X-Long: firstsecondthird] [Host: x]\n");
+
+	// Waiting for the end of the head
+	checkParse("GET / HTTP/1.1\r\nHost: x\r\n", "incomplete\n");
+	checkParse("GET / HTTP/1.1\n\n", "incomplete\n");
+
+	// Oversized heads, whether or not they are complete, and however they arrive
+	string longHeader = "GET / HTTP/1.1\r\nX-Big: " + string(HttpRequestParser::MAX_HEAD_SIZE, 'a') + "\r\n";
+	checkParse(longHeader, "invalid\n");
+	checkParse(longHeader + "\r\n", "invalid\n");
+
+	// A head of exactly the maximum size, with the body arriving in the same reads as its end
+	string bigHead = "POST / HTTP/1.1\r\nContent-Length: 10\r\nX-Big: ";
+	string padding(HttpRequestParser::MAX_HEAD_SIZE - bigHead.size() - 4, 'a');
+	checkParse(bigHead + padding + "\r\n\r\n0123456789",
+			"POST / HTTP/1.1 [Content-Length: 10] [X-Big: " + padding + "] body=0123456789\n");
+
+	// Malformed request lines
+	checkParse("GET /\r\n\r\n", "invalid\n");
+	checkParse("GET / HTTP/1.1 extra\r\n\r\n", "invalid\n");
+	checkParse("GET / HTTX/1.1\r\n\r\n", "invalid\n");
+	checkParse("GET / HTTP/1.\r\n\r\n", "invalid\n");
+	checkParse("G(T / HTTP/1.1\r\n\r\n", "invalid\n");
+	checkParse("GET  HTTP/1.1\r\n\r\n", "invalid\n");
+
+	// Malformed headers
+	checkParse("GET / HTTP/1.1\r\nNoColon\r\n\r\n", "invalid\n");
+	checkParse("GET / HTTP/1.1\r\nBad Name: x\r\n\r\n", "invalid\n");
+	checkParse("GET / HTTP/1.1\r\n continued\r\n\r\n", "invalid\n");
+	checkParse("GET / HTTP/1.1\r\nX: a\rb\r\n\r\n", "invalid\n");
+	static const char withNul[] = "GET / HTTP/1.1\r\nX: a\0b\r\n\r\n";
+	checkParse(string(withNul, sizeof(withNul) - 1), "invalid\n");
+
+	// POSTs we can't find the end of
+	checkParse("POST / HTTP/1.1\r\n\r\nbody", "invalid\n");
+	checkParse("POST / HTTP/1.1\r\nContent-Length: lots\r\n\r\nbody", "invalid\n");
+	checkParse("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\nbody", "invalid\n");
+	checkParse("POST / HTTP/1.1\r\nContent-Length: +4\r\n\r\nbody", "invalid\n");
+	checkParse("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\nbody", "invalid\n");
+
+	// A body we won't buffer, before any of it arrives
+	checkParse("POST / HTTP/1.1\r\nContent-Length: 18446744073709551615\r\n\r\nbody", "invalid\n");
+
+	cout << "HttpRequestParser tests passed" << endl;
+}
+
+/**
+ * The original one-byte-at-a-time request parser, kept here only as the baseline for BenchmarkHttpRequestParser
+ * (TestHttpRequestParser checks the real one).
+ */
+class BytewiseRequestParser {
+public:
+	BytewiseRequestParser() :
+		state_(method_start), postDataLength_(0) {
+	}
+
+	boost::tuple<tribool, char*> parse(HttpRequest& req, char * begin, char * end) {
+		while (begin != end) {
+			boost::tribool result = consume(req, *begin++);
+			if (result || !result)
+				return boost::make_tuple(result, begin);
+		}
+		boost::tribool result = boost::indeterminate;
+		return boost::make_tuple(result, begin);
+	}
+
+private:
+	tribool consume(HttpRequest& req, char input);
+
+	static bool is_char(int c);
+	static bool is_ctl(int c);
+	static bool is_tspecial(int c);
+	static bool is_digit(int c);
+
+	enum state {
+		method_start,
+		method,
+		uri_start,
+		uri,
+		http_version_h,
+		http_version_t_1,
+		http_version_t_2,
+		http_version_p,
+		http_version_slash,
+		http_version_major_start,
+		http_version_major,
+		http_version_minor_start,
+		http_version_minor,
+		expecting_newline_1,
+		header_line_start,
+		header_lws,
+		header_name,
+		space_before_header_value,
+		header_value,
+		expecting_newline_2,
+		expecting_newline_3,
+		post_data
+	} state_;
+
+	size_t postDataLength_;
+};
+
+tribool BytewiseRequestParser::consume(HttpRequest& req, char input) {
+	switch (state_) {
+	case method_start:
+		if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
+			return false;
+		} else {
+			state_ = method;
+			req.method.push_back(input);
+			return boost::indeterminate;
+		}
+	case method:
+		if (input == ' ') {
+			state_ = uri;
+			return boost::indeterminate;
+		} else if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
+			return false;
+		} else {
+			req.method.push_back(input);
+			return boost::indeterminate;
+		}
+	case uri_start:
+		if (is_ctl(input)) {
+			return false;
+		} else {
+			state_ = uri;
+			req.uri.push_back(input);
+			return boost::indeterminate;
+		}
+	case uri:
+		if (input == ' ') {
+			state_ = http_version_h;
+			return boost::indeterminate;
+		} else if (is_ctl(input)) {
+			return false;
+		} else {
+			req.uri.push_back(input);
+			return boost::indeterminate;
+		}
+	case http_version_h:
+		if (input == 'H') {
+			state_ = http_version_t_1;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_t_1:
+		if (input == 'T') {
+			state_ = http_version_t_2;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_t_2:
+		if (input == 'T') {
+			state_ = http_version_p;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_p:
+		if (input == 'P') {
+			state_ = http_version_slash;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_slash:
+		if (input == '/') {
+			req.http_version_major = 0;
+			req.http_version_minor = 0;
+			state_ = http_version_major_start;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_major_start:
+		if (is_digit(input)) {
+			req.http_version_major = req.http_version_major * 10 + input - '0';
+			state_ = http_version_major;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_major:
+		if (input == '.') {
+			state_ = http_version_minor_start;
+			return boost::indeterminate;
+		} else if (is_digit(input)) {
+			req.http_version_major = req.http_version_major * 10 + input - '0';
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_minor_start:
+		if (is_digit(input)) {
+			req.http_version_minor = req.http_version_minor * 10 + input - '0';
+			state_ = http_version_minor;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case http_version_minor:
+		if (input == '\r') {
+			state_ = expecting_newline_1;
+			return boost::indeterminate;
+		} else if (is_digit(input)) {
+			req.http_version_minor = req.http_version_minor * 10 + input - '0';
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case expecting_newline_1:
+		if (input == '\n') {
+			state_ = header_line_start;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case header_line_start:
+		if (input == '\r') {
+			state_ = expecting_newline_3;
+			return boost::indeterminate;
+		} else if (!req.headers.empty() && (input == ' ' || input == '\t')) {
+			state_ = header_lws;
+			return boost::indeterminate;
+		} else if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
+			return false;
+		} else {
+			req.headers.push_back(HttpHeader());
+			req.headers.back().name.push_back(input);
+			state_ = header_name;
+			return boost::indeterminate;
+		}
+	case header_lws:
+		if (input == '\r') {
+			state_ = expecting_newline_2;
+			return boost::indeterminate;
+		} else if (input == ' ' || input == '\t') {
+			return boost::indeterminate;
+		} else if (is_ctl(input)) {
+			return false;
+		} else {
+			state_ = header_value;
+			req.headers.back().value.push_back(input);
+			return boost::indeterminate;
+		}
+	case header_name:
+		if (input == ':') {
+			state_ = space_before_header_value;
+			return boost::indeterminate;
+		} else if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
+			return false;
+		} else {
+			req.headers.back().name.push_back(input);
+			return boost::indeterminate;
+		}
+	case space_before_header_value:
+		if (input == ' ') {
+			state_ = header_value;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case header_value:
+		if (input == '\r') {
+			state_ = expecting_newline_2;
+			return boost::indeterminate;
+		} else if (is_ctl(input)) {
+			return false;
+		} else {
+			req.headers.back().value.push_back(input);
+			return boost::indeterminate;
+		}
+	case expecting_newline_2:
+		if (input == '\n') {
+			state_ = header_line_start;
+			return boost::indeterminate;
+		} else {
+			return false;
+		}
+	case expecting_newline_3:
+		if (input == '\n') {
+			if ("POST" == req.method) {
+				size_t contentLength = 0;
+				bool found = false;
+				for (auto it = req.headers.begin(); it != req.headers.end(); it++) {
+					if ("Content-Length" == it->name) {
+						try {
+							contentLength = boost::lexical_cast<size_t>(it->value);
+							found = true;
+							break;
+						} catch (boost::bad_lexical_cast& blc) {
+							LOG(WARNING) << "Invalid Content-Length value in POST: " << it->value;
+							return false;
+						}
+					}
+				}
+				if (!found) {
+					LOG(WARNING) << "Content-Length header not found or negative value in POST: " << contentLength;
+					return false;
+				}
+				postDataLength_ = contentLength;
+				if (contentLength != 0) {
+					req.post_data.reserve(contentLength);
+					state_ = post_data;
+					return boost::indeterminate;
+				} else {
+					// Don't wait for data that is never coming!
+					return true;
+				}
+			}
+			return true;
+		}
+	case post_data:
+		req.post_data.push_back(input);
+		if (req.post_data.size() == postDataLength_) {
+			return true;
+		}
+		return boost::indeterminate;
+	default:
+		return false;
+	}
+}
+
+bool BytewiseRequestParser::is_char(int c) {
+	return c >= 0 && c <= 127;
+}
+
+bool BytewiseRequestParser::is_ctl(int c) {
+	return (c >= 0 && c <= 31) || (c == 127);
+}
+
+bool BytewiseRequestParser::is_tspecial(int c) {
+	switch (c) {
+	case '(':
+	case ')':
+	case '<':
+	case '>':
+	case '@':
+	case ',':
+	case ';':
+	case ':':
+	case '\\':
+	case '"':
+	case '/':
+	case '[':
+	case ']':
+	case '?':
+	case '=':
+	case '{':
+	case '}':
+	case ' ':
+	case '\t':
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool BytewiseRequestParser::is_digit(int c) {
+	return c >= '0' && c <= '9';
+}
+
+
+// A /pprof/symbol POST as pprof sends it: hex addresses joined by '+'
+static string buildSymbolRequest(size_t bodySize) {
+	string body;
+	body.reserve(bodySize + 32);
+	uint64_t address = 0x00007f3a12345678ULL;
+	char hex[32];
+	while (body.size() < bodySize) {
+		if (!body.empty()) {
+			body += '+';
+		}
+		snprintf(hex, sizeof(hex), "0x%016llx", (unsigned long long) address);
+		body += hex;
+		address += 0x1d3;
+	}
+
+	ostringstream s;
+	s << "POST /pprof/symbol HTTP/1.1\r\n";
+	s << "User-Agent: curl/7.22.0 (x86_64-pc-linux-gnu) libcurl/7.22.0\r\n";
+	s << "Host: localhost:8088\r\n";
+	s << "Accept: */*\r\n";
+	s << "Content-Length: " << body.size() << "\r\n";
+	s << "Content-Type: application/x-www-form-urlencoded\r\n";
+	s << "\r\n";
+	s << body;
+	return s.str();
+}
+
+// Feed the request through the parser in 8 KB reads, as HttpConnection does
+template<class Parser>
+static double timeParse(const string& request, int iterations) {
+	const size_t readSize = 8192;
+	vector<char> buffer(readSize);
+
+	double start = now();
+	for (int i = 0; i < iterations; i++) {
+		Parser parser;
+		HttpRequest req;
+
+		tribool result = boost::indeterminate;
+		size_t pos = 0;
+		while (pos < request.size() && boost::indeterminate(result)) {
+			size_t n = min(readSize, request.size() - pos);
+			memcpy(&buffer[0], request.data() + pos, n);
+			pos += n;
+
+			boost::tie(result, boost::tuples::ignore) = parser.parse(req, &buffer[0], &buffer[0] + n);
+		}
+
+		CHECK(result);
+	}
+	return (now() - start) / iterations;
+}
+
+void BenchmarkHttpRequestParser() {
+	size_t sizes[] = { 64 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		string request = buildSymbolRequest(sizes[i]);
+		int iterations = max(1, (int) ((64 * 1024 * 1024) / request.size()));
+
+		double bytewise = timeParse<BytewiseRequestParser>(request, iterations);
+		double bulk = timeParse<HttpRequestParser>(request, iterations);
+
+		double mb = request.size() / (1024.0 * 1024.0);
+		cout << "symbol POST " << mb << " MB:"
+				<< " bytewise " << (mb / bytewise) << " MB/s,"
+				<< " bulk " << (mb / bulk) << " MB/s,"
+				<< " speedup " << (bytewise / bulk) << "x" << endl;
+	}
+}
+
+// Answers every request with a short body, like /pprof/cmdline
+class FixedRequestHandler: public HttpRequestHandler {
+public:
+	unique_ptr<HttpResponse> handleRequest(const HttpRequest& request) {
+		unique_ptr<HttpResponse> response(new HttpResponse());
+		response->setContentType(HttpResponse::CONTENT_TYPE_TEXT);
+		response->content = "/usr/local/bin/server\n--port=8080\n";
+		return response;
+	}
+};
+
+// One client: a persistent connection issuing GETs back-to-back, recording each request's latency
+static void runLoadClient(const string& port, double duration, vector<double> * latencies) {
+	boost::asio::io_service io_service;
+	boost::asio::ip::tcp::resolver resolver(io_service);
+	boost::asio::ip::tcp::resolver::iterator endpoints = resolver.resolve(boost::asio::ip::tcp::resolver::query("127.0.0.1", port));
+	boost::asio::ip::tcp::socket socket(io_service);
+
+	const string request = "GET /pprof/cmdline HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	boost::asio::streambuf response;
+
+	double end = now() + duration;
+	while (true) {
+		double start = now();
+		if (start >= end) {
+			break;
+		}
+
+		if (!socket.is_open()) {
+			boost::asio::connect(socket, endpoints);
+			socket.set_option(boost::asio::ip::tcp::no_delay(true));
+		}
+
+		boost::asio::write(socket, boost::asio::buffer(request));
+
+		size_t headerLength = boost::asio::read_until(socket, response, "\r\n\r\n");
+		string header(boost::asio::buffers_begin(response.data()), boost::asio::buffers_begin(response.data()) + headerLength);
+		response.consume(headerLength);
+
+		size_t contentLength = 0;
+		size_t pos = header.find("Content-Length: ");
+		if (pos != string::npos) {
+			contentLength = boost::lexical_cast<size_t>(header.substr(pos + 16, header.find("\r\n", pos) - pos - 16));
+		}
+		if (response.size() < contentLength) {
+			boost::asio::read(socket, response, boost::asio::transfer_exactly(contentLength - response.size()));
+		}
+		response.consume(contentLength);
+
+		if (header.find("Connection: close") != string::npos) {
+			// The server reached its per-connection request limit
+			socket.close();
+		}
+
+		latencies->push_back(now() - start);
+	}
+}
+
+static void loadTestServer(HttpServer::threading_model model, const char * label, const string& port, size_t serverThreads, size_t clients,
+		double duration) {
+	shared_ptr<HttpServer> server;
+	{
+		unique_ptr<HttpRequestHandler> handler(new FixedRequestHandler());
+		server.reset(new HttpServer("127.0.0.1", port, move(handler), serverThreads, model));
+	}
+	server->RunAsync();
+
+	vector<vector<double> > latencies(clients);
+	boost::thread_group threads;
+	for (size_t i = 0; i < clients; i++) {
+		threads.create_thread(boost::bind(&runLoadClient, port, duration, &latencies[i]));
+	}
+	threads.join_all();
+
+	server->Stop();
+	server->WaitForExit();
+
+	vector<double> all;
+	for (size_t i = 0; i < clients; i++) {
+		all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+	}
+	sort(all.begin(), all.end());
+
+	double p50 = all.empty() ? 0 : all[all.size() / 2];
+	double p99 = all.empty() ? 0 : all[(all.size() * 99) / 100];
+	cout << label << ": " << serverThreads << " threads, " << clients << " clients: "
+			<< (all.size() / duration) << " requests/sec,"
+			<< " p50 " << (p50 * 1e6) << " us,"
+			<< " p99 " << (p99 * 1e6) << " us" << endl;
+}
+
+void LoadTestHttpServer() {
+	size_t serverThreads = max(1u, boost::thread::hardware_concurrency() / 2);
+	size_t clients[] = { 1, 8, 64 };
+	double duration = 3.0;
+
+	// Each run gets its own port, so we don't wait on sockets from the previous run
+	int port = 18088;
+	for (size_t i = 0; i < sizeof(clients) / sizeof(clients[0]); i++) {
+		loadTestServer(HttpServer::shared_pool, "shared_pool", boost::lexical_cast<string>(port++), serverThreads, clients[i], duration);
+		loadTestServer(HttpServer::io_service_per_core, "io_service_per_core", boost::lexical_cast<string>(port++), serverThreads, clients[i], duration);
+	}
+}
+
+int main(int argc, char ** argv) {
+	if (argc > 1 && string(argv[1]) == "benchmark-parse") {
+		BenchmarkHttpRequestParser();
+		return 0;
+	}
+	if (argc > 1 && string(argv[1]) == "load-test") {
+		LoadTestHttpServer();
+		return 0;
+	}
+
+	TestHttpRequestParser();
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+// See COPYRIGHT for copyright
+#ifndef TESTMAIN_H_
+#define TESTMAIN_H_
+
+
+#endif /* TESTMAIN_H_ */
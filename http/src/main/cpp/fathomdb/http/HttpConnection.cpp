@@ -1,7 +1,10 @@
 // See COPYRIGHT file for copyright information
 #include "HttpConnection.h"
 
+#include <errno.h>
+#include <string.h>
 #include <vector>
+#include <sstream>
 #include <boost/bind.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/placeholders.hpp>
@@ -9,14 +12,18 @@
 
 #include "HttpRequestHandler.h"
 #include "HttpException.h"
+#include "HttpServer.h"
+#include "HttpWorkerPool.h"
 #include <glog/logging.h>
 #include <boost/asio.hpp>
 
 namespace fathomdb {
 namespace http {
 
-HttpConnection::HttpConnection(shared_ptr<HttpServer> server, boost::asio::io_service& io_service, HttpRequestHandler& handler) :
-	server_(server), strand_(io_service), socket_(io_service), request_handler_(handler) {
+HttpConnection::HttpConnection(shared_ptr<HttpServer> server, boost::asio::io_service& io_service, HttpRequestHandler& handler, bool useStrand) :
+	server_(server), io_service_(io_service), strand_(useStrand ? new boost::asio::io_service::strand(io_service) : NULL), socket_(io_service), request_handler_(handler), buffer_start_(0), buffer_end_(0), idle_timer_(io_service),
+			idle_timeout_ms_(server->keepAliveTimeout()), request_count_(0), max_requests_(server->maxRequestsPerConnection()), keep_alive_(true),
+			chunked_(false), body_complete_(false), body_sent_(0) {
 }
 
 boost::asio::ip::tcp::socket& HttpConnection::socket() {
@@ -28,8 +35,39 @@ template<class T> T * get_pointer(std::shared_ptr<T> const& p) {
 }
 
 void HttpConnection::start() {
-	socket_.async_read_some(boost::asio::buffer(buffer_), strand_.wrap(boost::bind(&HttpConnection::handle_read, shared_from_this(), boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred)));
+	startRead();
+}
+
+void HttpConnection::startRead() {
+	// Re-arming the timer cancels any previous wait
+	idle_timer_.expires_from_now(boost::posix_time::milliseconds(idle_timeout_ms_));
+	auto timeoutHandler = boost::bind(&HttpConnection::handleIdleTimeout, shared_from_this(), boost::asio::placeholders::error);
+	auto readHandler = boost::bind(&HttpConnection::handle_read, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred);
+
+	if (strand_) {
+		idle_timer_.async_wait(strand_->wrap(timeoutHandler));
+		socket_.async_read_some(boost::asio::buffer(buffer_), strand_->wrap(readHandler));
+	} else {
+		idle_timer_.async_wait(timeoutHandler);
+		socket_.async_read_some(boost::asio::buffer(buffer_), readHandler);
+	}
+}
+
+void HttpConnection::handleIdleTimeout(const boost::system::error_code& e) {
+	if (e == boost::asio::error::operation_aborted) {
+		// Timer was cancelled or re-armed
+		return;
+	}
+
+	if (idle_timer_.expires_at() > boost::asio::deadline_timer::traits_type::now()) {
+		// Re-armed after this handler was queued
+		return;
+	}
+
+	// Closing the socket aborts the pending read, which releases the connection
+	boost::system::error_code ignored_ec;
+	socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+	socket_.close(ignored_ec);
 }
 
 // Helper class that handles an (async) sleep during an HTTP call, used by profiler
@@ -51,22 +89,12 @@ public:
 
 void HttpConnection::handle_read(const boost::system::error_code& e, size_t bytes_transferred) {
 	if (!e) {
-		boost::tribool result;
-		boost::tie(result, boost::tuples::ignore) = request_parser_.parse(request_, buffer_.data(), buffer_.data() + bytes_transferred);
+		idle_timer_.cancel();
 
-		if (result || !result) {
-			if (result) {
-				buildReply(false);
-			}
-			if (!result) {
-				reply_ = HttpResponse::stock_reply(HttpResponse::status_type::bad_request);
-			}
+		buffer_start_ = 0;
+		buffer_end_ = bytes_transferred;
 
-			sendReply();
-		} else {
-			socket_.async_read_some(boost::asio::buffer(buffer_), strand_.wrap(boost::bind(&HttpConnection::handle_read, shared_from_this(), boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred)));
-		}
+		processBuffer();
 	}
 
 	// If an error occurs then no new asynchronous operations are started. This
@@ -75,53 +103,257 @@ void HttpConnection::handle_read(const boost::system::error_code& e, size_t byte
 	// handler returns. The connection class's destructor closes the socket.
 }
 
+void HttpConnection::processBuffer() {
+	boost::tribool result;
+	char * consumed;
+	boost::tie(result, consumed) = request_parser_.parse(request_, buffer_.data() + buffer_start_, buffer_.data() + buffer_end_);
+	buffer_start_ = consumed - buffer_.data();
+
+	if (result || !result) {
+		if (result) {
+			buildReply(false);
+		}
+		if (!result) {
+			// We can't find the start of the next request, so we must close
+			keep_alive_ = false;
+			reply_ = HttpResponse::stock_reply(HttpResponse::status_type::bad_request);
+		}
+
+		sendReply();
+	} else {
+		startRead();
+	}
+}
+
 void HttpConnection::handle_write(const boost::system::error_code& e) {
-	if (!e) {
+	if (e) {
+		// No new asynchronous operations are started. This means that all shared_ptr
+		// references to the connection object will disappear and the object will be
+		// destroyed automatically after this handler returns. The connection class's
+		// destructor closes the socket.
+		return;
+	}
+
+	if (reply_->body && !body_complete_) {
+		writeBodyBlock();
+		return;
+	}
+
+	if (!keep_alive_) {
 		// Initiate graceful connection closure.
 		boost::system::error_code ignored_ec;
 		socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+		return;
 	}
 
-	// No new asynchronous operations are started. This means that all shared_ptr
-	// references to the connection object will disappear and the object will be
-	// destroyed automatically after this handler returns. The connection class's
-	// destructor closes the socket.
+	reply_.reset();
+	request_.reset();
+	request_parser_.reset();
+	body_complete_ = false;
+	body_sent_ = 0;
+
+	if (buffer_start_ < buffer_end_) {
+		// The client pipelined another request behind the one we just answered
+		processBuffer();
+	} else {
+		startRead();
+	}
 }
 
-void HttpConnection::buildReply(bool continuation) {
+// Calls into handler code, turning any exception into an error response
+template<class F>
+static unique_ptr<HttpResponse> invokeHandler(F f) {
 	try {
-		if (continuation) {
-			reply_ = request_handler_.resumeRequest(request_, *reply_);
-		} else {
-			reply_ = request_handler_.handleRequest(request_);
-		}
+		return f();
 	} catch (HttpException& e) {
-		reply_ = HttpResponse::stock_reply(e.statusCode());
+		return HttpResponse::stock_reply(e.statusCode());
 	} catch (exception& e) {
 		LOG(WARNING) << "Unexpected internal error: " << e.what();
-		reply_ = HttpResponse::stock_reply(HttpResponse::status_type::internal_server_error);
+		return HttpResponse::stock_reply(HttpResponse::status_type::internal_server_error);
 	} catch (...) {
 		LOG(WARNING) << "Unknown internal error";
-		reply_ = HttpResponse::stock_reply(HttpResponse::status_type::internal_server_error);
+		return HttpResponse::stock_reply(HttpResponse::status_type::internal_server_error);
+	}
+}
+
+void HttpConnection::buildReply(bool continuation) {
+	if (continuation) {
+		reply_ = invokeHandler([this]() {
+			return request_handler_.resumeRequest(request_, *reply_);
+		});
+	} else {
+		reply_ = invokeHandler([this]() {
+			return request_handler_.handleRequest(request_);
+		});
 	}
 }
 
 void HttpConnection::sendReply() {
 	if (reply_->isSpecial()) {
 		if (reply_->isSleep()) {
-			shared_ptr<SleepHandler> sleepHandler(new SleepHandler(strand_.get_io_service()));
+			shared_ptr<SleepHandler> sleepHandler(new SleepHandler(io_service_));
 
-			sleepHandler->async_wait(boost::posix_time::milliseconds(reply_->sleepMilliseconds()), strand_.wrap(boost::bind(&HttpConnection::handleWaitComplete, shared_from_this(),
-					boost::asio::placeholders::error, sleepHandler)));
+			boost::posix_time::milliseconds delay(reply_->sleepMilliseconds());
+			auto waitHandler = boost::bind(&HttpConnection::handleWaitComplete, shared_from_this(), boost::asio::placeholders::error, sleepHandler);
+			if (strand_) {
+				sleepHandler->async_wait(delay, strand_->wrap(waitHandler));
+			} else {
+				sleepHandler->async_wait(delay, waitHandler);
+			}
+		} else if (reply_->isDeferred()) {
+			// Nothing else touches this connection until the worker posts back
+			if (!server_->workerPool().submit(boost::bind(&HttpConnection::runDeferred, shared_from_this()))) {
+				LOG(WARNING) << "Worker pool is full; rejecting request";
+				reply_ = HttpResponse::stock_reply(HttpResponse::status_type::service_unavailable);
+				sendReply();
+			}
 		} else {
 			CHECK(false)<< "Unhandled special reply";
 		}
 	}
 	else
 	{
-		reply_->finalize();
-		boost::asio::async_write(socket_, reply_->to_buffers(), strand_.wrap(boost::bind(&HttpConnection::handle_write, shared_from_this(), boost::asio::placeholders::error)));
+		request_count_++;
+		keep_alive_ = keep_alive_ && request_.isKeepAlive() && request_count_ < max_requests_;
+
+		// HTTP/1.0 clients don't understand chunking; for them the end of the body is the end of the connection
+		bool http11 = request_.http_version_major > 1 || (request_.http_version_major == 1 && request_.http_version_minor >= 1);
+		chunked_ = reply_->needsChunking() && http11;
+		if (reply_->needsChunking() && !chunked_) {
+			keep_alive_ = false;
+		}
+
+		reply_->setUniqueHeader("Connection", keep_alive_ ? "keep-alive" : "close");
+
+		reply_->finalize(chunked_);
+		auto writeHandler = boost::bind(&HttpConnection::handle_write, shared_from_this(), boost::asio::placeholders::error);
+		if (strand_) {
+			boost::asio::async_write(socket_, reply_->to_buffers(), strand_->wrap(writeHandler));
+		} else {
+			boost::asio::async_write(socket_, reply_->to_buffers(), writeHandler);
+		}
+	}
+}
+
+namespace misc_strings {
+
+const char crlf[] = { '\r', '\n' };
+const char last_chunk[] = { '0', '\r', '\n', '\r', '\n' };
+
+} // namespace misc_strings
+
+void HttpConnection::writeBodyBlock() {
+	if (!chunked_ && sendFileBlock()) {
+		return;
+	}
+
+	if (body_buffer_.empty()) {
+		body_buffer_.resize(BODY_BLOCK_SIZE);
+	}
+
+	size_t n;
+	try {
+		n = reply_->body->read(&body_buffer_[0], body_buffer_.size());
+	} catch (exception& e) {
+		// The headers are already out, so all we can do is drop the connection
+		LOG(WARNING) << "Error streaming response body: " << e.what();
+		boost::system::error_code ignored_ec;
+		socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+		return;
+	}
+
+	vector<boost::asio::const_buffer> buffers;
+	if (n == 0) {
+		body_complete_ = true;
+
+		int64_t length = reply_->body->length();
+		if (length >= 0 && body_sent_ != length) {
+			LOG(WARNING) << "Response body ended early: sent " << body_sent_ << " of " << length;
+			keep_alive_ = false;
+		}
+
+		if (!chunked_) {
+			handle_write(boost::system::error_code());
+			return;
+		}
+		buffers.push_back(boost::asio::buffer(misc_strings::last_chunk));
+	} else {
+		body_sent_ += n;
+		if (chunked_) {
+			ostringstream s;
+			s << hex << n << "\r\n";
+			chunk_header_ = s.str();
+			buffers.push_back(boost::asio::buffer(chunk_header_));
+			buffers.push_back(boost::asio::buffer(&body_buffer_[0], n));
+			buffers.push_back(boost::asio::buffer(misc_strings::crlf));
+		} else {
+			buffers.push_back(boost::asio::buffer(&body_buffer_[0], n));
+		}
 	}
+
+	auto writeHandler = boost::bind(&HttpConnection::handle_write, shared_from_this(), boost::asio::placeholders::error);
+	if (strand_) {
+		boost::asio::async_write(socket_, buffers, strand_->wrap(writeHandler));
+	} else {
+		boost::asio::async_write(socket_, buffers, writeHandler);
+	}
+}
+
+bool HttpConnection::sendFileBlock() {
+	boost::system::error_code ec;
+	socket_.native_non_blocking(true, ec);
+	if (ec) {
+		return false;
+	}
+
+	ssize_t sent = reply_->body->sendFile(socket_.native_handle(), SENDFILE_BLOCK_SIZE);
+	if (sent == 0) {
+		return false;
+	}
+
+	if (sent < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			LOG(WARNING) << "Error in sendfile: " << strerror(errno);
+			boost::system::error_code ignored_ec;
+			socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+			return true;
+		}
+	} else {
+		body_sent_ += sent;
+	}
+
+	// Wait until the socket can take more (immediately, if it isn't full); this also lets other
+	// connections on this thread make progress between blocks
+	auto writableHandler = boost::bind(&HttpConnection::handleSocketWritable, shared_from_this(), boost::asio::placeholders::error);
+	if (strand_) {
+		socket_.async_write_some(boost::asio::null_buffers(), strand_->wrap(writableHandler));
+	} else {
+		socket_.async_write_some(boost::asio::null_buffers(), writableHandler);
+	}
+	return true;
+}
+
+void HttpConnection::handleSocketWritable(const boost::system::error_code& e) {
+	if (!e) {
+		writeBodyBlock();
+	}
+}
+
+void HttpConnection::runDeferred() {
+	reply_ = invokeHandler([this]() {
+		return reply_->runDeferred();
+	});
+
+	auto completeHandler = boost::bind(&HttpConnection::handleDeferredComplete, shared_from_this());
+	if (strand_) {
+		strand_->post(completeHandler);
+	} else {
+		io_service_.post(completeHandler);
+	}
+}
+
+void HttpConnection::handleDeferredComplete() {
+	sendReply();
 }
 
 void HttpConnection::handleWaitComplete(const boost::system::error_code& e, shared_ptr<SleepHandler> sleepHandler) {
@@ -9,6 +9,7 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/deadline_timer.hpp>
 
 #include "HttpRequest.h"
 #include "HttpRequestParser.h"
@@ -24,7 +25,8 @@ class SleepHandler;
 class HttpConnection: public enable_shared_from_this<HttpConnection> , private boost::noncopyable {
 public:
 	/// Construct a connection with the given io_service.
-	explicit HttpConnection(shared_ptr<HttpServer> server, boost::asio::io_service& io_service, HttpRequestHandler& handler);
+	/// A strand is only needed if more than one thread runs the io_service.
+	explicit HttpConnection(shared_ptr<HttpServer> server, boost::asio::io_service& io_service, HttpRequestHandler& handler, bool useStrand = true);
 
 	/// Get the socket associated with the connection.
 	boost::asio::ip::tcp::socket& socket();
@@ -33,22 +35,49 @@ public:
 	void start();
 
 private:
+	/// Read more data from the socket, closing the connection if nothing arrives before the idle timeout.
+	void startRead();
+
+	/// Parse the unconsumed part of buffer_; replies if a request is complete, otherwise reads more.
+	void processBuffer();
+
 	/// Handle completion of a read operation.
 	void handle_read(const boost::system::error_code& e, std::size_t bytes_transferred);
 
 	/// Handle completion of a write operation.
 	void handle_write(const boost::system::error_code& e);
 
+	/// Write the next block of a streamed response body.
+	void writeBodyBlock();
+
+	/// Send the next part of a streamed body with sendfile; returns false if the body can't use it here.
+	bool sendFileBlock();
+
+	/// Handle the socket becoming writable during sendfile.
+	void handleSocketWritable(const boost::system::error_code& e);
+
+	/// Handle expiry of the idle timer.
+	void handleIdleTimeout(const boost::system::error_code& e);
+
 	void handleWaitComplete(const boost::system::error_code& e, shared_ptr<SleepHandler> sleepHandler);
 
+	/// Runs on a worker thread: executes a DeferredResponse and posts the result back to our io_service.
+	void runDeferred();
+
+	/// Back on the io_service: send the response produced by runDeferred.
+	void handleDeferredComplete();
+
 	void buildReply(bool continuation);
 	void sendReply();
 
 	// Pointer to parent, to keep it alive
 	shared_ptr<HttpServer> server_;
 
+	boost::asio::io_service& io_service_;
+
 	/// Strand to ensure the connection's handlers are not called concurrently.
-	boost::asio::io_service::strand strand_;
+	/// NULL when the io_service is run by a single thread.
+	unique_ptr<boost::asio::io_service::strand> strand_;
 
 	/// Socket for the connection.
 	boost::asio::ip::tcp::socket socket_;
@@ -59,6 +88,34 @@ private:
 	/// Buffer for incoming data.
 	boost::array<char, 8192> buffer_;
 
+	/// The part of buffer_ that has been read but not yet parsed (e.g. a pipelined request).
+	size_t buffer_start_;
+	size_t buffer_end_;
+
+	/// Closes the connection when the client is idle for too long.
+	boost::asio::deadline_timer idle_timer_;
+	int idle_timeout_ms_;
+
+	/// Number of requests we have replied to on this connection, and the limit.
+	size_t request_count_;
+	size_t max_requests_;
+
+	/// Whether the connection stays open after the current reply has been written.
+	bool keep_alive_;
+
+	/// Streaming state for replies with a body source: the block being written, whether we frame it
+	/// in chunks, and how far we have got.
+	vector<char> body_buffer_;
+	string chunk_header_;
+	bool chunked_;
+	bool body_complete_;
+	int64_t body_sent_;
+
+	static const size_t BODY_BLOCK_SIZE = 64 * 1024;
+
+	/// Upper bound on one sendfile() call, so one big download doesn't monopolise the thread.
+	static const size_t SENDFILE_BLOCK_SIZE = 1024 * 1024;
+
 	/// The incoming request.
 	HttpRequest request_;
 
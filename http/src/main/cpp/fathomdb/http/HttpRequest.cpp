@@ -7,6 +7,7 @@
 #include <glog/logging.h>
 #include <algorithm>
 #include <map>
+#include <boost/algorithm/string/predicate.hpp>
 
 namespace fathomdb {
 namespace http {
@@ -79,7 +80,7 @@ multimap<string, string> HttpRequest::parseQueryString() const {
 			eq = sep;
 		}
 
-		string name = query.substr(pos, eq - pos);
+		string name = url_decode(query.substr(pos, eq - pos));
 
 		string value;
 		if (eq == sep) {
@@ -87,7 +88,7 @@ multimap<string, string> HttpRequest::parseQueryString() const {
 		} else {
 			eq++;
 			CHECK(eq <= sep);
-			value = query.substr(eq, sep - eq);
+			value = url_decode(query.substr(eq, sep - eq));
 		}
 
 		map.insert(make_pair(name, value));
@@ -98,6 +99,34 @@ multimap<string, string> HttpRequest::parseQueryString() const {
 	return map;
 }
 
+void HttpRequest::reset() {
+	method.clear();
+	uri.clear();
+	post_data.clear();
+	http_version_major = 0;
+	http_version_minor = 0;
+	headers.clear();
+}
+
+const string * HttpRequest::getHeader(const string& name) const {
+	for (auto it = headers.begin(); it != headers.end(); it++) {
+		if (boost::algorithm::iequals(it->name, name)) {
+			return &it->value;
+		}
+	}
+	return NULL;
+}
+
+bool HttpRequest::isKeepAlive() const {
+	const string * connection = getHeader("Connection");
+
+	if (http_version_major > 1 || (http_version_major == 1 && http_version_minor >= 1)) {
+		return !(connection && boost::algorithm::iequals(*connection, "close"));
+	}
+
+	return connection && boost::algorithm::iequals(*connection, "keep-alive");
+}
+
 string HttpRequest::getRequestPath() const {
 	ParsedUri parsed = parse();
 	return parsed.path;
@@ -27,11 +27,22 @@ public:
 	int http_version_minor;
 	vector<HttpHeader> headers;
 
-	HttpRequest() {
+	HttpRequest() :
+		http_version_major(0), http_version_minor(0) {
 	}
 
+	/// Clear all fields, so the request can be reused for the next request on a persistent connection.
+	void reset();
+
 	string getRequestPath() const;
 
+	/// Returns the value of the first header with the given name (compared case-insensitively), or NULL.
+	const string * getHeader(const string& name) const;
+
+	/// Whether the client wants the connection kept open after this request.
+	/// HTTP/1.1 defaults to keep-alive unless "Connection: close"; HTTP/1.0 requires "Connection: keep-alive".
+	bool isKeepAlive() const;
+
 	string getQueryParameter(const string& key, const string& defaultValue) const;
 	bool getQueryParameter(const string& key, string * dest) const;
 
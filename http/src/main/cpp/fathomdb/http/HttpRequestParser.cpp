@@ -1,6 +1,8 @@
 // See COPYRIGHT file for copyright information
 
 #include "HttpRequestParser.h"
+#include <string.h>
+#include <algorithm>
 #include <boost/logic/tribool.hpp>
 #include "HttpRequest.h"
 #include <boost/lexical_cast.hpp>
@@ -10,237 +12,287 @@ namespace fathomdb {
 namespace http {
 
 using boost::logic::tribool;
+using std::min;
+
+/// The most of a POST body we reserve before it arrives
+static const size_t POST_DATA_RESERVE = 1024 * 1024;
 
 HttpRequestParser::HttpRequestParser() :
-	state_(method_start), postDataLength_(0) {
+	state_(request_head), postDataLength_(0) {
 }
 
 void HttpRequestParser::reset() {
-	state_ = method_start;
+	state_ = request_head;
+	head_.clear();
+	postDataLength_ = 0;
 }
 
-tribool HttpRequestParser::consume(HttpRequest& req, char input) {
-	switch (state_) {
-	case method_start:
-		if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
-			return false;
-		} else {
-			state_ = method;
-			req.method.push_back(input);
-			return boost::indeterminate;
-		}
-	case method:
-		if (input == ' ') {
-			state_ = uri;
-			return boost::indeterminate;
-		} else if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
-			return false;
-		} else {
-			req.method.push_back(input);
-			return boost::indeterminate;
-		}
-	case uri_start:
-		if (is_ctl(input)) {
-			return false;
-		} else {
-			state_ = uri;
-			req.uri.push_back(input);
-			return boost::indeterminate;
+tuple<tribool, char*> HttpRequestParser::parse(HttpRequest& req, char * begin, char * end) {
+	if (state_ == request_head) {
+		const char * headBegin = NULL;
+		const char * headEnd = NULL;
+
+		if (head_.empty()) {
+			// Common case: the whole head arrived in one read, so we parse it where it is
+			headEnd = findHeadEnd(begin, end);
+			if (headEnd && (size_t) (headEnd - begin) > MAX_HEAD_SIZE) {
+				LOG(WARNING) << "Request head too large";
+				return boost::make_tuple(tribool(false), begin);
+			}
+			if (headEnd) {
+				headBegin = begin;
+				begin += headEnd - headBegin;
+			}
 		}
-	case uri:
-		if (input == ' ') {
-			state_ = http_version_h;
-			return boost::indeterminate;
-		} else if (is_ctl(input)) {
-			return false;
-		} else {
-			req.uri.push_back(input);
-			return boost::indeterminate;
+
+		if (!headEnd) {
+			size_t previous = head_.size();
+
+			// Where the head ends in this read, if it does; we've already looked, if this is its first read
+			const char * headEndInRead = NULL;
+			if (previous != 0) {
+				// The blank line may straddle the previous read
+				char seam[6];
+				size_t carried = min(previous, (size_t) 3);
+				size_t leading = min((size_t) (end - begin), (size_t) 3);
+				memcpy(seam, head_.data() + previous - carried, carried);
+				memcpy(seam + carried, begin, leading);
+				const char * seamEnd = findHeadEnd(seam, seam + carried + leading);
+				if (seamEnd) {
+					headEndInRead = begin + (seamEnd - seam - carried);
+				} else {
+					headEndInRead = findHeadEnd(begin, end);
+				}
+			}
+
+			// Anything after the head is the body (or the next request), so doesn't count towards its size
+			size_t headBytes = headEndInRead ? headEndInRead - begin : end - begin;
+			if (previous + headBytes > MAX_HEAD_SIZE) {
+				LOG(WARNING) << "Request head too large";
+				return boost::make_tuple(tribool(false), begin);
+			}
+			head_.append(begin, headBytes);
+			if (!headEndInRead) {
+				return boost::make_tuple(tribool(boost::indeterminate), end);
+			}
+
+			headBegin = head_.data();
+			headEnd = headBegin + head_.size();
+			begin += headBytes;
 		}
-	case http_version_h:
-		if (input == 'H') {
-			state_ = http_version_t_1;
-			return boost::indeterminate;
-		} else {
-			return false;
+
+		tribool result = parseHead(req, headBegin, headEnd);
+		head_.clear();
+		if (result || !result) {
+			return boost::make_tuple(result, begin);
 		}
-	case http_version_t_1:
-		if (input == 'T') {
-			state_ = http_version_t_2;
-			return boost::indeterminate;
-		} else {
-			return false;
+	}
+
+	if (state_ == post_data) {
+		size_t remaining = postDataLength_ - req.post_data.size();
+		size_t available = end - begin;
+		size_t n = available < remaining ? available : remaining;
+
+		req.post_data.append(begin, n);
+		begin += n;
+
+		if (req.post_data.size() == postDataLength_) {
+			return boost::make_tuple(tribool(true), begin);
 		}
-	case http_version_t_2:
-		if (input == 'T') {
-			state_ = http_version_p;
-			return boost::indeterminate;
-		} else {
-			return false;
+		return boost::make_tuple(tribool(boost::indeterminate), begin);
+	}
+
+	return boost::make_tuple(tribool(false), begin);
+}
+
+const char * HttpRequestParser::findHeadEnd(const char * begin, const char * end) {
+	const char * p = begin;
+	while (p < end) {
+		p = (const char *) memchr(p, '\n', end - p);
+		if (!p) {
+			return NULL;
 		}
-	case http_version_p:
-		if (input == 'P') {
-			state_ = http_version_slash;
-			return boost::indeterminate;
-		} else {
-			return false;
+
+		// Looking for \r\n\r\n, with p on the second \n
+		if (p - begin >= 3 && p[-1] == '\r' && p[-2] == '\n' && p[-3] == '\r') {
+			return p + 1;
 		}
-	case http_version_slash:
-		if (input == '/') {
-			req.http_version_major = 0;
-			req.http_version_minor = 0;
-			state_ = http_version_major_start;
-			return boost::indeterminate;
-		} else {
+		p++;
+	}
+	return NULL;
+}
+
+tribool HttpRequestParser::parseHead(HttpRequest& req, const char * begin, const char * end) {
+	// Every line ends with \r\n; the head ends with an empty line
+	const char * lineEnd = (const char *) memchr(begin, '\r', end - begin);
+	if (lineEnd[1] != '\n') {
+		return false;
+	}
+	if (!parseRequestLine(req, begin, lineEnd)) {
+		return false;
+	}
+
+	const char * p = lineEnd + 2;
+	while (true) {
+		lineEnd = (const char *) memchr(p, '\r', end - p);
+		if (lineEnd[1] != '\n') {
 			return false;
 		}
-	case http_version_major_start:
-		if (is_digit(input)) {
-			req.http_version_major = req.http_version_major * 10 + input - '0';
-			state_ = http_version_major;
-			return boost::indeterminate;
-		} else {
-			return false;
+
+		if (lineEnd == p) {
+			// Blank line: end of headers
+			break;
 		}
-	case http_version_major:
-		if (input == '.') {
-			state_ = http_version_minor_start;
-			return boost::indeterminate;
-		} else if (is_digit(input)) {
-			req.http_version_major = req.http_version_major * 10 + input - '0';
-			return boost::indeterminate;
+
+		if (*p == ' ' || *p == '\t') {
+			// Continuation of the previous header's value
+			if (req.headers.empty()) {
+				return false;
+			}
+			while (*p == ' ' || *p == '\t') {
+				p++;
+			}
+			if (!is_text(p, lineEnd)) {
+				return false;
+			}
+			req.headers.back().value.append(p, lineEnd);
 		} else {
-			return false;
+			const char * colon = (const char *) memchr(p, ':', lineEnd - p);
+			if (!colon || !is_token(p, colon)) {
+				return false;
+			}
+
+			const char * value = colon + 1;
+			while (value < lineEnd && (*value == ' ' || *value == '\t')) {
+				value++;
+			}
+			if (!is_text(value, lineEnd)) {
+				return false;
+			}
+
+			req.headers.push_back(HttpHeader());
+			HttpHeader& header = req.headers.back();
+			header.name.assign(p, colon);
+			header.value.assign(value, lineEnd);
 		}
-	case http_version_minor_start:
-		if (is_digit(input)) {
-			req.http_version_minor = req.http_version_minor * 10 + input - '0';
-			state_ = http_version_minor;
-			return boost::indeterminate;
-		} else {
+
+		p = lineEnd + 2;
+	}
+
+	if ("POST" == req.method) {
+		const string * contentLengthHeader = req.getHeader("Content-Length");
+		if (!contentLengthHeader) {
+			LOG(WARNING) << "Content-Length header not found in POST";
 			return false;
 		}
-	case http_version_minor:
-		if (input == '\r') {
-			state_ = expecting_newline_1;
-			return boost::indeterminate;
-		} else if (is_digit(input)) {
-			req.http_version_minor = req.http_version_minor * 10 + input - '0';
-			return boost::indeterminate;
-		} else {
-			return false;
+
+		// Only digits: lexical_cast would wrap "-1" round to a huge length
+		const string& value = *contentLengthHeader;
+		size_t contentLength = 0;
+		bool valid = !value.empty() && value.size() <= 20;
+		for (size_t i = 0; valid && i < value.size(); i++) {
+			valid = is_digit(value[i]);
 		}
-	case expecting_newline_1:
-		if (input == '\n') {
-			state_ = header_line_start;
-			return boost::indeterminate;
-		} else {
-			return false;
+		if (valid) {
+			try {
+				contentLength = boost::lexical_cast<size_t>(value);
+			} catch (boost::bad_lexical_cast& blc) {
+				valid = false;
+			}
 		}
-	case header_line_start:
-		if (input == '\r') {
-			state_ = expecting_newline_3;
-			return boost::indeterminate;
-		} else if (!req.headers.empty() && (input == ' ' || input == '\t')) {
-			state_ = header_lws;
-			return boost::indeterminate;
-		} else if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
+		if (!valid) {
+			LOG(WARNING) << "Invalid Content-Length value in POST: " << value;
 			return false;
-		} else {
-			req.headers.push_back(HttpHeader());
-			req.headers.back().name.push_back(input);
-			state_ = header_name;
-			return boost::indeterminate;
 		}
-	case header_lws:
-		if (input == '\r') {
-			state_ = expecting_newline_2;
-			return boost::indeterminate;
-		} else if (input == ' ' || input == '\t') {
-			return boost::indeterminate;
-		} else if (is_ctl(input)) {
+		if (contentLength > MAX_CONTENT_LENGTH) {
+			LOG(WARNING) << "POST too large: " << contentLength;
 			return false;
-		} else {
-			state_ = header_value;
-			req.headers.back().value.push_back(input);
-			return boost::indeterminate;
 		}
-	case header_name:
-		if (input == ':') {
-			state_ = space_before_header_value;
+
+		postDataLength_ = contentLength;
+		if (contentLength != 0) {
+			// Don't take the client's word for how much memory to set aside up front
+			req.post_data.reserve(min(contentLength, POST_DATA_RESERVE));
+			state_ = post_data;
 			return boost::indeterminate;
-		} else if (!is_char(input) || is_ctl(input) || is_tspecial(input)) {
-			return false;
 		} else {
-			req.headers.back().name.push_back(input);
-			return boost::indeterminate;
+			// Don't wait for data that is never coming!
+			return true;
 		}
-	case space_before_header_value:
-		if (input == ' ') {
-			state_ = header_value;
-			return boost::indeterminate;
-		} else {
+	}
+
+	return true;
+}
+
+bool HttpRequestParser::parseRequestLine(HttpRequest& req, const char * begin, const char * end) {
+	const char * methodEnd = (const char *) memchr(begin, ' ', end - begin);
+	if (!methodEnd || !is_token(begin, methodEnd)) {
+		return false;
+	}
+
+	const char * uri = methodEnd + 1;
+	const char * uriEnd = (const char *) memchr(uri, ' ', end - uri);
+	if (!uriEnd || uriEnd == uri) {
+		return false;
+	}
+	for (const char * p = uri; p != uriEnd; p++) {
+		if (is_ctl(*p)) {
 			return false;
 		}
-	case header_value:
-		if (input == '\r') {
-			state_ = expecting_newline_2;
-			return boost::indeterminate;
-		} else if (is_ctl(input)) {
+	}
+
+	// HTTP/<major>.<minor>
+	const char * p = uriEnd + 1;
+	if (end - p < 8 || memcmp(p, "HTTP/", 5) != 0) {
+		return false;
+	}
+	p += 5;
+
+	int major = 0;
+	const char * digits = p;
+	while (p < end && is_digit(*p)) {
+		major = major * 10 + (*p++ - '0');
+	}
+	if (p == digits || p == end || *p++ != '.') {
+		return false;
+	}
+
+	int minor = 0;
+	digits = p;
+	while (p < end && is_digit(*p)) {
+		minor = minor * 10 + (*p++ - '0');
+	}
+	if (p == digits || p != end) {
+		return false;
+	}
+
+	req.method.assign(begin, methodEnd);
+	req.uri.assign(uri, uriEnd);
+	req.http_version_major = major;
+	req.http_version_minor = minor;
+	return true;
+}
+
+bool HttpRequestParser::is_token(const char * begin, const char * end) {
+	if (begin == end) {
+		return false;
+	}
+	for (const char * p = begin; p != end; p++) {
+		int c = *p;
+		if (!is_char(c) || is_ctl(c) || is_tspecial(c)) {
 			return false;
-		} else {
-			req.headers.back().value.push_back(input);
-			return boost::indeterminate;
 		}
-	case expecting_newline_2:
-		if (input == '\n') {
-			state_ = header_line_start;
-			return boost::indeterminate;
-		} else {
+	}
+	return true;
+}
+
+bool HttpRequestParser::is_text(const char * begin, const char * end) {
+	for (const char * p = begin; p != end; p++) {
+		if (is_ctl(*p) && *p != '\t') {
 			return false;
 		}
-	case expecting_newline_3:
-		if (input == '\n') {
-			if ("POST" == req.method) {
-				size_t contentLength = 0;
-				bool found = false;
-				for (auto it = req.headers.begin(); it != req.headers.end(); it++) {
-					if ("Content-Length" == it->name) {
-						try {
-							contentLength = boost::lexical_cast<size_t>(it->value);
-							found = true;
-							break;
-						} catch (boost::bad_lexical_cast& blc) {
-							LOG(WARNING) << "Invalid Content-Length value in POST: " << it->value;
-							return false;
-						}
-					}
-				}
-				if (!found) {
-					LOG(WARNING) << "Content-Length header not found or negative value in POST: " << contentLength;
-					return false;
-				}
-				postDataLength_ = contentLength;
-				if (contentLength != 0) {
-					req.post_data.reserve(contentLength);
-					state_ = post_data;
-					return boost::indeterminate;
-				} else {
-					// Don't wait for data that is never coming!
-					return true;
-				}
-			}
-			return true;
-		}
-	case post_data:
-		req.post_data.push_back(input);
-		if (req.post_data.size() == postDataLength_) {
-			return true;
-		}
-		return boost::indeterminate;
-	default:
-		return false;
 	}
+	return true;
 }
 
 bool HttpRequestParser::is_char(int c) {
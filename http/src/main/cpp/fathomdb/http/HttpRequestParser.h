@@ -3,6 +3,8 @@
 #ifndef HTTPREQUESTPARSER_H_
 #define HTTPREQUESTPARSER_H_
 
+#include <string>
+
 #include <boost/logic/tribool.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -10,10 +12,15 @@ namespace fathomdb {
 namespace http {
 using boost::logic::tribool;
 using boost::tuples::tuple;
+using std::string;
 
 class HttpRequest;
 
 /// Parser for incoming requests.
+///
+/// The request head (request line and headers) is located by scanning for the blank line with memchr;
+/// each field is then copied out in one piece.  If the head arrives in several reads it is accumulated
+/// in head_, otherwise it is parsed in place.  POST bodies are appended in a single copy per read.
 class HttpRequestParser {
 public:
 	/// Construct ready to parse the request method.
@@ -24,22 +31,31 @@ public:
 
 	/// Parse some data. The tribool return value is true when a complete request
 	/// has been parsed, false if the data is invalid, indeterminate when more
-	/// data is required. The InputIterator return value indicates how much of the
+	/// data is required. The pointer return value indicates how much of the
 	/// input has been consumed.
-	template<typename InputIterator>
-	tuple<tribool, InputIterator> parse(HttpRequest& req, InputIterator begin, InputIterator end) {
-		while (begin != end) {
-			boost::tribool result = consume(req, *begin++);
-			if (result || !result)
-				return boost::make_tuple(result, begin);
-		}
-		boost::tribool result = boost::indeterminate;
-		return boost::make_tuple(result, begin);
-	}
+	tuple<tribool, char*> parse(HttpRequest& req, char * begin, char * end);
+
+	/// Requests with a longer head than this are rejected.
+	static const size_t MAX_HEAD_SIZE = 64 * 1024;
+
+	/// POSTs with a longer body than this are rejected.
+	static const size_t MAX_CONTENT_LENGTH = 256 * 1024 * 1024;
 
 private:
-	/// Handle the next character of input.
-	tribool consume(HttpRequest& req, char input);
+	/// Find the blank line that ends the request head; returns a pointer just past it, or NULL.
+	static const char * findHeadEnd(const char * begin, const char * end);
+
+	/// Parse a complete request head, [begin, end) ending with the blank line.
+	tribool parseHead(HttpRequest& req, const char * begin, const char * end);
+
+	/// Parse the "METHOD URI HTTP/x.y" line.
+	static bool parseRequestLine(HttpRequest& req, const char * begin, const char * end);
+
+	/// Check that [begin, end) is a non-empty HTTP token.
+	static bool is_token(const char * begin, const char * end);
+
+	/// Check that [begin, end) contains no control characters (tab is allowed).
+	static bool is_text(const char * begin, const char * end);
 
 	/// Check if a byte is an HTTP character.
 	static bool is_char(int c);
@@ -55,30 +71,13 @@ private:
 
 	/// The current state of the parser.
 	enum state {
-		method_start,
-		method,
-		uri_start,
-		uri,
-		http_version_h,
-		http_version_t_1,
-		http_version_t_2,
-		http_version_p,
-		http_version_slash,
-		http_version_major_start,
-		http_version_major,
-		http_version_minor_start,
-		http_version_minor,
-		expecting_newline_1,
-		header_line_start,
-		header_lws,
-		header_name,
-		space_before_header_value,
-		header_value,
-		expecting_newline_2,
-		expecting_newline_3,
+		request_head,
 		post_data
 	} state_;
 
+	/// Part of the request head received so far, when it spans several reads.
+	string head_;
+
 	size_t postDataLength_;
 };
 
@@ -12,22 +12,22 @@ namespace http {
 
 namespace status_strings {
 
-const string ok = "HTTP/1.0 200 OK\r\n";
-const string created = "HTTP/1.0 201 Created\r\n";
-const string accepted = "HTTP/1.0 202 Accepted\r\n";
-const string no_content = "HTTP/1.0 204 No Content\r\n";
-const string multiple_choices = "HTTP/1.0 300 Multiple Choices\r\n";
-const string moved_permanently = "HTTP/1.0 301 Moved Permanently\r\n";
-const string moved_temporarily = "HTTP/1.0 302 Moved Temporarily\r\n";
-const string not_modified = "HTTP/1.0 304 Not Modified\r\n";
-const string bad_request = "HTTP/1.0 400 Bad Request\r\n";
-const string unauthorized = "HTTP/1.0 401 Unauthorized\r\n";
-const string forbidden = "HTTP/1.0 403 Forbidden\r\n";
-const string not_found = "HTTP/1.0 404 Not Found\r\n";
-const string internal_server_error = "HTTP/1.0 500 Internal Server Error\r\n";
-const string not_implemented = "HTTP/1.0 501 Not Implemented\r\n";
-const string bad_gateway = "HTTP/1.0 502 Bad Gateway\r\n";
-const string service_unavailable = "HTTP/1.0 503 Service Unavailable\r\n";
+const string ok = "HTTP/1.1 200 OK\r\n";
+const string created = "HTTP/1.1 201 Created\r\n";
+const string accepted = "HTTP/1.1 202 Accepted\r\n";
+const string no_content = "HTTP/1.1 204 No Content\r\n";
+const string multiple_choices = "HTTP/1.1 300 Multiple Choices\r\n";
+const string moved_permanently = "HTTP/1.1 301 Moved Permanently\r\n";
+const string moved_temporarily = "HTTP/1.1 302 Moved Temporarily\r\n";
+const string not_modified = "HTTP/1.1 304 Not Modified\r\n";
+const string bad_request = "HTTP/1.1 400 Bad Request\r\n";
+const string unauthorized = "HTTP/1.1 401 Unauthorized\r\n";
+const string forbidden = "HTTP/1.1 403 Forbidden\r\n";
+const string not_found = "HTTP/1.1 404 Not Found\r\n";
+const string internal_server_error = "HTTP/1.1 500 Internal Server Error\r\n";
+const string not_implemented = "HTTP/1.1 501 Not Implemented\r\n";
+const string bad_gateway = "HTTP/1.1 502 Bad Gateway\r\n";
+const string service_unavailable = "HTTP/1.1 503 Service Unavailable\r\n";
 
 boost::asio::const_buffer to_buffer(HttpResponse::status_type status) {
 	switch (status) {
@@ -88,7 +88,9 @@ vector<boost::asio::const_buffer> HttpResponse::to_buffers() {
 		buffers.push_back(boost::asio::buffer(misc_strings::crlf));
 	}
 	buffers.push_back(boost::asio::buffer(misc_strings::crlf));
-	buffers.push_back(boost::asio::buffer(content));
+	if (!body) {
+		buffers.push_back(boost::asio::buffer(content));
+	}
 	return buffers;
 }
 
@@ -223,8 +225,14 @@ void HttpResponse::setUniqueHeader(const string& name, const string& value) {
 	headers.push_back(HttpHeader(name, value));
 }
 
-void HttpResponse::finalize() {
-	setUniqueHeader("Content-Length", boost::lexical_cast<string>(content.size()));
+void HttpResponse::finalize(bool chunked) {
+	if (!body) {
+		setUniqueHeader("Content-Length", boost::lexical_cast<string>(content.size()));
+	} else if (body->length() >= 0) {
+		setUniqueHeader("Content-Length", boost::lexical_cast<string>(body->length()));
+	} else if (chunked) {
+		setUniqueHeader("Transfer-Encoding", "chunked");
+	}
 }
 
 }
@@ -6,10 +6,12 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <functional>
 
 #include <boost/noncopyable.hpp>
 #include <boost/asio/buffer.hpp>
 #include "HttpHeader.h"
+#include "HttpResponseBody.h"
 #include <stdexcept>
 
 namespace fathomdb {
@@ -45,11 +47,20 @@ public:
 	/// The content to be sent in the reply.
 	string content;
 
+	/// If set, the body is streamed from here and content is ignored.
+	unique_ptr<HttpResponseBody> body;
+
 	/// Convert the reply into a vector of buffers. The buffers do not own the
 	/// underlying memory blocks, therefore the reply object must remain valid and
 	/// not be changed until the write operation has completed.
+	/// For a streamed body, this is just the status line and headers.
 	vector<boost::asio::const_buffer> to_buffers();
 
+	/// Whether the body must be sent chunked: it is streamed and its length isn't known up front.
+	bool needsChunking() const {
+		return body && body->length() < 0;
+	}
+
 	/// Get a stock reply.
 	static unique_ptr<HttpResponse> stock_reply(status_type status);
 
@@ -72,13 +83,24 @@ public:
 		throw invalid_argument("Not a sleep event");
 	}
 
+	virtual bool isDeferred() const {
+		return false;
+	}
+
+	/// Run the deferred work (on a worker thread), producing the real response.
+	virtual unique_ptr<HttpResponse> runDeferred() {
+		throw invalid_argument("Not a deferred response");
+	}
+
 	static constexpr const char * CONTENT_TYPE_HTML = "text/html";
 	static constexpr const char * CONTENT_TYPE_TEXT = "text/plain";
 
 	void setContentType(const string& contentType);
 	void setUniqueHeader(const string& name, const string& value);
 
-	void finalize();
+	/// Set the framing headers. A streamed body of unknown length uses Transfer-Encoding: chunked
+	/// if chunked is true; otherwise it is delimited by closing the connection.
+	void finalize(bool chunked = false);
 };
 
 // A special Response requesting an async sleep
@@ -103,6 +125,35 @@ public:
 	}
 };
 
+// A special Response asking for work to be run on the server's worker pool, off the io threads.
+// The work returns the real response, which may itself be special (e.g. SuspendProcessing).
+// The request remains valid until the response has been sent, so the work can refer to it.
+// If the pool's queue is full, the client gets 503 Service Unavailable.
+class DeferredResponse: public HttpResponse {
+public:
+	typedef function<unique_ptr<HttpResponse>()> work_t;
+
+private:
+	work_t work_;
+
+public:
+	DeferredResponse(const work_t& work) :
+		work_(work) {
+	}
+
+	bool isSpecial() const {
+		return true;
+	}
+
+	bool isDeferred() const {
+		return true;
+	}
+
+	unique_ptr<HttpResponse> runDeferred() {
+		return work_();
+	}
+};
+
 }
 }
 
@@ -0,0 +1,133 @@
+// See COPYRIGHT file for copyright information
+
+#include "HttpResponseBody.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <stdexcept>
+
+#include <glog/logging.h>
+
+namespace fathomdb {
+namespace http {
+
+FileResponseBody::FileResponseBody(const string& path, bool knownLength) :
+	fd_(-1), length_(-1), position_(0) {
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0) {
+		LOG(WARNING) << "Error opening file: " << path << ": " << strerror(errno);
+		throw invalid_argument("Unable to open file");
+	}
+
+	if (knownLength) {
+		struct stat st;
+		if (fstat(fd_, &st) != 0) {
+			LOG(WARNING) << "Error reading size of file: " << path << ": " << strerror(errno);
+			::close(fd_);
+			throw invalid_argument("Unable to stat file");
+		}
+		length_ = st.st_size;
+	}
+}
+
+FileResponseBody::~FileResponseBody() {
+	if (fd_ >= 0) {
+		::close(fd_);
+	}
+}
+
+size_t FileResponseBody::read(char * buffer, size_t max) {
+	if (length_ >= 0) {
+		// Never send more than we promised in Content-Length, even if the file grew
+		int64_t remaining = length_ - position_;
+		if ((int64_t) max > remaining) {
+			max = remaining;
+		}
+		if (max == 0) {
+			return 0;
+		}
+	}
+
+	// sendFile moves position_ but not the file offset, so read from position_ explicitly; after a short
+	// sendfile we carry on where it stopped rather than resending from the start
+	while (true) {
+		ssize_t n = ::pread(fd_, buffer, max, position_);
+		if (n >= 0) {
+			position_ += n;
+			return n;
+		}
+		if (errno != EINTR) {
+			LOG(WARNING) << "Error reading response body: " << strerror(errno);
+			throw runtime_error("Error reading response body");
+		}
+	}
+}
+
+ssize_t FileResponseBody::sendFile(int socketFd, size_t max) {
+	if (length_ < 0) {
+		return 0;
+	}
+
+	int64_t remaining = length_ - position_;
+	if ((int64_t) max > remaining) {
+		max = remaining;
+	}
+	if (max == 0) {
+		return 0;
+	}
+
+	off_t offset = position_;
+	ssize_t n = ::sendfile(socketFd, fd_, &offset, max);
+	if (n > 0) {
+		position_ = offset;
+	}
+	return n;
+}
+
+size_t StringResponseBody::read(char * buffer, size_t max) {
+	size_t n = data_.size() - position_;
+	if (n > max) {
+		n = max;
+	}
+	memcpy(buffer, data_.data() + position_, n);
+	position_ += n;
+	return n;
+}
+
+int64_t CompositeResponseBody::length() const {
+	int64_t total = 0;
+	for (auto it = parts_.begin(); it != parts_.end(); it++) {
+		int64_t length = (*it)->length();
+		if (length < 0) {
+			return -1;
+		}
+		total += length;
+	}
+	return total;
+}
+
+ssize_t CompositeResponseBody::sendFile(int socketFd, size_t max) {
+	// If the current part can't use sendfile (or is finished), read() moves us on
+	if (current_ < parts_.size()) {
+		return parts_[current_]->sendFile(socketFd, max);
+	}
+	return 0;
+}
+
+size_t CompositeResponseBody::read(char * buffer, size_t max) {
+	while (current_ < parts_.size()) {
+		size_t n = parts_[current_]->read(buffer, max);
+		if (n != 0) {
+			return n;
+		}
+		current_++;
+	}
+	return 0;
+}
+
+}
+}
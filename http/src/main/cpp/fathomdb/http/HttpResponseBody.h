@@ -0,0 +1,108 @@
+// See COPYRIGHT file for copyright information
+
+#ifndef HTTPRESPONSEBODY_H_
+#define HTTPRESPONSEBODY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+
+namespace fathomdb {
+namespace http {
+using namespace std;
+
+/// A response body that is produced incrementally, instead of being held in HttpResponse::content.
+/// HttpConnection pulls it through a bounded buffer while writing it to the socket.
+class HttpResponseBody: boost::noncopyable {
+public:
+	virtual ~HttpResponseBody() {
+	}
+
+	/// Total length in bytes, or -1 if not known in advance (the body is then sent chunked).
+	virtual int64_t length() const {
+		return -1;
+	}
+
+	/// Copy up to max bytes of the body into buffer. Returns 0 once the body is exhausted.
+	virtual size_t read(char * buffer, size_t max) = 0;
+
+	/// Zero-copy path: send up to max bytes of the body straight from a file to the socket, with sendfile().
+	/// Returns the number of bytes sent; 0 if the next part of the body doesn't come from a file (the
+	/// caller should use read() instead); -1 with errno set on error, including EAGAIN when the socket is full.
+	virtual ssize_t sendFile(int socketFd, size_t max) {
+		return 0;
+	}
+};
+
+/// A body read from a file. The file is opened by the constructor and stays readable even if it is
+/// then unlinked.
+class FileResponseBody: public HttpResponseBody {
+public:
+	/// If knownLength, the current file size is used as the Content-Length. That is wrong for
+	/// files that are generated as they are read (e.g. /proc), so pass false for those.
+	FileResponseBody(const string& path, bool knownLength = true);
+	~FileResponseBody();
+
+	int64_t length() const {
+		return length_;
+	}
+
+	size_t read(char * buffer, size_t max);
+
+	/// Only files of known length are sent with sendfile; /proc files don't support it everywhere.
+	ssize_t sendFile(int socketFd, size_t max);
+
+private:
+	int fd_;
+	int64_t length_;
+	int64_t position_;
+};
+
+/// A body held in memory; mostly useful as part of a CompositeResponseBody.
+class StringResponseBody: public HttpResponseBody {
+public:
+	StringResponseBody(const string& data) :
+		data_(data), position_(0) {
+	}
+
+	int64_t length() const {
+		return data_.size();
+	}
+
+	size_t read(char * buffer, size_t max);
+
+private:
+	string data_;
+	size_t position_;
+};
+
+/// Several bodies sent one after another.
+class CompositeResponseBody: public HttpResponseBody {
+public:
+	CompositeResponseBody() :
+		current_(0) {
+	}
+
+	void add(unique_ptr<HttpResponseBody> && part) {
+		parts_.push_back(move(part));
+	}
+
+	int64_t length() const;
+
+	size_t read(char * buffer, size_t max);
+
+	ssize_t sendFile(int socketFd, size_t max);
+
+private:
+	vector<unique_ptr<HttpResponseBody> > parts_;
+	size_t current_;
+};
+
+}
+}
+
+#endif /* HTTPRESPONSEBODY_H_ */
@@ -2,9 +2,13 @@
 
 #include "HttpServer.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <boost/thread/thread.hpp>
 #include "HttpConnection.h"
 #include "HttpRequestHandler.h"
+#include "HttpWorkerPool.h"
 #include <glog/logging.h>
 
 using namespace std;
@@ -12,8 +16,11 @@ using namespace std;
 namespace fathomdb {
 namespace http {
 
-HttpServer::HttpServer(const string& address, const string& port, unique_ptr<HttpRequestHandler>&& request_handler, size_t thread_pool_size) :
-	thread_pool_size_(thread_pool_size), signals_(io_service_), acceptor_(io_service_), new_connection_(), request_handler_(move(request_handler)) {
+HttpServer::HttpServer(const string& address, const string& port, unique_ptr<HttpRequestHandler>&& request_handler, size_t thread_pool_size,
+		threading_model model) :
+	thread_pool_size_(thread_pool_size), threading_model_(model), signals_(io_service_), request_handler_(move(request_handler)),
+			keepalive_timeout_ms_(DEFAULT_KEEPALIVE_TIMEOUT_MS), max_requests_per_connection_(DEFAULT_MAX_REQUESTS_PER_CONNECTION),
+			worker_pool_(new HttpWorkerPool(DEFAULT_WORKER_THREADS, DEFAULT_WORKER_QUEUE)) {
 //	// Register to handle the signals that indicate when the server should exit.
 //	// It is safe to register for the same signal multiple times in a program,
 //	// provided all registration for the specified signal is made through Asio.
@@ -24,43 +31,136 @@ HttpServer::HttpServer(const string& address, const string& port, unique_ptr<Htt
 //#endif // defined(SIGQUIT)
 //	signals_.async_wait(boost::bind(&HttpServer::HandleStopSignal, this));
 
-	// Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
 	boost::asio::ip::tcp::resolver resolver(io_service_);
 	boost::asio::ip::tcp::resolver::query query(address, port);
 	boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
-	acceptor_.open(endpoint.protocol());
-	acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-	acceptor_.bind(endpoint);
-	acceptor_.listen();
+
+	if (threading_model_ == io_service_per_core) {
+		for (size_t i = 0; i < thread_pool_size_; ++i) {
+			// Only one thread runs each io_service, so asio can skip some locking
+			core_io_services_.push_back(unique_ptr<boost::asio::io_service>(new boost::asio::io_service(1)));
+			addListener(*core_io_services_.back(), endpoint, true);
+		}
+	} else {
+		addListener(io_service_, endpoint, false);
+	}
+}
+
+HttpServer::~HttpServer() {
+}
+
+// SO_REUSEPORT isn't one of asio's predefined options
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+void HttpServer::addListener(boost::asio::io_service& io_service, const boost::asio::ip::tcp::endpoint& endpoint, bool reusePort) {
+	unique_ptr<Listener> listener(new Listener(io_service));
+
+	// Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
+	boost::asio::ip::tcp::acceptor& acceptor = listener->acceptor_;
+	acceptor.open(endpoint.protocol());
+	acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+	if (reusePort) {
+		acceptor.set_option(reuse_port(true));
+	}
+	acceptor.bind(endpoint);
+	acceptor.listen();
+
+	listeners_.push_back(move(listener));
+}
+
+void HttpServer::setWorkerPool(size_t threads, size_t maxQueued) {
+	CHECK(threads_.empty());
+	worker_pool_.reset(new HttpWorkerPool(threads, maxQueued));
+}
+
+// The CPUs we may run on (online, and in our affinity mask), in order; empty if we can't tell
+static vector<int> allowedCpus() {
+	vector<int> cpus;
+
+	// The kernel rejects a mask smaller than its own, so grow until it fits
+	for (int size = 1024; size <= 1024 * 1024; size *= 2) {
+		cpu_set_t * mask = CPU_ALLOC(size);
+		size_t bytes = CPU_ALLOC_SIZE(size);
+		int ret = sched_getaffinity(0, bytes, mask);
+		if (ret == 0) {
+			for (int cpu = 0; cpu < size; cpu++) {
+				if (CPU_ISSET_S(cpu, bytes, mask))
+					cpus.push_back(cpu);
+			}
+		}
+		CPU_FREE(mask);
+
+		if (ret == 0 || errno != EINVAL)
+			break;
+	}
+	return cpus;
 }
 
 void HttpServer::RunAsync() {
-	start_accept();
+	worker_pool_->start();
+
+	for (auto it = listeners_.begin(); it != listeners_.end(); it++) {
+		start_accept(it->get());
+	}
 
 	CHECK(threads_.empty());
 
-	// Create a pool of threads to run all of the io_services.
-	for (size_t i = 0; i < thread_pool_size_; ++i) {
-		shared_ptr < boost::thread > thread(new boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_)));
-		threads_.push_back(thread);
+	if (threading_model_ == io_service_per_core) {
+		// CPU numbers needn't be contiguous (offline CPUs), and we may be limited to some of them
+		vector<int> cpus = allowedCpus();
+		if (cpus.empty()) {
+			LOG(WARNING) << "Unable to read our CPU affinity; not pinning http threads";
+		}
+		for (size_t i = 0; i < core_io_services_.size(); ++i) {
+			int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+			shared_ptr < boost::thread > thread(new boost::thread(boost::bind(&HttpServer::runPinned, core_io_services_[i].get(), cpu)));
+			threads_.push_back(thread);
+		}
+	} else {
+		// Create a pool of threads to run all of the io_services.
+		for (size_t i = 0; i < thread_pool_size_; ++i) {
+			shared_ptr < boost::thread > thread(new boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_)));
+			threads_.push_back(thread);
+		}
+	}
+}
+
+/*static*/void HttpServer::runPinned(boost::asio::io_service * io_service, int cpu) {
+	if (cpu >= 0) {
+		cpu_set_t * cpus = CPU_ALLOC(cpu + 1);
+		size_t bytes = CPU_ALLOC_SIZE(cpu + 1);
+		CPU_ZERO_S(bytes, cpus);
+		CPU_SET_S(cpu, bytes, cpus);
+		int ret = pthread_setaffinity_np(pthread_self(), bytes, cpus);
+		CPU_FREE(cpus);
+		if (ret != 0) {
+			LOG(WARNING) << "Unable to pin http thread to cpu " << cpu << ": " << ret;
+		}
 	}
+
+	io_service->run();
 }
 
-void HttpServer::start_accept() {
-	new_connection_.reset(new HttpConnection(shared_from_this(), io_service_, *request_handler_));
-	acceptor_.async_accept(new_connection_->socket(), boost::bind(&HttpServer::handle_accept, this, boost::asio::placeholders::error));
+void HttpServer::start_accept(Listener * listener) {
+	bool useStrand = (threading_model_ == shared_pool);
+	listener->new_connection_.reset(new HttpConnection(shared_from_this(), listener->io_service_, *request_handler_, useStrand));
+	listener->acceptor_.async_accept(listener->new_connection_->socket(), boost::bind(&HttpServer::handle_accept, this, listener, boost::asio::placeholders::error));
 }
 
-void HttpServer::handle_accept(const boost::system::error_code& e) {
+void HttpServer::handle_accept(Listener * listener, const boost::system::error_code& e) {
 	if (!e) {
-		new_connection_->start();
+		listener->new_connection_->start();
 	}
 
-	start_accept();
+	start_accept(listener);
 }
 
 void HttpServer::Stop(bool sync) {
+	worker_pool_->stop();
 	io_service_.stop();
+	for (auto it = core_io_services_.begin(); it != core_io_services_.end(); it++) {
+		(*it)->stop();
+	}
 }
 
 void HttpServer::WaitForExit() {
@@ -14,13 +14,26 @@ namespace http {
 using namespace std;
 class HttpRequestHandler;
 class HttpConnection;
+class HttpWorkerPool;
 
 /// The top-level class of the HTTP server.
 class HttpServer: public enable_shared_from_this<HttpServer>, private boost::noncopyable {
 public:
+	/// How requests are spread over threads.
+	enum threading_model {
+		/// All threads run one io_service; connections use a strand and may move between threads.
+		shared_pool,
+		/// Each thread runs its own io_service pinned to a core, with its own SO_REUSEPORT acceptor.
+		/// The kernel spreads incoming connections; a connection stays on the thread that accepted it.
+		io_service_per_core
+	};
+
 	/// Construct the server to listen on the specified TCP address and port, and
 	/// serve up files from the given directory.
-	explicit HttpServer(const string& address, const string& port, unique_ptr<HttpRequestHandler>&& request_handler, size_t thread_pool_size);
+	explicit HttpServer(const string& address, const string& port, unique_ptr<HttpRequestHandler>&& request_handler, size_t thread_pool_size,
+			threading_model model = shared_pool);
+
+	~HttpServer();
 
 	// Run the webserver until a Stop request is received
 	void Run() {
@@ -37,32 +50,91 @@ public:
 	// Wait for all threads to exit
 	void WaitForExit();
 
+	// How long a persistent connection may sit idle waiting for the next request before we close it
+	void setKeepAliveTimeout(int milliseconds) {
+		keepalive_timeout_ms_ = milliseconds;
+	}
+
+	int keepAliveTimeout() const {
+		return keepalive_timeout_ms_;
+	}
+
+	// Maximum number of requests served on one connection before we close it (0 disables keep-alive)
+	void setMaxRequestsPerConnection(size_t maxRequests) {
+		max_requests_per_connection_ = maxRequests;
+	}
+
+	size_t maxRequestsPerConnection() const {
+		return max_requests_per_connection_;
+	}
+
+	// Threads and queue limit for DeferredResponse work; must be set before RunAsync
+	void setWorkerPool(size_t threads, size_t maxQueued);
+
+	HttpWorkerPool& workerPool() {
+		return *worker_pool_;
+	}
+
+	static const int DEFAULT_KEEPALIVE_TIMEOUT_MS = 15000;
+	static const size_t DEFAULT_MAX_REQUESTS_PER_CONNECTION = 1000;
+	static const size_t DEFAULT_WORKER_THREADS = 2;
+	static const size_t DEFAULT_WORKER_QUEUE = 64;
+
 private:
+	/// An acceptor, together with the io_service that runs it and the connections it accepts.
+	class Listener {
+	public:
+		Listener(boost::asio::io_service& io_service) :
+			io_service_(io_service), acceptor_(io_service) {
+		}
+
+		boost::asio::io_service& io_service_;
+
+		/// Acceptor used to listen for incoming connections.
+		boost::asio::ip::tcp::acceptor acceptor_;
+
+		/// The next connection to be accepted.
+		shared_ptr<HttpConnection> new_connection_;
+	};
+
+	/// Open a listener on the endpoint; with reusePort, several listeners can share the port.
+	void addListener(boost::asio::io_service& io_service, const boost::asio::ip::tcp::endpoint& endpoint, bool reusePort);
+
 	/// Initiate an asynchronous accept operation.
-	void start_accept();
+	void start_accept(Listener * listener);
 
 	/// Handle completion of an asynchronous accept operation.
-	void handle_accept(const boost::system::error_code& e);
+	void handle_accept(Listener * listener, const boost::system::error_code& e);
+
+	/// Thread body in io_service_per_core mode
+	static void runPinned(boost::asio::io_service * io_service, int cpu);
 
 	/// The number of threads that will call io_service::run().
 	size_t thread_pool_size_;
 
-	/// The io_service used to perform asynchronous operations.
+	threading_model threading_model_;
+
+	/// The io_service used to perform asynchronous operations (all of them, in shared_pool mode).
 	boost::asio::io_service io_service_;
 
+	/// In io_service_per_core mode, one io_service per thread.
+	vector<unique_ptr<boost::asio::io_service> > core_io_services_;
+
 	/// The signal_set is used to register for process termination notifications.
 	boost::asio::signal_set signals_;
 
-	/// Acceptor used to listen for incoming connections.
-	boost::asio::ip::tcp::acceptor acceptor_;
-
-	/// The next connection to be accepted.
-	shared_ptr<HttpConnection> new_connection_;
+	vector<unique_ptr<Listener> > listeners_;
 
 	/// The handler for all incoming requests.
 	unique_ptr<HttpRequestHandler> request_handler_;
 
 	vector < shared_ptr<boost::thread> > threads_;
+
+	int keepalive_timeout_ms_;
+	size_t max_requests_per_connection_;
+
+	/// Runs blocking handler work (DeferredResponse).
+	unique_ptr<HttpWorkerPool> worker_pool_;
 };
 
 }
@@ -0,0 +1,77 @@
+// See COPYRIGHT file for copyright information
+
+#include "HttpWorkerPool.h"
+
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace fathomdb {
+namespace http {
+
+HttpWorkerPool::HttpWorkerPool(size_t threads, size_t maxQueued) :
+	thread_count_(threads), max_queued_(maxQueued), stopping_(false) {
+}
+
+HttpWorkerPool::~HttpWorkerPool() {
+	stop();
+}
+
+void HttpWorkerPool::start() {
+	CHECK(threads_.empty());
+
+	stopping_ = false;
+	for (size_t i = 0; i < thread_count_; ++i) {
+		shared_ptr<boost::thread> thread(new boost::thread(boost::bind(&HttpWorkerPool::run, this)));
+		threads_.push_back(thread);
+	}
+}
+
+bool HttpWorkerPool::submit(const task_t& task) {
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (stopping_ || threads_.empty() || queue_.size() >= max_queued_) {
+			return false;
+		}
+		queue_.push_back(task);
+	}
+	condition_.notify_one();
+	return true;
+}
+
+void HttpWorkerPool::stop() {
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		stopping_ = true;
+		queue_.clear();
+	}
+	condition_.notify_all();
+
+	for (auto it = threads_.begin(); it != threads_.end();) {
+		(*it)->join();
+		it = threads_.erase(it);
+	}
+}
+
+void HttpWorkerPool::run() {
+	while (true) {
+		task_t task;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			while (!stopping_ && queue_.empty()) {
+				condition_.wait(lock);
+			}
+			if (stopping_) {
+				return;
+			}
+			task = queue_.front();
+			queue_.pop_front();
+		}
+
+		task();
+	}
+}
+
+}
+}
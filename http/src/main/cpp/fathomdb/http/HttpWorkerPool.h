@@ -0,0 +1,62 @@
+// See COPYRIGHT file for copyright information
+
+#ifndef HTTPWORKERPOOL_H_
+#define HTTPWORKERPOOL_H_
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace fathomdb {
+namespace http {
+using namespace std;
+
+/// Threads for handler work that would block an io_service thread (forking, waiting, big reads).
+/// The queue is bounded: when it is full, submit fails and the caller should shed the request.
+class HttpWorkerPool: private boost::noncopyable {
+public:
+	typedef function<void()> task_t;
+
+	HttpWorkerPool(size_t threads, size_t maxQueued);
+	~HttpWorkerPool();
+
+	/// Queue a task; returns false (without queuing it) if the queue is full or the pool is stopped.
+	bool submit(const task_t& task);
+
+	void start();
+
+	/// Stop the threads once their current tasks finish; tasks still queued are discarded.
+	void stop();
+
+	size_t threadCount() const {
+		return thread_count_;
+	}
+
+	size_t maxQueued() const {
+		return max_queued_;
+	}
+
+private:
+	void run();
+
+	size_t thread_count_;
+	size_t max_queued_;
+
+	boost::mutex mutex_;
+	boost::condition_variable condition_;
+	deque<task_t> queue_;
+	bool stopping_;
+
+	vector<shared_ptr<boost::thread> > threads_;
+};
+
+}
+}
+
+#endif /* HTTPWORKERPOOL_H_ */
@@ -41,8 +41,17 @@ int main_http() {
 
 extern void TestHardwarePerformanceEvents();
 extern void TestGoogleProfiler();
+extern void BenchmarkSampleDecoding();
+extern void TestPmuRegistry();
+
+int main(int argc, char ** argv) {
+	if (argc > 1 && string(argv[1]) == "benchmark-decode") {
+		BenchmarkSampleDecoding();
+		return 0;
+	}
+
+	TestPmuRegistry();
 
-int main() {
 //	TestHardwarePerformanceEvents();
 	TestGoogleProfiler();
 
@@ -0,0 +1,326 @@
+// See COPYRIGHT for copyright
+#include "AddressSpace.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <link.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+AddressSpace::AddressSpace() :
+	indexed_(true), version_(0) {
+}
+
+void AddressSpace::loadProcSelfMaps(bool executableOnly) {
+	ifstream ifs("/proc/self/maps");
+	if (ifs.fail()) {
+		LOG(WARNING) << "Unable to read /proc/self/maps";
+		return;
+	}
+
+	string maps((istreambuf_iterator<char> (ifs)), istreambuf_iterator<char> ());
+	loadMaps(maps, executableOnly);
+}
+
+void AddressSpace::loadMaps(const string& maps, bool executableOnly) {
+	istringstream in(maps);
+	string line;
+	while (getline(in, line)) {
+		// 00400000-0040b000 r-xp 00000000 08:01 1234    /usr/bin/foo
+		uint64_t start, end, offset;
+		char perms[5];
+		int pathStart = 0;
+		if (sscanf(line.c_str(), "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*s %n", &start, &end, perms, &offset, &pathStart) < 4) {
+			continue;
+		}
+		if (executableOnly && perms[2] != 'x') {
+			continue;
+		}
+
+		string path = pathStart ? line.substr(pathStart) : string();
+		addMapping(start, end - start, offset, path, string(), 0);
+	}
+}
+
+void AddressSpace::addMapping(uint64_t start, uint64_t len, uint64_t pgoff, const string& path, const string& buildId, uint64_t time) {
+	uint64_t end = start + len;
+
+	lock_guard<mutex> lock(mutex_);
+
+	// Records from different channels can arrive out of order; a later mapping stays live, and ends ours
+	uint64_t timeUnmapped = FOREVER;
+
+	vector<Mapping> remainders;
+	for (auto it = mappings_.begin(); it != mappings_.end(); it++) {
+		Mapping& existing = *it;
+		if (existing.time_unmapped != FOREVER || existing.end <= start || end <= existing.start)
+			continue;
+
+		if (existing.start == start && existing.end == end && existing.pgoff == pgoff && existing.path == path) {
+			// The same mapping again, e.g. reported by more than one event
+			return;
+		}
+
+		if (existing.time_mapped > time) {
+			timeUnmapped = min(timeUnmapped, existing.time_mapped);
+			continue;
+		}
+
+		// The parts of the old mapping that weren't covered carry on from now
+		if (existing.start < start) {
+			Mapping before = existing;
+			before.end = start;
+			before.time_mapped = time;
+			before.sampled = false;
+			remainders.push_back(before);
+		}
+		if (end < existing.end) {
+			Mapping after = existing;
+			after.pgoff += end - existing.start;
+			after.start = end;
+			after.time_mapped = time;
+			after.sampled = false;
+			remainders.push_back(after);
+		}
+
+		existing.time_unmapped = time;
+	}
+
+	for (auto it = remainders.begin(); it != remainders.end(); it++) {
+		add(*it);
+	}
+
+	Mapping mapping;
+	mapping.start = start;
+	mapping.end = end;
+	mapping.pgoff = pgoff;
+	mapping.path = path;
+	mapping.build_id = buildId;
+	mapping.time_mapped = time;
+	mapping.time_unmapped = timeUnmapped;
+	mapping.sampled = false;
+
+	if (mapping.build_id.empty() && !path.empty() && path[0] == '/') {
+		mapping.build_id = buildIdFor(path);
+	}
+
+	add(mapping);
+}
+
+void AddressSpace::add(const Mapping& mapping) {
+	mappings_.push_back(mapping);
+	indexed_ = false;
+	version_++;
+}
+
+void AddressSpace::index() {
+	sort(mappings_.begin(), mappings_.end(), [](const Mapping& a, const Mapping& b) {
+		return a.start < b.start;
+	});
+
+	max_end_.resize(mappings_.size());
+	uint64_t maxEnd = 0;
+	for (size_t i = 0; i < mappings_.size(); i++) {
+		maxEnd = max(maxEnd, mappings_[i].end);
+		max_end_[i] = maxEnd;
+	}
+
+	indexed_ = true;
+}
+
+size_t AddressSpace::countStartingBefore(uint64_t addr) const {
+	return upper_bound(mappings_.begin(), mappings_.end(), addr, [](uint64_t addr, const Mapping& m) {
+		return addr < m.start;
+	}) - mappings_.begin();
+}
+
+bool AddressSpace::resolve(uint64_t addr, uint64_t time, Mapping * mapping) {
+	lock_guard<mutex> lock(mutex_);
+
+	if (!indexed_) {
+		index();
+	}
+
+	// The mappings that start at or before addr, and only as far back as one of them could still reach addr
+	size_t i = countStartingBefore(addr);
+	while (i > 0 && max_end_[i - 1] > addr) {
+		i--;
+		Mapping& candidate = mappings_[i];
+		if (candidate.contains(addr, time)) {
+			candidate.sampled = true;
+			if (mapping) {
+				*mapping = candidate;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+void AddressSpace::markSampled(const vector<SampledAddress>& addresses) {
+	lock_guard<mutex> lock(mutex_);
+
+	if (!indexed_) {
+		index();
+	}
+
+	for (auto it = addresses.begin(); it != addresses.end(); it++) {
+		size_t i = countStartingBefore(it->addr);
+		while (i > 0 && max_end_[i - 1] > it->addr) {
+			i--;
+			Mapping& candidate = mappings_[i];
+			if (candidate.start <= it->addr && it->addr < candidate.end && candidate.time_mapped <= it->last_time
+					&& it->first_time < candidate.time_unmapped) {
+				candidate.sampled = true;
+			}
+		}
+	}
+}
+
+void AddressSpace::forgetHistory() {
+	lock_guard<mutex> lock(mutex_);
+
+	vector<Mapping> live;
+	for (auto it = mappings_.begin(); it != mappings_.end(); it++) {
+		if (it->time_unmapped == FOREVER) {
+			live.push_back(*it);
+			live.back().sampled = false;
+		}
+	}
+
+	mappings_.swap(live);
+	indexed_ = false;
+	version_++;
+}
+
+uint64_t AddressSpace::version() const {
+	lock_guard<mutex> lock(mutex_);
+	return version_;
+}
+
+vector<AddressSpace::Mapping> AddressSpace::mappings() const {
+	vector<Mapping> copy;
+	{
+		lock_guard<mutex> lock(mutex_);
+		copy = mappings_;
+	}
+
+	sort(copy.begin(), copy.end(), [](const Mapping& a, const Mapping& b) {
+		return a.start < b.start;
+	});
+	return copy;
+}
+
+string AddressSpace::formatMaps() const {
+	vector<Mapping> all = mappings();
+
+	ostringstream out;
+	out << hex << setfill('0');
+	for (auto it = all.begin(); it != all.end(); it++) {
+		if (it->time_unmapped != FOREVER && !it->sampled)
+			continue;
+
+		// We only track code, and don't know the device or inode
+		out << setw(8) << it->start << "-" << setw(8) << it->end << " r-xp " << setw(8) << it->pgoff << " 00:00 0";
+		if (!it->path.empty()) {
+			out << "          " << it->path;
+		}
+		out << "\n";
+	}
+	return out.str();
+}
+
+string AddressSpace::buildIdFor(const string& path) {
+	// The same path can be a different file over time (e.g. a library that was upgraded)
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		return string();
+	}
+
+	ostringstream key;
+	key << path << ":" << st.st_dev << ":" << st.st_ino << ":" << st.st_mtime;
+
+	auto it = build_ids_.find(key.str());
+	if (it != build_ids_.end()) {
+		return it->second;
+	}
+
+	string buildId = readBuildId(path);
+	build_ids_[key.str()] = buildId;
+	return buildId;
+}
+
+static bool readFully(int fd, void * buffer, size_t size, off_t offset) {
+	return pread(fd, buffer, size, offset) == (ssize_t) size;
+}
+
+/*static*/string AddressSpace::readBuildId(const string& path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return string();
+	}
+
+	string buildId;
+
+	// The build-id is in a PT_NOTE segment, so the program headers are all we need to read
+	ElfW(Ehdr) ehdr;
+	if (readFully(fd, &ehdr, sizeof(ehdr), 0) && memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0
+			&& ehdr.e_ident[EI_CLASS] == (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32) && ehdr.e_phentsize == sizeof(ElfW(Phdr))) {
+		for (int i = 0; i < ehdr.e_phnum && buildId.empty(); i++) {
+			ElfW(Phdr) phdr;
+			if (!readFully(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)))
+				break;
+			if (phdr.p_type != PT_NOTE || phdr.p_filesz > 64 * 1024)
+				continue;
+
+			string notes(phdr.p_filesz, '\0');
+			if (!readFully(fd, &notes[0], notes.size(), phdr.p_offset))
+				continue;
+
+			// Each note is a header, then the name and the descriptor, each padded to 4 bytes
+			size_t pos = 0;
+			while (pos + sizeof(ElfW(Nhdr)) <= notes.size()) {
+				ElfW(Nhdr) nhdr;
+				memcpy(&nhdr, &notes[pos], sizeof(nhdr));
+				size_t name = pos + sizeof(nhdr);
+				size_t desc = name + ((nhdr.n_namesz + 3) & ~3);
+				size_t next = desc + ((nhdr.n_descsz + 3) & ~3);
+				if (next > notes.size())
+					break;
+
+				if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 && memcmp(&notes[name], "GNU", 4) == 0) {
+					ostringstream hexId;
+					hexId << hex << setfill('0');
+					for (size_t j = 0; j < nhdr.n_descsz; j++) {
+						hexId << setw(2) << (unsigned) (uint8_t) notes[desc + j];
+					}
+					buildId = hexId.str();
+					break;
+				}
+				pos = next;
+			}
+		}
+	}
+
+	close(fd);
+	return buildId;
+}
+
+}
+}
+}
@@ -0,0 +1,136 @@
+// See COPYRIGHT for copyright
+#ifndef ADDRESSSPACE_H_
+#define ADDRESSSPACE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * The executable mappings of the process over time, built from the kernel's PERF_RECORD_MMAP(2) records,
+ * so that a sample is resolved against whatever was mapped at its address when it was taken. Code that
+ * was dlclose'd, or JIT code that was replaced, is still attributed to the object it came from.
+ *
+ * The kernel doesn't report munmap, so a mapping stays live until something is mapped over it. When that
+ * happens the old mapping is retired (it stays in the table, valid up to the time it was replaced) and
+ * any part of it that wasn't covered carries on as a new version.
+ *
+ * The mappings are kept sorted by start address along with the greatest end address of each prefix,
+ * so a lookup only scans back over mappings that could contain the address (an implicit interval tree).
+ * The index is rebuilt on the first lookup after a change; mappings change rarely.
+ *
+ * Safe to use from several threads.
+ */
+class AddressSpace {
+public:
+	/// The time_unmapped of a mapping that is still live
+	static const uint64_t FOREVER = ~((uint64_t) 0);
+
+	struct Mapping {
+		uint64_t start;
+		uint64_t end;
+		uint64_t pgoff;
+
+		/// The mapped file; empty for anonymous (e.g. JIT) code
+		string path;
+
+		/// The GNU build-id of the file in hex, or empty if it has none (or we couldn't read it)
+		string build_id;
+
+		/// In perf clock time; 0 if it was mapped before we started watching
+		uint64_t time_mapped;
+		uint64_t time_unmapped;
+
+		/// Whether a sample has resolved to this mapping
+		bool sampled;
+
+		bool contains(uint64_t addr, uint64_t time) const {
+			return start <= addr && addr < end && time_mapped <= time && time < time_unmapped;
+		}
+	};
+
+	AddressSpace();
+
+	/// Adds the executable mappings listed in /proc/<pid>/maps format, as mapped since time 0
+	/// (or every mapping, for resolving data addresses, if executableOnly is false)
+	void loadMaps(const string& maps, bool executableOnly = true);
+
+	/// Adds the executable mappings of this process from /proc/self/maps
+	void loadProcSelfMaps(bool executableOnly = true);
+
+	/// A PERF_RECORD_MMAP(2): replaces anything mapped over [start, start + len) from time on.
+	/// An empty buildId is read from the file.
+	void addMapping(uint64_t start, uint64_t len, uint64_t pgoff, const string& path, const string& buildId, uint64_t time);
+
+	/// An address that samples hit, from the first of them to the last
+	struct SampledAddress {
+		uint64_t addr;
+		uint64_t first_time;
+		uint64_t last_time;
+	};
+
+	/// Finds the mapping that was live at addr at time, marking it as sampled. Returns false if there wasn't one.
+	bool resolve(uint64_t addr, uint64_t time, Mapping * mapping = NULL);
+
+	/// Marks every mapping that was live at one of the addresses at any time while it was being sampled;
+	/// a batch of them costs one lock, rather than one per frame of every sample
+	void markSampled(const vector<SampledAddress>& addresses);
+
+	/// Drops the retired mappings and clears the sampled marks, e.g. when starting a new profile
+	void forgetHistory();
+
+	/// Increases whenever the mappings change
+	uint64_t version() const;
+
+	/// A copy of every mapping (including retired ones), ordered by start address
+	vector<Mapping> mappings() const;
+
+	/// The mappings in /proc/<pid>/maps format, for pprof: those still live, and the retired ones that
+	/// were sampled. This only decides which mappings are listed: pprof has no notion of time, and the
+	/// profile records bare addresses, so if an address range was reused by two sampled objects it will
+	/// attribute both objects' samples to one of them.
+	string formatMaps() const;
+
+	/// The GNU build-id of an ELF file (of our own class) in hex; empty if it has none or can't be read
+	static string readBuildId(const string& path);
+
+private:
+	/// Sorts the mappings and computes max_end_; called with mutex_ held
+	void index();
+
+	/// How many mappings start at or before addr; called with mutex_ held, once indexed
+	size_t countStartingBefore(uint64_t addr) const;
+
+	/// Called with mutex_ held
+	void add(const Mapping& mapping);
+
+	/// Called with mutex_ held
+	string buildIdFor(const string& path);
+
+	mutable mutex mutex_;
+
+	vector<Mapping> mappings_;
+
+	/// max_end_[i] is the greatest end of mappings_[0..i]; only valid when indexed_
+	vector<uint64_t> max_end_;
+	bool indexed_;
+
+	uint64_t version_;
+
+	/// Files are only read once each
+	map<string, string> build_ids_;
+};
+
+}
+}
+}
+
+#endif /* ADDRESSSPACE_H_ */
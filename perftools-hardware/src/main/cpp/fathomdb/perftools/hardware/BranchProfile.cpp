@@ -0,0 +1,178 @@
+// See COPYRIGHT for copyright
+#include "BranchProfile.h"
+
+#include <link.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <linux/perf_event.h>
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+BranchProfile::BranchProfile() :
+	samples_(0) {
+}
+
+void BranchProfile::addSample(const DecodedPerfEvent& sample) {
+	lock_guard<mutex> lock(mutex_);
+
+	samples_++;
+	addresses_[sample.ip]++;
+
+	for (uint64_t i = 0; i < sample.branch_count; i++) {
+		const perf_branch_entry& branch = sample.branches[i];
+		if (branch.from == 0 || branch.to == 0)
+			continue;
+
+		EdgeCounts& counts = edges_[key_t(branch.from, branch.to)];
+		counts.count++;
+		if (branch.mispred) {
+			counts.mispredicted++;
+		}
+
+		// The most recent branch is first, so we ran from where the older one went to where this one left
+		if (i + 1 < sample.branch_count) {
+			uint64_t start = sample.branches[i + 1].to;
+			uint64_t end = branch.from;
+			if (start != 0 && start <= end && end - start < MAX_RANGE) {
+				ranges_[key_t(start, end)]++;
+			}
+		}
+	}
+}
+
+uint64_t BranchProfile::sampleCount() const {
+	lock_guard<mutex> lock(mutex_);
+	return samples_;
+}
+
+vector<BranchProfile::Edge> BranchProfile::hottestEdges(size_t n) const {
+	vector<Edge> edges;
+	{
+		lock_guard<mutex> lock(mutex_);
+		edges.reserve(edges_.size());
+		for (auto it = edges_.begin(); it != edges_.end(); it++) {
+			Edge edge;
+			edge.from = it->first.first;
+			edge.to = it->first.second;
+			edge.count = it->second.count;
+			edge.mispredicted = it->second.mispredicted;
+			edges.push_back(edge);
+		}
+	}
+
+	n = min(n, edges.size());
+	partial_sort(edges.begin(), edges.begin() + n, edges.end(), [](const Edge& a, const Edge& b) {
+		return a.count > b.count;
+	});
+	edges.resize(n);
+	return edges;
+}
+
+// Where a loaded object is: its load bias, and the address ranges of its code
+struct LoadedObject {
+	string path;
+	bool found;
+	uint64_t bias;
+	vector<pair<uint64_t, uint64_t> > text;
+
+	bool contains(uint64_t addr) const {
+		for (auto it = text.begin(); it != text.end(); it++) {
+			if (it->first <= addr && addr < it->second)
+				return true;
+		}
+		return false;
+	}
+};
+
+static int findLoadedObject(dl_phdr_info * info, size_t size, void * data) {
+	LoadedObject * object = (LoadedObject *) data;
+
+	// The main executable is listed first, with an empty name. Others are listed by the name they were
+	// loaded by, while maps has the resolved path.
+	const char * name = info->dlpi_name ? info->dlpi_name : "";
+	bool match;
+	if (object->path.empty()) {
+		match = (name[0] == '\0');
+	} else {
+		char resolved[PATH_MAX];
+		match = (object->path == name) || (name[0] != '\0' && realpath(name, resolved) && object->path == resolved);
+	}
+	if (!match)
+		return 0;
+
+	object->found = true;
+	object->bias = info->dlpi_addr;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+		if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+			uint64_t start = info->dlpi_addr + phdr.p_vaddr;
+			object->text.push_back(make_pair(start, start + phdr.p_memsz));
+		}
+	}
+	return 1;
+}
+
+string BranchProfile::formatAutoFdo(const string& objectPath) const {
+	LoadedObject object;
+	object.path = objectPath;
+	object.found = false;
+	object.bias = 0;
+	dl_iterate_phdr(findLoadedObject, &object);
+	if (!object.found) {
+		throw invalid_argument("Object is not loaded: " + objectPath);
+	}
+
+	vector<pair<key_t, uint64_t> > ranges;
+	vector<pair<uint64_t, uint64_t> > addresses;
+	vector<pair<key_t, uint64_t> > branches;
+	{
+		lock_guard<mutex> lock(mutex_);
+		for (auto it = ranges_.begin(); it != ranges_.end(); it++) {
+			if (object.contains(it->first.first) && object.contains(it->first.second)) {
+				ranges.push_back(make_pair(key_t(it->first.first - object.bias, it->first.second - object.bias), it->second));
+			}
+		}
+		for (auto it = addresses_.begin(); it != addresses_.end(); it++) {
+			if (object.contains(it->first)) {
+				addresses.push_back(make_pair(it->first - object.bias, it->second));
+			}
+		}
+		for (auto it = edges_.begin(); it != edges_.end(); it++) {
+			if (object.contains(it->first.first) && object.contains(it->first.second)) {
+				branches.push_back(make_pair(key_t(it->first.first - object.bias, it->first.second - object.bias), it->second.count));
+			}
+		}
+	}
+
+	sort(ranges.begin(), ranges.end());
+	sort(addresses.begin(), addresses.end());
+	sort(branches.begin(), branches.end());
+
+	ostringstream out;
+	out << ranges.size() << "\n";
+	for (auto it = ranges.begin(); it != ranges.end(); it++) {
+		out << hex << it->first.first << "-" << it->first.second << ":" << dec << it->second << "\n";
+	}
+	out << addresses.size() << "\n";
+	for (auto it = addresses.begin(); it != addresses.end(); it++) {
+		out << hex << it->first << ":" << dec << it->second << "\n";
+	}
+	out << branches.size() << "\n";
+	for (auto it = branches.begin(); it != branches.end(); it++) {
+		out << hex << it->first.first << "->" << it->first.second << ":" << dec << it->second << "\n";
+	}
+	return out.str();
+}
+
+}
+}
+}
@@ -0,0 +1,90 @@
+// See COPYRIGHT for copyright
+#ifndef BRANCHPROFILE_H_
+#define BRANCHPROFILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <mutex>
+
+#include "PerfEvent.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Aggregates the branch stacks (LBR) of samples: how often each branch edge was taken (and
+ * mispredicted), and how often each straight-line address range between two consecutive branches
+ * was executed. That's what AutoFDO builds a profile-guided optimisation profile from.
+ *
+ * Safe to use from several threads.
+ */
+class BranchProfile {
+public:
+	struct Edge {
+		uint64_t from;
+		uint64_t to;
+		uint64_t count;
+		uint64_t mispredicted;
+	};
+
+	BranchProfile();
+
+	void addSample(const DecodedPerfEvent& sample);
+
+	uint64_t sampleCount() const;
+
+	/// The n most taken edges, most taken first
+	vector<Edge> hottestEdges(size_t n) const;
+
+	/**
+	 * The counts within one loaded object, in AutoFDO's text format (as read by its TextSampleReader),
+	 * with addresses relative to the object's load address:
+	 *
+	 *	<number of ranges>
+	 *	start-end:count			(hex addresses, decimal counts)
+	 *	<number of addresses>
+	 *	address:count
+	 *	<number of branches>
+	 *	from->to:count
+	 *
+	 * objectPath is a path as in /proc/self/maps; empty means the main executable.
+	 * Throws invalid_argument if no such object is loaded.
+	 */
+	string formatAutoFdo(const string& objectPath) const;
+
+private:
+	typedef pair<uint64_t, uint64_t> key_t;
+
+	struct KeyHash {
+		size_t operator()(const key_t& key) const {
+			return key.first * 0x9e3779b97f4a7c15ULL ^ key.second;
+		}
+	};
+
+	struct EdgeCounts {
+		uint64_t count;
+		uint64_t mispredicted;
+	};
+
+	/// A run of straight-line code longer than this is a bogus pair of branch records
+	static const uint64_t MAX_RANGE = 1 << 20;
+
+	unordered_map<key_t, EdgeCounts, KeyHash> edges_;
+	unordered_map<key_t, uint64_t, KeyHash> ranges_;
+	unordered_map<uint64_t, uint64_t> addresses_;
+	uint64_t samples_;
+
+	mutable mutex mutex_;
+};
+
+}
+}
+}
+
+#endif /* BRANCHPROFILE_H_ */
@@ -0,0 +1,244 @@
+// See COPYRIGHT for copyright
+#include "CounterSet.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include <stdexcept>
+#include <sstream>
+
+#include <glog/logging.h>
+
+#include "ThreadDiscovery.h"
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+static void addReading(CounterSet::Reading& sum, const CounterSet::Reading& reading) {
+	if (sum.counters.empty()) {
+		sum.counters = reading.counters;
+		return;
+	}
+
+	CHECK_EQ(sum.counters.size(), reading.counters.size());
+	for (size_t i = 0; i < sum.counters.size(); i++) {
+		CounterSet::Counter& total = sum.counters[i];
+		const CounterSet::Counter& counter = reading.counters[i];
+		total.raw += counter.raw;
+		total.time_enabled += counter.time_enabled;
+		total.time_running += counter.time_running;
+		total.scaled += counter.scaled;
+	}
+}
+
+static size_t countOpenDescriptors() {
+	DIR * dir = opendir("/proc/self/fd");
+	if (dir == NULL) {
+		return 0;
+	}
+
+	size_t count = 0;
+	while (dirent * entry = readdir(dir)) {
+		if (entry->d_name[0] != '.') {
+			count++;
+		}
+	}
+	closedir(dir);
+
+	// Less the one we were reading it with
+	return count ? count - 1 : 0;
+}
+
+// Running out of descriptors part way through opening the counters would also starve the rest of the
+// process (e.g. the server accepting connections), so we fail up front, leaving some to spare
+static void checkDescriptorLimit(size_t needed) {
+	static const size_t RESERVED_DESCRIPTORS = 64;
+
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+		return;
+	}
+
+	size_t used = countOpenDescriptors() + RESERVED_DESCRIPTORS;
+	size_t available = (used < limit.rlim_cur) ? limit.rlim_cur - used : 0;
+	if (needed > available) {
+		ostringstream message;
+		message << "Counting needs " << needed << " file descriptors (cpus * threads * events), but only " << available
+				<< " are available under RLIMIT_NOFILE (" << limit.rlim_cur << "); count fewer events, or by thread";
+		throw invalid_argument(message.str());
+	}
+}
+
+CounterSet::CounterSet(const EventSetSpecifier& spec, Breakdown breakdown, pid_t pid, bool excludeKernel) :
+	events_per_reading_(spec.size()), breakdown_(breakdown) {
+	EventSetSpecifier counting(spec);
+
+	for (size_t i = 0; i < counting.size(); i++) {
+		EventSpecification& eventSpec = counting[i];
+		perf_event_attr& attr = eventSpec.attr();
+
+		// Siblings follow their leader
+		attr.disabled = eventSpec.isGroupSibling() ? 0 : 1;
+		if (!eventSpec.modifiers().specifiesPrivilege()) {
+			attr.exclude_kernel = excludeKernel ? 1 : 0;
+		}
+
+		attr.freq = 0;
+		attr.sample_period = 0;
+		attr.sample_type = 0;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		// Reading an inherited counter includes its children, so per-cpu counters also see new threads
+		attr.inherit = (breakdown == BY_CPU) ? 1 : 0;
+	}
+
+	// Inheritance only follows threads created after the counter is opened, so either way we open
+	// counters on each existing thread (per-cpu that is cpus * threads * events descriptors)
+	ThreadSet threads = ThreadSet::findThreadsInProcess(pid);
+	CpuSet cpus = (breakdown == BY_CPU) ? CpuSet::buildEachCpu() : CpuSet::buildWildcard();
+	checkDescriptorLimit(cpus.size() * threads.size() * counting.size());
+	event_set_.reset(new EventSet(counting, cpus, threads));
+}
+
+void CounterSet::start() {
+	for (size_t i = 0; i < event_set_->size(); i++) {
+		Event& event = (*event_set_)[i];
+		if (event.specification().isGroupSibling())
+			continue;
+
+		if (ioctl(event.fileDescriptor(), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) != 0) {
+			LOG(WARNING) << "Unable to reset counter " << event.name();
+		}
+	}
+	event_set_->setEnabled(true);
+}
+
+void CounterSet::stop() {
+	event_set_->setEnabled(false);
+}
+
+vector<CounterSet::Reading> CounterSet::read() {
+	vector<Reading> readings;
+
+	// { nr, time_enabled, time_running, value[nr] }
+	vector<uint64_t> buffer(3 + events_per_reading_);
+
+	for (size_t base = 0; base < event_set_->size(); base += events_per_reading_) {
+		Reading reading;
+		reading.cpu = (*event_set_)[base].cpu();
+		reading.tid = (*event_set_)[base].tid();
+
+		for (size_t k = 0; k < events_per_reading_; k++) {
+			Event& event = (*event_set_)[base + k];
+			const perf_event_attr& attr = event.specification().attr();
+
+			Counter counter;
+			counter.name = event.name();
+			counter.type = attr.type;
+			counter.config = attr.config;
+			counter.raw = 0;
+			counter.time_enabled = 0;
+			counter.time_running = 0;
+			counter.scaled = 0;
+			reading.counters.push_back(counter);
+		}
+
+		for (size_t k = 0; k < events_per_reading_; k++) {
+			Event& event = (*event_set_)[base + k];
+			if (event.specification().isGroupSibling())
+				continue;
+
+			// The group's values come back in the order its events were opened: the leader, then its siblings
+			ssize_t n = ::read(event.fileDescriptor(), &buffer[0], buffer.size() * sizeof(uint64_t));
+			if (n < (ssize_t) (3 * sizeof(uint64_t))) {
+				LOG(WARNING) << "Unable to read counter " << event.name();
+				continue;
+			}
+
+			uint64_t nr = buffer[0];
+			if (k + nr > events_per_reading_ || n < (ssize_t) ((3 + nr) * sizeof(uint64_t))) {
+				LOG(WARNING) << "Unexpected group read for counter " << event.name();
+				continue;
+			}
+
+			for (uint64_t j = 0; j < nr; j++) {
+				Counter& counter = reading.counters[k + j];
+				counter.raw = buffer[3 + j];
+				counter.time_enabled = buffer[1];
+				counter.time_running = buffer[2];
+				counter.scaled = buffer[2] ? (double) counter.raw * buffer[1] / buffer[2] : 0;
+			}
+		}
+
+		if (breakdown_ == BY_CPU) {
+			// The events are opened cpu by cpu, so a cpu's threads are adjacent
+			if (readings.empty() || readings.back().cpu != reading.cpu) {
+				Reading cpu;
+				cpu.cpu = reading.cpu;
+				cpu.tid = -1;
+				readings.push_back(move(cpu));
+			}
+			addReading(readings.back(), reading);
+		} else {
+			readings.push_back(move(reading));
+		}
+	}
+
+	return readings;
+}
+
+/*static*/CounterSet::Reading CounterSet::total(const vector<Reading>& readings) {
+	Reading total;
+	total.cpu = -1;
+	total.tid = -1;
+
+	for (auto it = readings.begin(); it != readings.end(); it++) {
+		addReading(total, *it);
+	}
+	return total;
+}
+
+static const CounterSet::Counter * findCounter(const vector<CounterSet::Counter>& counters, uint32_t type, uint64_t config) {
+	for (auto it = counters.begin(); it != counters.end(); it++) {
+		if (it->type == type && it->config == config)
+			return &*it;
+	}
+	return NULL;
+}
+
+/*static*/vector<pair<string, double> > CounterSet::ratios(const vector<Counter>& counters) {
+	struct Ratio {
+		const char * name;
+		uint64_t numerator;
+		uint64_t denominator;
+	};
+
+	static const Ratio hardwareRatios[] = {
+		{ "instructions-per-cycle", PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES },
+		{ "cache-miss-rate", PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_CACHE_REFERENCES },
+		{ "branch-miss-rate", PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+		{ "frontend-stalls-per-cycle", PERF_COUNT_HW_STALLED_CYCLES_FRONTEND, PERF_COUNT_HW_CPU_CYCLES },
+		{ "backend-stalls-per-cycle", PERF_COUNT_HW_STALLED_CYCLES_BACKEND, PERF_COUNT_HW_CPU_CYCLES },
+	};
+
+	vector<pair<string, double> > ratios;
+	for (size_t i = 0; i < sizeof(hardwareRatios) / sizeof(hardwareRatios[0]); i++) {
+		const Ratio& ratio = hardwareRatios[i];
+		const Counter * numerator = findCounter(counters, PERF_TYPE_HARDWARE, ratio.numerator);
+		const Counter * denominator = findCounter(counters, PERF_TYPE_HARDWARE, ratio.denominator);
+		if (numerator && denominator && denominator->scaled != 0) {
+			ratios.push_back(make_pair(string(ratio.name), numerator->scaled / denominator->scaled));
+		}
+	}
+	return ratios;
+}
+
+}
+}
+}
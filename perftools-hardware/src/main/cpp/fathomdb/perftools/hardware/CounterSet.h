@@ -0,0 +1,87 @@
+// See COPYRIGHT for copyright
+#ifndef COUNTERSET_H_
+#define COUNTERSET_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include "EventSet.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Counting mode: the events just count (no sampling, no mmap), and are read with one read() per group.
+ *
+ * Every event is read as a group (ungrouped events as a group of one) with the time the group was
+ * enabled and the time it was actually on the PMU. When there are more events than counters, the
+ * kernel multiplexes them, and we scale each count up by enabled / running.
+ */
+class CounterSet {
+public:
+	enum Breakdown {
+		/// Counters for each CPU, following the whole process (including new threads)
+		BY_CPU,
+		/// One set of counters per thread that exists when the set is built
+		BY_THREAD
+	};
+
+	struct Counter {
+		string name;
+		uint32_t type;
+		uint64_t config;
+
+		uint64_t raw;
+		uint64_t time_enabled;
+		uint64_t time_running;
+
+		/// raw, scaled up for the time the counter wasn't on the PMU
+		double scaled;
+
+		/// The fraction of the time the counter was actually counting (0 if it never was)
+		double running() const {
+			return time_enabled ? (double) time_running / time_enabled : 0;
+		}
+	};
+
+	/// The counters of one CPU or thread (cpu or tid is -1 when it doesn't apply), in spec order
+	struct Reading {
+		cpuid_t cpu;
+		pid_t tid;
+		vector<Counter> counters;
+	};
+
+	/// Opens the counters, disabled. Throws invalid_argument if an event can't be opened, or if there
+	/// aren't enough file descriptors left to open them all.
+	/// excludeKernel applies to the events that don't have a u or k modifier.
+	CounterSet(const EventSetSpecifier& spec, Breakdown breakdown, pid_t pid, bool excludeKernel);
+
+	/// Zero and enable the counters
+	void start();
+
+	void stop();
+
+	vector<Reading> read();
+
+	/// The sum of the readings, with cpu and tid -1
+	static Reading total(const vector<Reading>& readings);
+
+	/// Ratios derived from well-known pairs of counters that are present, e.g. instructions per cycle
+	static vector<pair<string, double> > ratios(const vector<Counter>& counters);
+
+private:
+	unique_ptr<EventSet> event_set_;
+	size_t events_per_reading_;
+	Breakdown breakdown_;
+};
+
+}
+}
+}
+
+#endif /* COUNTERSET_H_ */
@@ -0,0 +1,204 @@
+// See COPYRIGHT for copyright
+#include "DataAccessProfile.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <linux/perf_event.h>
+
+#include "AddressSpace.h"
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+DataAccessProfile::DataAccessProfile() :
+	samples_(0) {
+}
+
+void DataAccessProfile::addSample(const DecodedPerfEvent& sample) {
+	// Events that can't attribute the sample to a data access report it at 0
+	if (sample.addr == 0)
+		return;
+
+	perf_mem_data_src source;
+	source.val = sample.data_src;
+
+	lock_guard<mutex> lock(mutex_);
+
+	samples_++;
+
+	uint64_t line = sample.addr & ~(CACHE_LINE_SIZE - 1);
+	auto it = lines_.find(line);
+	if (it == lines_.end()) {
+		LineCounts counts;
+		memset(&counts, 0, sizeof(counts));
+		counts.tid = sample.tid;
+		it = lines_.insert(make_pair(line, counts)).first;
+	}
+
+	LineCounts& counts = it->second;
+	counts.samples++;
+	counts.weight += sample.weight;
+	counts.bytes |= 1ULL << (sample.addr & (CACHE_LINE_SIZE - 1));
+	if (sample.tid != counts.tid) {
+		counts.several_threads = true;
+	}
+
+	if (sample.data_src == 0)
+		return;
+
+	if (source.mem_op & PERF_MEM_OP_LOAD) {
+		counts.loads++;
+	}
+	if (source.mem_op & PERF_MEM_OP_STORE) {
+		counts.stores++;
+	}
+
+	if (source.mem_lvl & PERF_MEM_LVL_HIT) {
+		if (source.mem_lvl & (PERF_MEM_LVL_L1 | PERF_MEM_LVL_LFB)) {
+			counts.l1++;
+		} else if (source.mem_lvl & PERF_MEM_LVL_L2) {
+			counts.l2++;
+		} else if (source.mem_lvl & PERF_MEM_LVL_L3) {
+			counts.l3++;
+		} else if (source.mem_lvl & (PERF_MEM_LVL_LOC_RAM | PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2)) {
+			counts.dram++;
+		} else if (source.mem_lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2)) {
+			counts.remote_cache++;
+		}
+	}
+
+	if (source.mem_snoop & PERF_MEM_SNOOP_HITM) {
+		counts.hitm++;
+	}
+}
+
+uint64_t DataAccessProfile::sampleCount() const {
+	lock_guard<mutex> lock(mutex_);
+	return samples_;
+}
+
+typedef pair<uint64_t, DataAccessProfile::LineCounts> line_t;
+
+static bool hotter(const line_t& a, const line_t& b) {
+	if (a.second.weight != b.second.weight)
+		return a.second.weight > b.second.weight;
+	return a.second.samples > b.second.samples;
+}
+
+// The lines of one mapping, and their totals
+struct MappingLines {
+	string name;
+	uint64_t start;
+	uint64_t end;
+
+	uint64_t samples;
+	uint64_t weight;
+	uint64_t dram;
+
+	vector<line_t> lines;
+
+	bool operator<(const MappingLines& other) const {
+		if (weight != other.weight)
+			return weight > other.weight;
+		return samples > other.samples;
+	}
+};
+
+// A line that other threads write (or had modified) is shared; if they use different words of it, probably falsely
+static const char * describeSharing(const DataAccessProfile::LineCounts& line) {
+	if (!line.several_threads || (line.stores == 0 && line.hitm == 0))
+		return "";
+
+	int words = 0;
+	for (int i = 0; i < 8; i++) {
+		if ((line.bytes >> (i * 8)) & 0xff)
+			words++;
+	}
+	return words > 1 ? "\tfalse sharing?" : "\tshared";
+}
+
+string DataAccessProfile::formatHeatmap(size_t n) const {
+	vector<line_t> lines;
+	uint64_t samples;
+	{
+		lock_guard<mutex> lock(mutex_);
+		lines.assign(lines_.begin(), lines_.end());
+		samples = samples_;
+	}
+
+	// Data is mapped and unmapped far more often than code, so we don't track it over time; lines that
+	// have since been unmapped are reported together
+	AddressSpace addressSpace;
+	addressSpace.loadProcSelfMaps(false);
+
+	map<uint64_t, MappingLines> byMapping;
+	for (auto it = lines.begin(); it != lines.end(); it++) {
+		AddressSpace::Mapping mapping;
+		uint64_t key = 0;
+		if (addressSpace.resolve(it->first, 0, &mapping)) {
+			key = mapping.start;
+		}
+
+		auto found = byMapping.find(key);
+		if (found == byMapping.end()) {
+			MappingLines mappingLines;
+			if (key == 0) {
+				mappingLines.name = "[unmapped]";
+				mappingLines.start = mappingLines.end = 0;
+			} else {
+				mappingLines.name = mapping.path.empty() ? "[anon]" : mapping.path;
+				mappingLines.start = mapping.start;
+				mappingLines.end = mapping.end;
+			}
+			mappingLines.samples = mappingLines.weight = mappingLines.dram = 0;
+			found = byMapping.insert(make_pair(key, mappingLines)).first;
+		}
+
+		MappingLines& mappingLines = found->second;
+		mappingLines.samples += it->second.samples;
+		mappingLines.weight += it->second.weight;
+		mappingLines.dram += it->second.dram;
+		mappingLines.lines.push_back(*it);
+	}
+
+	vector<MappingLines> mappings;
+	for (auto it = byMapping.begin(); it != byMapping.end(); it++) {
+		mappings.push_back(it->second);
+	}
+	sort(mappings.begin(), mappings.end());
+
+	ostringstream out;
+	out << "# " << samples << " samples with data addresses, in " << lines.size() << " cache lines of " << CACHE_LINE_SIZE << " bytes\n";
+	out << "# line, offset in mapping, samples, weight, loads, stores, l1, l2, l3, dram, remote cache, hitm, threads, bytes touched\n";
+
+	for (auto it = mappings.begin(); it != mappings.end(); it++) {
+		MappingLines& mapping = *it;
+		out << hex << mapping.start << "-" << mapping.end << dec << " " << mapping.name << ": " << mapping.samples << " samples, weight "
+				<< mapping.weight << ", " << mapping.dram << " from dram\n";
+
+		size_t count = min(n, mapping.lines.size());
+		partial_sort(mapping.lines.begin(), mapping.lines.begin() + count, mapping.lines.end(), hotter);
+		for (size_t i = 0; i < count; i++) {
+			const LineCounts& line = mapping.lines[i].second;
+			out << "\t0x" << hex << mapping.lines[i].first << "\t+0x" << (mapping.lines[i].first - mapping.start) << dec;
+			out << "\t" << line.samples << "\t" << line.weight << "\t" << line.loads << "\t" << line.stores;
+			out << "\t" << line.l1 << "\t" << line.l2 << "\t" << line.l3 << "\t" << line.dram << "\t" << line.remote_cache << "\t" << line.hitm;
+			out << "\t" << (line.several_threads ? "several" : "one") << "\t" << __builtin_popcountll(line.bytes);
+			out << describeSharing(line) << "\n";
+		}
+	}
+
+	return out.str();
+}
+
+}
+}
+}
@@ -0,0 +1,84 @@
+// See COPYRIGHT for copyright
+#ifndef DATAACCESSPROFILE_H_
+#define DATAACCESSPROFILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+#include "PerfEvent.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Aggregates the data addresses of samples (from events with the 'd' modifier) by cache line: how often
+ * each line was sampled, the total weight (latency) of those accesses, where they were satisfied (the
+ * data source), and which threads and bytes of the line they touched. That's a heatmap of the data.
+ *
+ * A line that several threads write at different offsets is likely false sharing; a mapping whose
+ * accesses are mostly satisfied from DRAM is full of cold misses.
+ *
+ * Safe to use from several threads.
+ */
+class DataAccessProfile {
+public:
+	static const uint64_t CACHE_LINE_SIZE = 64;
+
+	struct LineCounts {
+		uint64_t samples;
+
+		/// The total weight of the accesses; for memory events that's their latency in cycles
+		uint64_t weight;
+
+		uint64_t loads;
+		uint64_t stores;
+
+		/// Where the accesses were satisfied: L1 (or the line fill buffer), L2, L3, local or remote DRAM,
+		/// or a remote cache
+		uint64_t l1;
+		uint64_t l2;
+		uint64_t l3;
+		uint64_t dram;
+		uint64_t remote_cache;
+
+		/// Accesses that found the line modified in another core's cache (snoop HITM)
+		uint64_t hitm;
+
+		/// A bit for each byte of the line that was accessed
+		uint64_t bytes;
+
+		/// The first thread to access the line, and whether any other thread did
+		uint32_t tid;
+		bool several_threads;
+	};
+
+	DataAccessProfile();
+
+	void addSample(const DecodedPerfEvent& sample);
+
+	/// Samples with a data address
+	uint64_t sampleCount() const;
+
+	/**
+	 * A text report grouped by the mapping (as now in /proc/self/maps) that each line is in, hottest
+	 * (by weight, then samples) first, listing the n hottest lines of each mapping.
+	 */
+	string formatHeatmap(size_t n) const;
+
+private:
+	unordered_map<uint64_t, LineCounts> lines_;
+	uint64_t samples_;
+
+	mutable mutex mutex_;
+};
+
+}
+}
+}
+
+#endif /* DATAACCESSPROFILE_H_ */
@@ -0,0 +1,375 @@
+// See COPYRIGHT for copyright
+#include "DwarfUnwinder.h"
+
+#include <string.h>
+#include <link.h>
+
+#include <algorithm>
+
+#include <libunwind.h>
+#include <glog/logging.h>
+
+#if defined(__x86_64__)
+#include <asm/perf_regs.h>
+#endif
+
+using namespace std;
+
+// Not in libunwind.h, but exported; it searches an .eh_frame_hdr table for the FDE of an ip
+extern "C" int UNW_OBJ(dwarf_search_unwind_table)(unw_addr_space_t as, unw_word_t ip, unw_dyn_info_t * di,
+		unw_proc_info_t * pi, int need_unwind_info, void * arg);
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+// .eh_frame_hdr pointer encodings (DW_EH_PE_*)
+static const uint8_t EH_PE_UDATA4 = 0x03;
+static const uint8_t EH_PE_SDATA4 = 0x0b;
+static const uint8_t EH_PE_DATAREL = 0x30;
+
+#if defined(__x86_64__)
+static const uint64_t UNWIND_REGISTERS = (1ULL << PERF_REG_X86_AX) | (1ULL << PERF_REG_X86_BX) | (1ULL << PERF_REG_X86_CX)
+		| (1ULL << PERF_REG_X86_DX) | (1ULL << PERF_REG_X86_SI) | (1ULL << PERF_REG_X86_DI) | (1ULL << PERF_REG_X86_BP)
+		| (1ULL << PERF_REG_X86_SP) | (1ULL << PERF_REG_X86_IP) | (1ULL << PERF_REG_X86_R8) | (1ULL << PERF_REG_X86_R9)
+		| (1ULL << PERF_REG_X86_R10) | (1ULL << PERF_REG_X86_R11) | (1ULL << PERF_REG_X86_R12) | (1ULL << PERF_REG_X86_R13)
+		| (1ULL << PERF_REG_X86_R14) | (1ULL << PERF_REG_X86_R15);
+
+// The perf register for each libunwind register number, or -1
+static int perfRegister(unw_regnum_t regnum) {
+	switch (regnum) {
+	case UNW_X86_64_RAX:
+		return PERF_REG_X86_AX;
+	case UNW_X86_64_RDX:
+		return PERF_REG_X86_DX;
+	case UNW_X86_64_RCX:
+		return PERF_REG_X86_CX;
+	case UNW_X86_64_RBX:
+		return PERF_REG_X86_BX;
+	case UNW_X86_64_RSI:
+		return PERF_REG_X86_SI;
+	case UNW_X86_64_RDI:
+		return PERF_REG_X86_DI;
+	case UNW_X86_64_RBP:
+		return PERF_REG_X86_BP;
+	case UNW_X86_64_RSP:
+		return PERF_REG_X86_SP;
+	case UNW_X86_64_RIP:
+		return PERF_REG_X86_IP;
+	default:
+		if (regnum >= UNW_X86_64_R8 && regnum <= UNW_X86_64_R15) {
+			return PERF_REG_X86_R8 + (regnum - UNW_X86_64_R8);
+		}
+		return -1;
+	}
+}
+
+static const int STACK_POINTER = PERF_REG_X86_SP;
+#else
+static const uint64_t UNWIND_REGISTERS = 0;
+
+static int perfRegister(unw_regnum_t regnum) {
+	return -1;
+}
+
+static const int STACK_POINTER = -1;
+#endif
+
+/*static*/uint64_t DwarfUnwinder::sampleRegisters() {
+	return UNWIND_REGISTERS;
+}
+
+// What the accessors need to know about the sample being unwound
+struct UnwindContext {
+	DwarfUnwinder * unwinder;
+	const DecodedPerfEvent * sample;
+};
+
+static bool sampledRegister(const DecodedPerfEvent& sample, int perfReg, uint64_t * value) {
+	if (perfReg < 0 || !(UNWIND_REGISTERS & (1ULL << perfReg)))
+		return false;
+
+	// The registers are recorded in bit order
+	size_t index = __builtin_popcountll(UNWIND_REGISTERS & ((1ULL << perfReg) - 1));
+	if (index >= sample.regs_count)
+		return false;
+
+	*value = sample.regs_user[index];
+	return true;
+}
+
+static int findProcInfo(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t * pi, int needUnwindInfo, void * arg) {
+	UnwindContext * context = (UnwindContext *) arg;
+	const DwarfUnwinder::Object * object = context->unwinder->findObject(ip);
+	if (!object)
+		return -UNW_ENOINFO;
+
+	unw_dyn_info_t di;
+	memset(&di, 0, sizeof(di));
+	di.format = UNW_INFO_FORMAT_REMOTE_TABLE;
+	di.start_ip = object->start;
+	di.end_ip = object->end;
+	di.u.rti.segbase = object->eh_frame_hdr;
+	di.u.rti.table_data = object->table;
+	// In words; each entry is a pair of 32 bit offsets
+	di.u.rti.table_len = object->table_entries * 2 * sizeof(int32_t) / sizeof(unw_word_t);
+
+	return UNW_OBJ(dwarf_search_unwind_table)(as, ip, &di, pi, needUnwindInfo, arg);
+}
+
+static void putUnwindInfo(unw_addr_space_t as, unw_proc_info_t * pi, void * arg) {
+}
+
+static int getDynInfoListAddr(unw_addr_space_t as, unw_word_t * dilap, void * arg) {
+	return -UNW_ENOINFO;
+}
+
+static int accessMem(unw_addr_space_t as, unw_word_t addr, unw_word_t * valp, int write, void * arg) {
+	if (write)
+		return -UNW_EINVAL;
+
+	UnwindContext * context = (UnwindContext *) arg;
+	const DecodedPerfEvent& sample = *context->sample;
+
+	// The stack as it was when the sample was taken...
+	uint64_t sp;
+	if (sampledRegister(sample, STACK_POINTER, &sp) && addr >= sp && addr - sp + sizeof(unw_word_t) <= sample.stack_dyn_size) {
+		memcpy(valp, sample.stack_data + (addr - sp), sizeof(unw_word_t));
+		return 0;
+	}
+
+	// ... or the unwind tables, which are in our own address space
+	if (context->unwinder->isReadable(addr, sizeof(unw_word_t))) {
+		memcpy(valp, (const void *) addr, sizeof(unw_word_t));
+		return 0;
+	}
+
+	return -UNW_EINVAL;
+}
+
+static int accessReg(unw_addr_space_t as, unw_regnum_t regnum, unw_word_t * valp, int write, void * arg) {
+	if (write)
+		return -UNW_EREADONLYREG;
+
+	UnwindContext * context = (UnwindContext *) arg;
+	uint64_t value;
+	if (!sampledRegister(*context->sample, perfRegister(regnum), &value))
+		return -UNW_EBADREG;
+
+	*valp = value;
+	return 0;
+}
+
+static int accessFpreg(unw_addr_space_t as, unw_regnum_t regnum, unw_fpreg_t * fpvalp, int write, void * arg) {
+	return -UNW_EINVAL;
+}
+
+static int resume(unw_addr_space_t as, unw_cursor_t * cursor, void * arg) {
+	return -UNW_EINVAL;
+}
+
+static int getProcName(unw_addr_space_t as, unw_word_t addr, char * bufp, size_t bufLen, unw_word_t * offp, void * arg) {
+	return -UNW_EINVAL;
+}
+
+DwarfUnwinder::DwarfUnwinder() :
+	address_space_(NULL), adds_(0), subs_(0) {
+	unw_accessors_t accessors;
+	memset(&accessors, 0, sizeof(accessors));
+	accessors.find_proc_info = findProcInfo;
+	accessors.put_unwind_info = putUnwindInfo;
+	accessors.get_dyn_info_list_addr = getDynInfoListAddr;
+	accessors.access_mem = accessMem;
+	accessors.access_reg = accessReg;
+	accessors.access_fpreg = accessFpreg;
+	accessors.resume = resume;
+	accessors.get_proc_name = getProcName;
+
+	address_space_ = unw_create_addr_space(&accessors, 0);
+	if (!address_space_) {
+		LOG(WARNING) << "Unable to create libunwind address space";
+		return;
+	}
+	unw_set_caching_policy(address_space_, UNW_CACHE_GLOBAL);
+}
+
+DwarfUnwinder::~DwarfUnwinder() {
+	if (address_space_) {
+		unw_destroy_addr_space(address_space_);
+	}
+}
+
+struct LoadCounts {
+	unsigned long long adds;
+	unsigned long long subs;
+};
+
+static int readLoadCounts(dl_phdr_info * info, size_t size, void * data) {
+	LoadCounts * counts = (LoadCounts *) data;
+	if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+		counts->adds = info->dlpi_adds;
+		counts->subs = info->dlpi_subs;
+	}
+	// We only need the first object
+	return 1;
+}
+
+struct ObjectScan {
+	vector<DwarfUnwinder::Object> objects;
+	vector<DwarfUnwinder::Segment> segments;
+};
+
+static int scanObject(dl_phdr_info * info, size_t size, void * data) {
+	ObjectScan * scan = (ObjectScan *) data;
+
+	uint64_t textStart = ~((uint64_t) 0);
+	uint64_t textEnd = 0;
+	uint64_t ehFrameHdr = 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+		uint64_t start = info->dlpi_addr + phdr.p_vaddr;
+		if (phdr.p_type == PT_LOAD) {
+			DwarfUnwinder::Segment segment;
+			segment.start = start;
+			segment.end = start + phdr.p_memsz;
+			scan->segments.push_back(segment);
+
+			if (phdr.p_flags & PF_X) {
+				textStart = min(textStart, segment.start);
+				textEnd = max(textEnd, segment.end);
+			}
+		} else if (phdr.p_type == PT_GNU_EH_FRAME) {
+			ehFrameHdr = start;
+		}
+	}
+
+	if (!ehFrameHdr || textEnd == 0)
+		return 0;
+
+	// { u8 version, eh_frame_ptr_enc, fde_count_enc, table_enc; eh_frame_ptr; fde_count; table[] }
+	// We only handle the 4 byte encodings that the toolchains generate
+	const uint8_t * hdr = (const uint8_t *) ehFrameHdr;
+	if (hdr[0] != 1 || (hdr[1] & 0x0f) != EH_PE_SDATA4 || hdr[2] != EH_PE_UDATA4 || hdr[3] != (EH_PE_DATAREL | EH_PE_SDATA4)) {
+		return 0;
+	}
+
+	uint32_t fdeCount;
+	memcpy(&fdeCount, hdr + 8, sizeof(fdeCount));
+
+	DwarfUnwinder::Object object;
+	object.start = textStart;
+	object.end = textEnd;
+	object.eh_frame_hdr = ehFrameHdr;
+	object.table = ehFrameHdr + 12;
+	object.table_entries = fdeCount;
+	scan->objects.push_back(object);
+	return 0;
+}
+
+void DwarfUnwinder::refreshObjects() {
+	LoadCounts counts;
+	counts.adds = counts.subs = 0;
+	dl_iterate_phdr(readLoadCounts, &counts);
+	if (!objects_.empty() && counts.adds == adds_ && counts.subs == subs_)
+		return;
+
+	ObjectScan scan;
+	dl_iterate_phdr(scanObject, &scan);
+
+	sort(scan.objects.begin(), scan.objects.end(), [](const Object& a, const Object& b) {
+		return a.start < b.start;
+	});
+	sort(scan.segments.begin(), scan.segments.end(), [](const Segment& a, const Segment& b) {
+		return a.start < b.start;
+	});
+
+	objects_.swap(scan.objects);
+	segments_.swap(scan.segments);
+	adds_ = counts.adds;
+	subs_ = counts.subs;
+
+	// Cached unwind info may be for code that has gone
+	unw_flush_cache(address_space_, 0, 0);
+}
+
+const DwarfUnwinder::Object * DwarfUnwinder::findObject(uint64_t ip) {
+	auto it = upper_bound(objects_.begin(), objects_.end(), ip, [](uint64_t ip, const Object& object) {
+		return ip < object.start;
+	});
+	if (it == objects_.begin())
+		return NULL;
+	--it;
+	return (ip < it->end) ? &*it : NULL;
+}
+
+bool DwarfUnwinder::isReadable(uint64_t addr, size_t size) const {
+	auto it = upper_bound(segments_.begin(), segments_.end(), addr, [](uint64_t addr, const Segment& segment) {
+		return addr < segment.start;
+	});
+	if (it == segments_.begin())
+		return false;
+	--it;
+	return addr + size <= it->end;
+}
+
+struct LoadedUnwind {
+	DwarfUnwinder * unwinder;
+	const DecodedPerfEvent * sample;
+	uint64_t * ips;
+	int max_depth;
+	int depth;
+};
+
+static int unwindWithLoaderLock(dl_phdr_info * info, size_t size, void * data) {
+	LoadedUnwind * call = (LoadedUnwind *) data;
+	call->depth = call->unwinder->unwindLoaded(*call->sample, call->ips, call->max_depth);
+	// Once is enough
+	return 1;
+}
+
+int DwarfUnwinder::unwind(const DecodedPerfEvent& sample, uint64_t * ips, int maxDepth) {
+	if (!address_space_ || sample.regs_abi == PERF_SAMPLE_REGS_ABI_NONE || maxDepth <= 0)
+		return 0;
+
+	lock_guard<mutex> lock(mutex_);
+
+	// dl_iterate_phdr holds the loader's lock while it calls us, so that a library being unloaded
+	// (dlclose) waits for us to finish reading its tables.  The lock is recursive, so refreshObjects can
+	// call dl_iterate_phdr again.
+	LoadedUnwind call;
+	call.unwinder = this;
+	call.sample = &sample;
+	call.ips = ips;
+	call.max_depth = maxDepth;
+	call.depth = 0;
+	dl_iterate_phdr(unwindWithLoaderLock, &call);
+	return call.depth;
+}
+
+int DwarfUnwinder::unwindLoaded(const DecodedPerfEvent& sample, uint64_t * ips, int maxDepth) {
+	refreshObjects();
+
+	UnwindContext context;
+	context.unwinder = this;
+	context.sample = &sample;
+
+	unw_cursor_t cursor;
+	if (unw_init_remote(&cursor, address_space_, &context) < 0)
+		return 0;
+
+	int depth = 0;
+	while (depth < maxDepth) {
+		unw_word_t ip;
+		if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0 || ip == 0)
+			break;
+		ips[depth++] = ip;
+
+		if (unw_step(&cursor) <= 0)
+			break;
+	}
+	return depth;
+}
+
+}
+}
+}
@@ -0,0 +1,88 @@
+// See COPYRIGHT for copyright
+#ifndef DWARFUNWINDER_H_
+#define DWARFUNWINDER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+#include "PerfEvent.h"
+
+struct unw_addr_space;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Unwinds samples that carry the user registers (PERF_SAMPLE_REGS_USER) and a copy of the top of the
+ * user stack (PERF_SAMPLE_STACK_USER), using the .eh_frame unwind tables, so we get call graphs from
+ * code built without frame pointers.
+ *
+ * This is libunwind's remote unwinding: the registers and stack are those of the sample, not of the
+ * thread doing the unwinding. Any other memory libunwind reads must be in a loaded object (that's where
+ * the unwind tables are); we find the objects with dl_iterate_phdr and cache their .eh_frame_hdr
+ * lookup tables, refreshing them when libraries are loaded or unloaded. Each unwind runs inside a
+ * dl_iterate_phdr callback, holding the loader's lock, so no library can be unloaded while we read it.
+ *
+ * Only supported on x86-64. Safe to call from several threads.
+ */
+class DwarfUnwinder {
+public:
+	/// The registers to sample (sample_regs_user) for unwinding; 0 if we can't unwind on this platform
+	static uint64_t sampleRegisters();
+
+	DwarfUnwinder();
+	~DwarfUnwinder();
+
+	/// Writes the sample's ip and the return addresses above it into ips, returning how many.
+	/// Returns 0 if the sample has no user registers (e.g. it was taken in the kernel).
+	int unwind(const DecodedPerfEvent& sample, uint64_t * ips, int maxDepth);
+
+	/// An object's unwind table, as found through its PT_GNU_EH_FRAME header
+	struct Object {
+		uint64_t start;
+		uint64_t end;
+
+		/// The .eh_frame_hdr, and its sorted table of (initial location, FDE) pairs
+		uint64_t eh_frame_hdr;
+		uint64_t table;
+		uint64_t table_entries;
+	};
+
+	/// A range of a loaded object that libunwind may read (a PT_LOAD segment)
+	struct Segment {
+		uint64_t start;
+		uint64_t end;
+	};
+
+	/// Called with mutex_ held, by the libunwind accessors
+	const Object * findObject(uint64_t ip);
+	bool isReadable(uint64_t addr, size_t size) const;
+
+	/// unwind's work, called with mutex_ and the loader's lock held
+	int unwindLoaded(const DecodedPerfEvent& sample, uint64_t * ips, int maxDepth);
+
+private:
+	/// Reloads the objects if libraries have been loaded or unloaded since we last looked
+	void refreshObjects();
+
+	unw_addr_space * address_space_;
+
+	vector<Object> objects_;
+	vector<Segment> segments_;
+
+	/// dl_iterate_phdr's counts of loaded and unloaded objects when we last looked
+	unsigned long long adds_;
+	unsigned long long subs_;
+
+	mutex mutex_;
+};
+
+}
+}
+}
+
+#endif /* DWARFUNWINDER_H_ */
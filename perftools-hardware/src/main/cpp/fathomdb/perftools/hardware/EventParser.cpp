@@ -1,5 +1,7 @@
 // See COPYRIGHT for copyright
 #include "EventParser.h"
+#include <stdlib.h>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <glog/logging.h>
@@ -332,7 +334,150 @@ void SoftwareEvent::fillAttributes(perf_event_attr *attr) {
 	attr->config = id_;
 }
 
-void EventParser::parseEvent(const string& eventName, perf_event_attr *attr) {
+/*static*/EventModifiers EventModifiers::parse(const string& s) {
+	EventModifiers modifiers;
+
+	istringstream in(s);
+	string part;
+	while (getline(in, part, ':')) {
+		size_t equals = part.find('=');
+		if (equals != string::npos) {
+			string name = part.substr(0, equals);
+			string value = part.substr(equals + 1);
+
+			char * end;
+			uint64_t n = strtoull(value.c_str(), &end, 0);
+			if (value.empty() || *end != '\0' || n == 0) {
+				throw invalid_argument("Expected a positive number for event modifier: " + part);
+			}
+
+			if (name == "period") {
+				modifiers.period = n;
+			} else if (name == "freq") {
+				modifiers.freq = n;
+			} else {
+				throw invalid_argument("Unknown event modifier: " + name);
+			}
+			continue;
+		}
+
+		for (size_t i = 0; i < part.size(); i++) {
+			switch (part[i]) {
+			case 'p':
+				if (++modifiers.precise > MAX_PRECISE) {
+					throw invalid_argument("Too many 'p' modifiers (at most ppp): " + s);
+				}
+				break;
+
+			case 'd':
+				modifiers.data = true;
+				break;
+
+			case 'u':
+				modifiers.user = true;
+				break;
+
+			case 'k':
+				modifiers.kernel = true;
+				break;
+
+			default:
+				string message("Unknown event modifier: ");
+				message.append(1, part[i]);
+				throw invalid_argument(message);
+			}
+		}
+	}
+
+	if (modifiers.period && modifiers.freq) {
+		throw invalid_argument("An event can't have both period and freq: " + s);
+	}
+	return modifiers;
+}
+
+void EventModifiers::fillAttributes(perf_event_attr *attr) const {
+	CHECK_EQ(attr->size, sizeof(perf_event_attr))
+		;
+
+	attr->precise_ip = precise;
+
+	if (specifiesPrivilege()) {
+		attr->exclude_user = user ? 0 : 1;
+		attr->exclude_kernel = kernel ? 0 : 1;
+		attr->exclude_hv = 1;
+	}
+
+	if (period) {
+		attr->freq = 0;
+		attr->sample_period = period;
+	} else if (freq) {
+		attr->freq = 1;
+		attr->sample_freq = freq;
+	}
+}
+
+/*static*/unique_ptr<RawEvent> RawEvent::tryParse(const string& s) {
+	if (s.size() < 2 || s[0] != 'r' || s.find_first_not_of("0123456789abcdefABCDEF", 1) != string::npos) {
+		return nullptr;
+	}
+
+	unique_ptr<RawEvent> event(new RawEvent(strtoull(s.c_str() + 1, NULL, 16)));
+	return event;
+}
+
+void RawEvent::fillAttributes(perf_event_attr *attr) {
+	CHECK_EQ(attr->size, sizeof(perf_event_attr))
+		;
+
+	attr->type = PERF_TYPE_RAW;
+	attr->config = config_;
+}
+
+/*static*/EventModifiers EventParser::parseEvent(const string& eventSpec, perf_event_attr *attr) {
+	return parseEvent(eventSpec, attr, PmuRegistry::system());
+}
+
+/*static*/EventModifiers EventParser::parseEvent(const string& eventSpec, perf_event_attr *attr, const PmuRegistry& pmus) {
+	string eventName = eventSpec;
+	EventModifiers modifiers;
+
+	// A PMU event's modifiers follow its terms
+	size_t slash = eventSpec.rfind('/');
+	size_t colon = eventSpec.find(':', slash == string::npos ? 0 : slash);
+	bool closed = (slash != string::npos && slash != eventSpec.find('/'));
+	if (closed && slash + 1 < eventSpec.size() && colon == string::npos) {
+		// perf also accepts "cpu/.../pp"
+		eventName = eventSpec.substr(0, slash + 1);
+		modifiers = EventModifiers::parse(eventSpec.substr(slash + 1));
+	} else if (colon != string::npos) {
+		eventName = eventSpec.substr(0, colon);
+		modifiers = EventModifiers::parse(eventSpec.substr(colon + 1));
+	}
+
+	parseEventName(eventName, attr, pmus);
+	modifiers.fillAttributes(attr);
+	return modifiers;
+}
+
+/*static*/void EventParser::parseEventName(const string& eventName, perf_event_attr *attr, const PmuRegistry& pmus) {
+	size_t slash = eventName.find('/');
+	if (slash != string::npos) {
+		// pmu/terms/
+		if (eventName.size() < slash + 2 || eventName[eventName.size() - 1] != '/') {
+			throw invalid_argument("Expected pmu/terms/: " + eventName);
+		}
+		pmus.fillAttributes(eventName.substr(0, slash), eventName.substr(slash + 1, eventName.size() - slash - 2), attr);
+		return;
+	}
+
+	{
+		unique_ptr<RawEvent> event = RawEvent::tryParse(eventName);
+		if (event) {
+			event->fillAttributes(attr);
+			return;
+		}
+	}
+
 	{
 		unique_ptr<HardwareEvent> event = HardwareEvent::tryParse(eventName);
 		if (event) {
@@ -349,6 +494,14 @@ void EventParser::parseEvent(const string& eventName, perf_event_attr *attr) {
 		}
 	}
 
+	{
+		const PmuRegistry::Pmu * pmu = pmus.findEvent(eventName);
+		if (pmu) {
+			pmus.fillAttributes(pmu->name, eventName, attr);
+			return;
+		}
+	}
+
 	{
 		HardwareCacheEvent event = HardwareCacheEvent::parse(eventName);
 		event.fillAttributes(attr);
@@ -2,11 +2,14 @@
 #ifndef EVENTPARSER_H_
 #define EVENTPARSER_H_
 
+#include <stdint.h>
 #include <string>
 #include <memory>
 
 #include <linux/perf_event.h>
 
+#include "PmuRegistry.h"
+
 namespace fathomdb {
 namespace perftools {
 namespace hardware {
@@ -72,9 +75,91 @@ private:
 	perf_sw_ids id_;
 };
 
+/// A raw PMU event code, as in "r1a8" (PERF_TYPE_RAW: the config is the CPU's own event encoding)
+class RawEvent {
+public:
+	static unique_ptr<RawEvent> tryParse(const string& s);
+
+	RawEvent(uint64_t config) :
+		config_(config) {
+	}
+
+	void fillAttributes(perf_event_attr *attr);
+
+private:
+	uint64_t config_;
+};
+
+/**
+ * The modifiers after an event's name, separated by ':', as in "l1d-read-miss:ppd" or "cycles:u:period=2000003":
+ *
+ *	p		precise: each p asks the PMU to attribute samples more exactly to the instruction that caused them (precise_ip, up to ppp)
+ *	d		data: record the data address, data source and weight (access latency) of each sample
+ *	u		count in user space only
+ *	k		count in the kernel only
+ *	period=N	sample every N events
+ *	freq=N		sample about N times a second (the kernel adjusts the period to match)
+ *
+ * Letters can be run together ("upp"). Without u or k the event counts wherever the profile's options say,
+ * and without period or freq it samples at the profile's default rate.
+ *
+ * The data addresses need an event the PMU can attribute to a memory access (e.g. a precise load or store
+ * event); other events report them as 0. Only the event name is parsed before the ':', so an option
+ * name (e.g. "branches") can't take modifiers; use its long form ("branch-instructions:pp").
+ * For a PMU event the modifiers follow the closing '/', as in "cpu/mem-loads,ldlat=30/pd".
+ */
+class EventModifiers {
+public:
+	static const int MAX_PRECISE = 3;
+
+	int precise;
+	bool data;
+
+	bool user;
+	bool kernel;
+
+	/// 0 if not given
+	uint64_t period;
+	uint64_t freq;
+
+	EventModifiers() :
+		precise(0), data(false), user(false), kernel(false), period(0), freq(0) {
+	}
+
+	/// Whether u or k was given; if so they decide exclude_user and exclude_kernel
+	bool specifiesPrivilege() const {
+		return user || kernel;
+	}
+
+	/// Whether period or freq was given; if so they decide the sampling rate
+	bool specifiesRate() const {
+		return period != 0 || freq != 0;
+	}
+
+	static EventModifiers parse(const string& s);
+
+	void fillAttributes(perf_event_attr *attr) const;
+};
+
+/**
+ * Parses an event, in any of perf's forms:
+ *
+ *	cycles, page-faults, l1d-read-miss	the generic hardware, software and cache events
+ *	r1a8					a raw event code for the CPU
+ *	cpu/event=0x3c,umask=0x0,cmask=1/	a PMU's event from its terms (see PmuRegistry)
+ *	cpu/mem-loads/, mem-loads		a PMU's named event
+ *
+ * each optionally followed by modifiers (see EventModifiers).
+ */
 class EventParser {
 public:
-	static void parseEvent(const string& eventName, perf_event_attr *attr);
+	/// Parses "name" or "name:modifiers" into attr, returning the modifiers; PMU events are those of this machine
+	static EventModifiers parseEvent(const string& eventSpec, perf_event_attr *attr);
+
+	static EventModifiers parseEvent(const string& eventSpec, perf_event_attr *attr, const PmuRegistry& pmus);
+
+private:
+	static void parseEventName(const string& eventName, perf_event_attr *attr, const PmuRegistry& pmus);
 };
 
 }
@@ -2,8 +2,11 @@
 #include "EventSet.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
@@ -13,8 +16,12 @@
 #include <glog/logging.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -36,72 +43,284 @@ namespace fathomdb {
 namespace perftools {
 namespace hardware {
 
-FileDescriptorPollList::FileDescriptorPollList(int max) :
-	pollfd_array_(0), count_(0), max_(max) {
-	pollfd_array_ = new pollfd[max_];
-	memset(pollfd_array_, 0, sizeof(pollfd) * max_);
+FileDescriptorPollList::FileDescriptorPollList() :
+	epoll_fd_(-1), wake_fd_(-1), events_(new epoll_event[MAX_EVENTS]) {
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		throw invalid_argument("Unable to create epoll descriptor");
+	}
+
+	wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd_ < 0) {
+		close(epoll_fd_);
+		throw invalid_argument("Unable to create eventfd");
+	}
+
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = WAKE_TOKEN;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) != 0) {
+		close(wake_fd_);
+		close(epoll_fd_);
+		throw invalid_argument("Unable to add eventfd to epoll");
+	}
 }
 
-void FileDescriptorPollList::add(int fd) {
-	fcntl(fd, F_SETFL, O_NONBLOCK);
+FileDescriptorPollList::~FileDescriptorPollList() {
+	close(wake_fd_);
+	close(epoll_fd_);
+}
 
-	if (count_ >= max_)
-		throw invalid_argument("Declared maximum number of polled file descriptors reached");
+void FileDescriptorPollList::add(int fd, uint64_t token) {
+	CHECK_NE(token, WAKE_TOKEN);
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
 
-	pollfd& p = pollfd_array_[count_];
-	p.fd = fd;
-	p.events = POLLIN;
-	p.revents = 0;
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = token;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+		perror("Error adding descriptor to epoll");
+		throw invalid_argument("Unable to add descriptor to poll list");
+	}
+}
 
-	count_++;
+void FileDescriptorPollList::remove(int fd) {
+	// (Closing the descriptor also removes it)
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, &event) != 0) {
+		perror("Error removing descriptor from epoll");
+	}
 }
 
-int FileDescriptorPollList::poll(int timeout) {
-	int ret = ::poll(pollfd_array_, count_, timeout);
-	if (ret >= 0)
-		return ret;
+int FileDescriptorPollList::poll(vector<uint64_t>& ready, int timeout) {
+	int ret = epoll_wait(epoll_fd_, events_.get(), MAX_EVENTS, timeout);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
 
-	// Error
-	perror("Error doing event poll");
-	return -1;
+		// Error
+		perror("Error doing event poll");
+		return -1;
+	}
+
+	int count = 0;
+	for (int i = 0; i < ret; i++) {
+		uint64_t token = events_[i].data.u64;
+		if (token == WAKE_TOKEN) {
+			uint64_t value;
+			if (read(wake_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+				perror("Error reading eventfd");
+			}
+			continue;
+		}
+		ready.push_back(token);
+		count++;
+	}
+	return count;
+}
+
+void FileDescriptorPollList::wake() {
+	uint64_t value = 1;
+	if (write(wake_fd_, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		perror("Error writing eventfd");
+	}
 }
 
 EventSet::~EventSet() {
 }
 
-Event::Event(const EventSpecification& specification, cpuid_t cpu, pid_t tid) :
-	specification_(specification), cpu_(cpu), tid_(tid), fd_(-1) {
-	open();
+Event::Event(const EventSpecification& specification, cpuid_t cpu, pid_t tid, int groupFd) :
+	specification_(specification), cpu_(cpu), tid_(tid), fd_(-1), id_(0) {
+	open(groupFd);
 }
 
-EventSpecification::EventSpecification(const perf_event_attr& attr, const string& name) :
-	attr_(attr), name_(name) {
+Event::~Event() {
+	if (fd_ != -1) {
+		close(fd_);
+	}
 }
 
-/*static*/vector<cpuid_t> CpuSet::getAllCpusSimple() {
-	// The perf subsystem parses the list of CPUs that are actually online.
-	// That's way too hard for now.
-	int cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
-	if (cpuCount < 0)
-		throw invalid_argument("Cannot determine number of CPUs in system");
+EventSpecification::EventSpecification(const perf_event_attr& attr, const string& name, int group, bool groupLeader,
+		const EventModifiers& modifiers) :
+	attr_(attr), name_(name), modifiers_(modifiers), group_(group), group_leader_(groupLeader) {
+}
 
+/*static*/const char * CpuSet::ONLINE_PATH = "/sys/devices/system/cpu/online";
+/*static*/const char * CpuSet::NODE_ROOT = "/sys/devices/system/node";
+
+/*static*/vector<cpuid_t> CpuSet::parseCpuList(const string& list) {
 	vector<cpuid_t> cpus;
-	for (int i = 0; i < cpuCount; i++) {
-		cpus.push_back(i);
+
+	istringstream in(list);
+	string range;
+	while (getline(in, range, ',')) {
+		boost::trim(range);
+		if (range.empty())
+			continue;
+
+		// "low-high", or a single CPU
+		int low, high;
+		char dash = '-';
+		int fields = sscanf(range.c_str(), "%d%c%d", &low, &dash, &high);
+		if (fields == 1) {
+			high = low;
+		}
+		if (fields == 0 || fields == 2 || dash != '-' || low < 0 || high < low)
+			throw invalid_argument("Bad CPU list: " + list);
+		for (int cpu = low; cpu <= high; cpu++) {
+			cpus.push_back(cpu);
+		}
 	}
+
+	sort(cpus.begin(), cpus.end());
+	cpus.erase(unique(cpus.begin(), cpus.end()), cpus.end());
 	return cpus;
 }
 
-/*static*/CpuSet CpuSet::buildEachCpu() {
-	static vector<cpuid_t> allCpus;
+// The CPUs in a thread's affinity mask; false if we can't tell
+static bool getAffinity(pid_t tid, vector<cpuid_t>& cpus) {
+	// The kernel rejects a mask smaller than its own, so grow until it fits
+	for (int size = 1024; size <= 1024 * 1024; size *= 2) {
+		cpu_set_t * mask = CPU_ALLOC(size);
+		size_t bytes = CPU_ALLOC_SIZE(size);
+		int ret = sched_getaffinity(tid, bytes, mask);
+		if (ret == 0) {
+			for (int cpu = 0; cpu < size; cpu++) {
+				if (CPU_ISSET_S(cpu, bytes, mask))
+					cpus.push_back(cpu);
+			}
+		}
+		CPU_FREE(mask);
 
-	if (allCpus.empty()) {
-		// We know there's at least one CPU :-)
-		vector<cpuid_t> cpus = getAllCpusSimple();
-		allCpus.swap(cpus);
+		if (ret == 0)
+			return true;
+		if (errno != EINVAL)
+			break;
 	}
+	return false;
+}
+
+// A CPU (or node) list from sysfs; empty if there isn't one
+static vector<cpuid_t> readCpuList(const string& path) {
+	vector<cpuid_t> cpus;
 
-	return CpuSet(allCpus);
+	ifstream ifs(path.c_str());
+	string line;
+	if (!ifs.fail() && getline(ifs, line)) {
+		cpus = CpuSet::parseCpuList(line);
+	}
+	return cpus;
+}
+
+static string nodeCpuListPath(int node) {
+	ostringstream path;
+	path << CpuSet::NODE_ROOT << "/node" << node << "/cpulist";
+	return path.str();
+}
+
+// The CPUs any of our threads may run on: threads are often pinned (e.g. the http io threads), so no one
+// thread's mask stands for the process's. False if we can't read any of them.
+static bool getProcessAffinity(vector<cpuid_t>& cpus) {
+	bool found = false;
+
+	vector<pid_t> threads = LinuxThreadDiscovery::discoverThreads(getpid());
+	for (auto it = threads.begin(); it != threads.end(); it++) {
+		// A thread may have exited since we listed it
+		vector<cpuid_t> allowed;
+		if (!getAffinity(*it, allowed))
+			continue;
+
+		vector<cpuid_t> merged;
+		set_union(cpus.begin(), cpus.end(), allowed.begin(), allowed.end(), back_inserter(merged));
+		cpus.swap(merged);
+		found = true;
+	}
+	return found;
+}
+
+/*static*/vector<cpuid_t> CpuSet::readOnlineCpus() {
+	vector<cpuid_t> cpus = readCpuList(ONLINE_PATH);
+
+	if (cpus.empty()) {
+		// Without sysfs, the best we can do is assume they're numbered from 0
+		int cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpuCount < 0)
+			throw invalid_argument("Cannot determine number of CPUs in system");
+
+		for (int i = 0; i < cpuCount; i++) {
+			cpus.push_back(i);
+		}
+	}
+	return cpus;
+}
+
+// Just those of cpus on the NUMA node
+static vector<cpuid_t> onNode(const vector<cpuid_t>& cpus, int node) {
+	vector<cpuid_t> nodeCpus = readCpuList(nodeCpuListPath(node));
+	vector<cpuid_t> both;
+	set_intersection(cpus.begin(), cpus.end(), nodeCpus.begin(), nodeCpus.end(), back_inserter(both));
+	return both;
+}
+
+/*static*/vector<cpuid_t> CpuSet::getOnlineCpus(int node) {
+	vector<cpuid_t> cpus = readOnlineCpus();
+
+	// Our threads can't run (and so can't be sampled) on other CPUs. Threads that widen this later are
+	// picked up by the hotplug check, which calls us again.
+	vector<cpuid_t> allowed;
+	if (getProcessAffinity(allowed)) {
+		vector<cpuid_t> both;
+		set_intersection(cpus.begin(), cpus.end(), allowed.begin(), allowed.end(), back_inserter(both));
+		if (!both.empty()) {
+			cpus.swap(both);
+		}
+	}
+
+	if (node != -1) {
+		cpus = onNode(cpus, node);
+	}
+	return cpus;
+}
+
+/*static*/CpuSet CpuSet::buildEachCpu(int node) {
+	return CpuSet(getOnlineCpus(node), node);
+}
+
+/*static*/vector<int> CpuSet::getNodes() {
+	// The online nodes are listed in the same format as CPUs
+	vector<int> nodes;
+	vector<cpuid_t> online = readCpuList(string(NODE_ROOT) + "/online");
+	if (online.empty()) {
+		return nodes;
+	}
+
+	// Walking our threads' affinities once will do for every node
+	vector<cpuid_t> cpus = getOnlineCpus(-1);
+	for (auto it = online.begin(); it != online.end(); it++) {
+		// Memory-only nodes have no CPUs
+		if (!onNode(cpus, *it).empty()) {
+			nodes.push_back(*it);
+		}
+	}
+	return nodes;
+}
+
+bool CpuSet::contains(cpuid_t cpu) const {
+	return find(cpus_.begin(), cpus_.end(), cpu) != cpus_.end();
+}
+
+void CpuSet::add(cpuid_t cpu) {
+	if (!contains(cpu)) {
+		cpus_.insert(lower_bound(cpus_.begin(), cpus_.end(), cpu), cpu);
+	}
+}
+
+void CpuSet::remove(cpuid_t cpu) {
+	cpus_.erase(std::remove(cpus_.begin(), cpus_.end(), cpu), cpus_.end());
 }
 
 /*static*/CpuSet CpuSet::buildWildcard() {
@@ -111,10 +330,12 @@ EventSpecification::EventSpecification(const perf_event_attr& attr, const string
 	return CpuSet(move(cpus));
 }
 
-///*static*/ThreadSet ThreadSet::findThreadsInProcess(pid_t pid) {
-//	vector<pid_t> threads = LinuxThreadDiscovery::discoverThreads(pid);
-//	return ThreadSet(move(threads));
-//}
+/*static*/ThreadSet ThreadSet::findThreadsInProcess(pid_t pid) {
+	vector<pid_t> threads = LinuxThreadDiscovery::discoverThreads(pid);
+	ThreadSet threadSet(move(threads));
+	threadSet.process_ = pid;
+	return threadSet;
+}
 
 
 /*static*/ThreadSet ThreadSet::buildSingleProcess(pid_t pid) {
@@ -130,21 +351,101 @@ EventSpecification::EventSpecification(const perf_event_attr& attr, const string
 }
 
 
-EventChannel& EventChannelSet::getChannel(key_t key) {
-	unique_ptr<EventChannel>& channel = channels_[key];
-	if (!channel) {
-		channel.reset(new EventChannel(format_));
+map<EventChannelSet::key_t, uint64_t> EventChannelSet::lostCounts() const {
+	lock_guard<mutex> lock(mutex_);
+
+	map<key_t, uint64_t> counts;
+	for (size_t i = 0; i < channels_.size(); i++) {
+		if (channels_[i]) {
+			counts[keys_[i]] = channels_[i]->lostCount();
+		}
+	}
+	return counts;
+}
+
+uint64_t EventChannelSet::retiredLostCount() const {
+	lock_guard<mutex> lock(mutex_);
+	return retired_lost_;
+}
+
+uint64_t EventChannelSet::tornCount() const {
+	lock_guard<mutex> lock(mutex_);
+
+	uint64_t count = retired_torn_;
+	for (size_t i = 0; i < channels_.size(); i++) {
+		if (channels_[i]) {
+			count += channels_[i]->tornCount();
+		}
+	}
+	return count;
+}
+
+uint64_t EventChannelSet::throttledCount() const {
+	lock_guard<mutex> lock(mutex_);
+
+	uint64_t count = retired_throttled_;
+	for (size_t i = 0; i < channels_.size(); i++) {
+		if (channels_[i]) {
+			count += channels_[i]->throttledCount();
+		}
+	}
+	return count;
+}
+
+size_t EventChannelSet::getIndex(key_t key) {
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = indexes_.find(key);
+	if (it != indexes_.end()) {
+		return it->second;
+	}
+
+	unique_ptr<EventChannel> channel(new EventChannel(format_, overwrite_, record_listener_));
+
+	size_t index;
+	if (!free_.empty()) {
+		index = free_.back();
+		free_.pop_back();
+		channels_[index] = move(channel);
+		keys_[index] = key;
+	} else {
+		index = channels_.size();
+		channels_.push_back(move(channel));
 		keys_.push_back(key);
 	}
-	return *channel;
+	indexes_[key] = index;
+	return index;
+}
+
+ssize_t EventChannelSet::findIndex(key_t key) const {
+	lock_guard<mutex> lock(mutex_);
+
+	auto it = indexes_.find(key);
+	if (it == indexes_.end()) {
+		return -1;
+	}
+	return it->second;
+}
+
+void EventChannelSet::remove(size_t index) {
+	lock_guard<mutex> lock(mutex_);
+
+	CHECK(channels_[index]);
+	retired_lost_ += channels_[index]->lostCount();
+	retired_torn_ += channels_[index]->tornCount();
+	retired_throttled_ += channels_[index]->throttledCount();
+
+	indexes_.erase(keys_[index]);
+	channels_[index].reset();
+	free_.push_back(index);
 }
 
-void EventChannel::add(int fd, FileDescriptorPollList& pollList) {
+void EventChannel::add(int fd, FileDescriptorPollList& pollList, uint64_t token) {
 	if (mmap_) {
 		joinMmap(fd, mmap_fd_);
 	} else {
 		doMmap(fd);
-		pollList.add(fd);
+		pollList.add(fd, token);
 	}
 }
 
@@ -168,6 +469,10 @@ void Event::setEnabled(bool enable) {
 	}
 }
 
+bool Event::setSampleRate(uint64_t value) {
+	return ioctl(fd_, PERF_EVENT_IOC_PERIOD, &value) == 0;
+}
+
 void Event::readEvent(void *buf, size_t size) {
 	ssize_t ret = read(fd_, buf, size);
 	if (ret != ((ssize_t) size)) {
@@ -179,41 +484,145 @@ void Event::readEvent(void *buf, size_t size) {
 	}
 }
 
-void Event::open() {
+// The highest precise_ip below attr's that the event opens with, or -1 if it doesn't open with any
+static int highestPreciseLevel(perf_event_attr attr, pid_t tid, int cpu, int groupFd) {
+	while (attr.precise_ip > 0) {
+		attr.precise_ip--;
+		int fd = sys_perf_event_open(&attr, tid, cpu, groupFd, 0);
+		if (fd != -1) {
+			close(fd);
+			return attr.precise_ip;
+		}
+		if (errno != EINVAL && errno != EOPNOTSUPP) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+void Event::open(int groupFd) {
 	CHECK_EQ(fd_, -1)
 		;
 
-	fd_ = sys_perf_event_open(&specification_.attr(), tid_, cpu_, -1, 0);
+	fd_ = sys_perf_event_open(&specification_.attr(), tid_, cpu_, groupFd, 0);
 
 	if (fd_ == -1) {
-		err(1, "cannot attach event to CPU%d %s", cpu_, name().c_str());
-		throw invalid_argument("Error attaching event");
+		// Don't exit: counters are opened on demand (e.g. over HTTP), and a bad event name shouldn't kill us.
+		// ESRCH (the thread has exited) and ENODEV (the CPU has gone offline) are expected, and callers
+		// handle them, so aren't worth a warning.
+		int error = errno;
+		if (error != ESRCH && error != ENODEV) {
+			warn("cannot attach event to CPU%d %s", cpu_, name().c_str());
+		}
+		if (error == EOPNOTSUPP && (specification_.attr().sample_type & PERF_SAMPLE_BRANCH_STACK)) {
+			throw EventOpenError("Branch stack sampling (LBR) is not supported for event: " + name(), error);
+		}
+		if ((error == EOPNOTSUPP || error == EINVAL) && specification_.attr().precise_ip) {
+			// EINVAL could be anything, so only blame precise_ip if the event opens without it
+			int supported = highestPreciseLevel(specification_.attr(), tid_, cpu_, groupFd);
+			if (supported == 0) {
+				throw EventOpenError("Precise sampling is not supported for event: " + name(), error);
+			}
+			if (supported > 0) {
+				ostringstream message;
+				message << "Precise sampling level " << (int) specification_.attr().precise_ip << " is not supported for event: " << name()
+						<< " (the highest it opens with is " << supported << ")";
+				throw EventOpenError(message.str(), error);
+			}
+		}
+		throw EventOpenError("Error attaching event: " + name() + ": " + strerror(error), error);
+	}
+
+#ifdef PERF_EVENT_IOC_ID
+	if (ioctl(fd_, PERF_EVENT_IOC_ID, &id_) != 0) {
+		id_ = 0;
+	}
+#endif
+}
+
+bool EventSetSpecifier::hasGroups() const {
+	for (auto it = events_.begin(); it != events_.end(); it++) {
+		if (it->group() != -1)
+			return true;
 	}
+	return false;
 }
 
-/*static*/EventSetSpecifier EventSetSpecifier::parse(const string& eventSpec) {
+bool EventSetSpecifier::hasDataAddresses() const {
+	for (auto it = events_.begin(); it != events_.end(); it++) {
+		if (it->modifiers().data)
+			return true;
+	}
+	return false;
+}
+
+/*static*/EventSetSpecifier EventSetSpecifier::parse(const string& eventSpec, const PmuRegistry& pmus) {
 	vector<EventSpecification> events;
 
-	vector<string> eventNames;
-	boost::algorithm::split(eventNames, eventSpec, boost::algorithm::is_any_of(","));
+	int groupCount = 0;
+	int group = -1;
+	bool leader = false;
+
+	string eventName;
+
+	// Inside a PMU event's "pmu/terms/", commas separate terms rather than events
+	bool inTerms = false;
+
+	for (size_t i = 0; i <= eventSpec.size(); i++) {
+		char c = (i < eventSpec.size()) ? eventSpec[i] : ',';
+
+		if (c == '/') {
+			inTerms = !inTerms;
+		}
+
+		if (inTerms && i < eventSpec.size()) {
+			eventName.push_back(c);
+			continue;
+		}
+
+		if (c == '{') {
+			if (group != -1 || !eventName.empty())
+				throw invalid_argument("Unexpected '{' in event specification: " + eventSpec);
+			group = groupCount++;
+			leader = true;
+			continue;
+		}
+
+		if (c != ',' && c != '}') {
+			eventName.push_back(c);
+			continue;
+		}
 
-	for (size_t i = 0; i < eventNames.size(); i++) {
-		const string& eventName = eventNames[i];
+		if (!eventName.empty()) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(perf_event_attr));
+			attr.size = sizeof(attr);
 
-		perf_event_attr attr;
-		memset(&attr, 0, sizeof(perf_event_attr));
-		attr.size = sizeof(attr);
+			EventModifiers modifiers = EventParser::parseEvent(eventName, &attr, pmus);
+			//		LOG(INFO) << "Parsed " << eventName << " => " << attr.type << ":" << attr.config;
 
-		EventParser::parseEvent(eventName, &attr);
-		//		LOG(INFO) << "Parsed " << eventName << " => " << attr.type << ":" << attr.config;
+			events.push_back(EventSpecification(attr, eventName, group, leader, modifiers));
+			leader = false;
+			eventName.clear();
+		}
 
-		events.push_back(EventSpecification(attr, eventName));
+		if (c == '}') {
+			if (group == -1)
+				throw invalid_argument("Unexpected '}' in event specification: " + eventSpec);
+			group = -1;
+		}
 	}
 
+	if (inTerms)
+		throw invalid_argument("Unterminated '/' in event specification: " + eventSpec);
+	if (group != -1)
+		throw invalid_argument("Unterminated '{' in event specification: " + eventSpec);
+
 	return EventSetSpecifier(move(events));
 }
 
 void EventSet::setEnabled(bool enable) {
+	enabled_ = enable;
 	for (auto it = events_.begin(); it != events_.end(); it++) {
 		(*it)->setEnabled(enable);
 	}
@@ -225,56 +634,234 @@ void EventSet::setEnabled(bool enable) {
 //}
 
 EventSet::EventSet(const EventSetSpecifier& eventSetSpec, const CpuSet& cpus, const ThreadSet& threads) :
-	cpus_(cpus), threads_(threads), event_spec_(eventSetSpec) {
+	cpus_(cpus), threads_(threads), event_spec_(eventSetSpec), enabled_(false), rate_scale_(1.0) {
 	buildEvents(eventSetSpec);
 }
 
 void EventSet::buildEvents(const EventSetSpecifier& eventSetSpec) {
-	for (size_t k = 0; k < eventSetSpec.size(); k++) {
-		const EventSpecification& eventSpec = eventSetSpec[k];
+	CHECK(cpus_.size() != 0);
+	CHECK(threads_.size() != 0);
+
+	vector<cpuid_t> offline;
+	for (size_t i = 0; i < cpus_.size(); i++) {
+		for (size_t j = 0; j < threads_.size(); j++) {
+			// A thread we discovered may exit, or a CPU go offline, before we get to it
+			vector<unique_ptr<Event> > events;
+			try {
+				openEvents(cpus_[i], threads_[j], events);
+			} catch (EventOpenError& e) {
+				if (e.error() == ESRCH && threads_.process() != -1)
+					continue;
+				if (e.error() == ENODEV && cpus_[i] != -1) {
+					offline.push_back(cpus_[i]);
+					break;
+				}
+				throw;
+			}
+			for (auto it = events.begin(); it != events.end(); it++) {
+				events_.push_back(move(*it));
+			}
+		}
+	}
+
+	// So that attachCpu opens them if they come back
+	for (auto it = offline.begin(); it != offline.end(); it++) {
+		detachCpu(*it);
+	}
+}
 
-		CHECK(cpus_.size() != 0);
-		CHECK(threads_.size() != 0);
+void EventSet::openEvents(cpuid_t cpu, pid_t tid, vector<unique_ptr<Event> >& events) {
+	// Each (cpu, tid) gets its own instance of each group, led by the first event we open
+	map<int, int> leaderFds;
 
-		for (size_t i = 0; i < cpus_.size(); i++) {
-			for (size_t j = 0; j < threads_.size(); j++) {
-				unique_ptr<Event> event(new Event(eventSpec, cpus_[i], threads_[j]));
-				events_.push_back(move(event));
-			}
+	for (size_t k = 0; k < event_spec_.size(); k++) {
+		const EventSpecification& eventSpec = event_spec_[k];
+
+		int groupFd = -1;
+		if (eventSpec.isGroupSibling()) {
+			auto leader = leaderFds.find(eventSpec.group());
+			CHECK(leader != leaderFds.end());
+			groupFd = leader->second;
 		}
+
+		unique_ptr<Event> event(new Event(eventSpec, cpu, tid, groupFd));
+		if (eventSpec.isGroupLeader()) {
+			leaderFds[eventSpec.group()] = event->fileDescriptor();
+		}
+		events.push_back(move(event));
 	}
 }
 
-//Event& EventSet::attachThread(pid_t tid) {
-//	if (cpus_.size() != 0) {
-//		throw invalid_argument("Attempt to attach to thread when running in CPU mode");
-//	}
-//
-//	// TODO: Add to thread list?  Do we need to keep cpus/threads anyway?
-//
-//	// TODO: Validate uniqueness?
-//
-//	for (size_t j = 0; j < event_spec_.size(); j++) {
-//		const EventSpecification& eventSpec = event_spec_[j];
-//		unique_ptr<Event> event(new Event(eventSpec, -1, tid));
-//		events_.push_back(move(event));
-//	}
-//
-//	return *events_.back();
-//}
+bool EventSet::hasThread(pid_t tid) const {
+	for (auto it = events_.begin(); it != events_.end(); it++) {
+		if ((*it)->tid() == tid)
+			return true;
+	}
+	return false;
+}
+
+vector<Event *> EventSet::attachThread(pid_t tid) {
+	CHECK(isPerThread());
+
+	vector<Event *> attached;
+	if (hasThread(tid)) {
+		return attached;
+	}
+
+	vector<unique_ptr<Event> > events;
+	try {
+		openEvents(-1, tid, events);
+	} catch (EventOpenError& e) {
+		if (e.error() == ESRCH) {
+			// It has already gone
+			return attached;
+		}
+		throw;
+	}
+
+	return adoptEvents(events);
+}
 
-EventChannel::EventChannel(SampleFormat format, bool overwrite, int pages) :
-	overwrite_(overwrite), mmap_(0), mmap_fd_(-1), last_read_offset_(0), format_(format) {
+vector<Event *> EventSet::attachCpu(cpuid_t cpu) {
+	CHECK(isPerCpu());
+
+	vector<Event *> attached;
+	if (cpus_.contains(cpu)) {
+		return attached;
+	}
+
+	vector<unique_ptr<Event> > events;
+	try {
+		for (size_t j = 0; j < threads_.size(); j++) {
+			openEvents(cpu, threads_[j], events);
+		}
+	} catch (EventOpenError& e) {
+		if (e.error() == ENODEV) {
+			// It has already gone
+			return attached;
+		}
+		throw;
+	}
+
+	cpus_.add(cpu);
+	return adoptEvents(events);
+}
+
+void EventSet::detachCpu(cpuid_t cpu) {
+	CHECK(isPerCpu());
+
+	// Closes the descriptors
+	events_.erase(remove_if(events_.begin(), events_.end(), [cpu](const unique_ptr<Event>& event) {
+		return event->cpu() == cpu;
+	}), events_.end());
+	cpus_.remove(cpu);
+}
+
+vector<Event *> EventSet::adoptEvents(vector<unique_ptr<Event> >& events) {
+	vector<Event *> attached;
+	for (auto it = events.begin(); it != events.end(); it++) {
+		if (rate_scale_ != 1.0) {
+			applyRateScale(**it);
+		}
+		if (enabled_) {
+			(*it)->setEnabled(true);
+		}
+		attached.push_back(it->get());
+		events_.push_back(move(*it));
+	}
+	return attached;
+}
+
+SampleRate SampleRate::scaled(double scale) const {
+	SampleRate rate(*this);
+	if (freq) {
+		rate.value = max((uint64_t) 1, (uint64_t) (value * scale));
+	} else {
+		rate.value = max((uint64_t) 1, (uint64_t) (value / scale));
+	}
+	return rate;
+}
+
+// Whether the event samples (rather than just counts); only those have a rate
+static bool isSampling(const EventSpecification& spec) {
+	return !spec.isGroupSibling() && (spec.attr().freq ? spec.attr().sample_freq : spec.attr().sample_period) != 0;
+}
+
+static SampleRate specifiedRate(const EventSpecification& spec) {
+	SampleRate rate;
+	rate.event = spec.name();
+	rate.freq = spec.attr().freq;
+	rate.value = spec.attr().freq ? spec.attr().sample_freq : spec.attr().sample_period;
+	return rate;
+}
+
+vector<SampleRate> EventSetSpecifier::sampleRates() const {
+	vector<SampleRate> rates;
+	for (auto it = events_.begin(); it != events_.end(); it++) {
+		if (isSampling(*it)) {
+			rates.push_back(specifiedRate(*it));
+		}
+	}
+	return rates;
+}
+
+vector<SampleRate> EventSet::sampleRates() const {
+	return event_spec_.sampleRates();
+}
+
+void EventSet::applyRateScale(Event& event) {
+	if (!isSampling(event.specification()))
+		return;
+
+	SampleRate rate = specifiedRate(event.specification()).scaled(rate_scale_);
+	if (!event.setSampleRate(rate.value)) {
+		LOG(WARNING) << "Cannot change sample rate of event " << event.name() << " to " << rate.value;
+	}
+}
+
+void EventSet::scaleSampleRates(double scale) {
+	rate_scale_ = scale;
+	for (auto it = events_.begin(); it != events_.end(); it++) {
+		applyRateScale(**it);
+	}
+}
+
+void EventSet::detachThread(pid_t tid) {
+	CHECK(isPerThread());
+
+	// Closes the descriptors
+	events_.erase(remove_if(events_.begin(), events_.end(), [tid](const unique_ptr<Event>& event) {
+		return event->tid() == tid;
+	}), events_.end());
+}
+
+const Event * EventSet::findById(uint64_t id) const {
+	for (auto it = events_.begin(); it != events_.end(); it++) {
+		if ((*it)->id() == id)
+			return it->get();
+	}
+	return NULL;
+}
+
+EventChannel::EventChannel(SampleFormat format, bool overwrite, RecordListener * recordListener, int pages) :
+	overwrite_(overwrite), record_listener_(recordListener), mmap_(0), mmap_fd_(-1), last_read_offset_(0), format_(format), lost_(0), torn_(0), throttled_(0) {
 	buffer_size_ = PAGE_SIZE * pages;
 	buffer_mask_ = buffer_size_ - 1;
 }
 
+EventChannel::~EventChannel() {
+	if (mmap_) {
+		munmap(mmap_, buffer_size_ + PAGE_SIZE);
+	}
+}
+
 void EventChannel::doMmap(int fd) {
 	CHECK_GE(fd, 0)
 		;
 
+	// A writable mapping is how we tell the kernel we'll maintain data_tail
 	int prot = PROT_READ;
-	if (overwrite_)
+	if (!overwrite_)
 		prot |= PROT_WRITE;
 
 	/* One extra page for the header*/
@@ -303,141 +890,318 @@ void EventChannel::joinMmap(int fd, int joinToFd) {
 }
 
 int EventChannel::readEvents(EventSink& sink) {
+	perf_event_mmap_page * page = (perf_event_mmap_page*) mmap_;
+
+	uint64_t head = page->data_head;
+	barrier();
+
+	if (overwrite_ && head - last_read_offset_ > buffer_size_) {
+		// The kernel has lapped us; we can't find a record boundary in what's left, so skip to the head
+		recordTorn(sink);
+		last_read_offset_ = head;
+		return 0;
+	}
+
 	int eventCount = 0;
 
-	while (true) {
-		perf_event_header * event = read();
-		if (!event)
+	while (last_read_offset_ != head) {
+		uint64_t start = last_read_offset_;
+		perf_event_header * event = read(head);
+		if (!event) {
+			recordTorn(sink);
+			last_read_offset_ = head;
 			break;
+		}
+
+		if (overwrite_) {
+			// We copied the record; make sure the kernel didn't overwrite it while we were copying
+			barrier();
+			uint64_t now = page->data_head;
+			if (now - start > buffer_size_) {
+				recordTorn(sink);
+				last_read_offset_ = now;
+				break;
+			}
+		}
 
 		eventCount++;
 
-		//			ret = perf_session__parse_sample(self, event, &sample);
-		//			if (ret) {
-		//				pr_err("Can't parse sample, err = %d\n", ret);
-		//				continue;
-		//			}
-		//
-		//			if (event->header.type == PERF_RECORD_SAMPLE)
-		//				perf_event__process_sample(event, &sample, self);
-		//			else
-		//				perf_event__process(event, &sample, self);
-		switch (event->type) {
-		/*
-		 * If perf_event_attr.sample_id_all is set then all event types will
-		 * have the sample_type selected fields related to where/when
-		 * (identity) an event took place (TID, TIME, ID, CPU, STREAM_ID)
-		 * described in PERF_RECORD_SAMPLE below, it will be stashed just after
-		 * the perf_event_header and the fields already present for the existing
-		 * fields, i.e. at the end of the payload. That way a newer perf.data
-		 * file will be supported by older perf tools, with these new optional
-		 * fields being ignored.
-		 *
-		 * The MMAP events record the PROT_EXEC mappings so that we can
-		 * correlate userspace IPs to code. They have the following structure:
-		 *
-		 * struct {
-		 *	struct perf_event_header	header;
-		 *
-		 *	u32				pid, tid;
-		 *	u64				addr;
-		 *	u64				len;
-		 *	u64				pgoff;
-		 *	char				filename[];
-		 * };
-		 */
-		case PERF_RECORD_MMAP:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_MMAP";
-			break;
+		dispatch(event, sink);
 
-		case PERF_RECORD_LOST:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_LOST";
-			break;
+		if (!overwrite_ && (eventCount % TAIL_BATCH) == 0) {
+			publishTail();
+		}
+	}
 
-		case PERF_RECORD_COMM:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_COMM";
-			break;
+	if (!overwrite_) {
+		publishTail();
+	}
 
-		case PERF_RECORD_EXIT:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_EXIT";
-			break;
+	return eventCount;
+}
 
-		case PERF_RECORD_THROTTLE:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_THROTTLE";
-			break;
+void EventChannel::publishTail() {
+	perf_event_mmap_page * page = (perf_event_mmap_page*) mmap_;
 
-		case PERF_RECORD_UNTHROTTLE:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_UNTHROTTLE";
-			break;
+	// Our reads of the records must complete before the kernel sees the space as free
+	__sync_synchronize();
+	page->data_tail = last_read_offset_;
+}
 
-		case PERF_RECORD_FORK:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_FORK";
-			break;
+void EventChannel::recordTorn(EventSink& sink) {
+	torn_.fetch_add(1, memory_order_relaxed);
+	sink.HandleRecordLost(1);
+}
 
-		case PERF_RECORD_READ:
-			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_READ";
-			break;
+void EventChannel::dispatch(perf_event_header * event, EventSink& sink) {
+	//			ret = perf_session__parse_sample(self, event, &sample);
+	//			if (ret) {
+	//				pr_err("Can't parse sample, err = %d\n", ret);
+	//				continue;
+	//			}
+	//
+	//			if (event->header.type == PERF_RECORD_SAMPLE)
+	//				perf_event__process_sample(event, &sample, self);
+	//			else
+	//				perf_event__process(event, &sample, self);
+	switch (event->type) {
+	/*
+	 * If perf_event_attr.sample_id_all is set then all event types will
+	 * have the sample_type selected fields related to where/when
+	 * (identity) an event took place (TID, TIME, ID, CPU, STREAM_ID)
+	 * described in PERF_RECORD_SAMPLE below, it will be stashed just after
+	 * the perf_event_header and the fields already present for the existing
+	 * fields, i.e. at the end of the payload. That way a newer perf.data
+	 * file will be supported by older perf tools, with these new optional
+	 * fields being ignored.
+	 *
+	 * The MMAP events record the PROT_EXEC mappings so that we can
+	 * correlate userspace IPs to code. They have the following structure:
+	 *
+	 * struct {
+	 *	struct perf_event_header	header;
+	 *
+	 *	u32				pid, tid;
+	 *	u64				addr;
+	 *	u64				len;
+	 *	u64				pgoff;
+	 *	char				filename[];
+	 * };
+	 */
+	case PERF_RECORD_MMAP:
+	case PERF_RECORD_MMAP2:
+		dispatchMmap(event);
+		break;
+
+	/*
+	 * struct {
+	 *	struct perf_event_header	header;
+	 *	u64				id;
+	 *	u64				lost;
+	 * };
+	 */
+	case PERF_RECORD_LOST: {
+		uint64_t lost = ((uint64_t *) (event + 1))[1];
+		lost_.fetch_add(lost, memory_order_relaxed);
+		sink.HandleRecordLost(lost);
+		break;
+	}
 
-		case PERF_RECORD_SAMPLE: {
-			//			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_SAMPLE";
-			PerfEvent sample(event);
-			sink.HandleRecordSample(sample);
-			break;
+	case PERF_RECORD_COMM:
+		LOG(INFO) << "Got unhandled record of type: PERF_RECORD_COMM";
+		break;
+
+	/*
+	 * struct {
+	 *	struct perf_event_header	header;
+	 *	u32				pid, ppid;
+	 *	u32				tid, ptid;
+	 *	u64				time;
+	 * };
+	 */
+	case PERF_RECORD_EXIT: {
+		uint32_t * ids = (uint32_t *) (event + 1);
+		if (record_listener_) {
+			record_listener_->ThreadExited(ids[0], ids[2]);
 		}
+		break;
+	}
 
-		default:
-			LOG(INFO) << "Got unhandled record of unknown type " << event->type;
-			break;
+	// The kernel stops an event sampling for the rest of the tick when its samples take too long
+	case PERF_RECORD_THROTTLE:
+		throttled_.fetch_add(1, memory_order_relaxed);
+		break;
+
+	case PERF_RECORD_UNTHROTTLE:
+		break;
+
+	// Same layout as PERF_RECORD_EXIT
+	case PERF_RECORD_FORK: {
+		uint32_t * ids = (uint32_t *) (event + 1);
+		if (record_listener_) {
+			record_listener_->ThreadStarted(ids[0], ids[2]);
 		}
+		break;
 	}
 
-	return eventCount;
+	case PERF_RECORD_READ:
+		LOG(INFO) << "Got unhandled record of type: PERF_RECORD_READ";
+		break;
+
+	case PERF_RECORD_SAMPLE: {
+		//			LOG(INFO) << "Got unhandled record of type: PERF_RECORD_SAMPLE";
+		PerfEvent sample(event);
+		sink.HandleRecordSample(sample);
+		break;
+	}
+
+	default:
+		LOG(INFO) << "Got unhandled record of unknown type " << event->type;
+		break;
+	}
 }
 
-perf_event_header * EventChannel::read() {
-	perf_event_mmap_page * page = (perf_event_mmap_page*) mmap_;
+uint64_t EventChannel::recordTime(perf_event_header * event) const {
+	if (!format_.checkFlag(PERF_SAMPLE_TIME))
+		return 0;
+
+	// { u32 pid, tid; } && PERF_SAMPLE_TID
+	// { u64 time; } && PERF_SAMPLE_TIME
+	// { u64 id; } && PERF_SAMPLE_ID
+	// { u64 stream_id;} && PERF_SAMPLE_STREAM_ID
+	// { u32 cpu, res; } && PERF_SAMPLE_CPU
+	// { u64 id; } && PERF_SAMPLE_IDENTIFIER
+	static const perf_event_sample_format trailer[] = { PERF_SAMPLE_TID, PERF_SAMPLE_TIME, PERF_SAMPLE_ID,
+			PERF_SAMPLE_STREAM_ID, PERF_SAMPLE_CPU, PERF_SAMPLE_IDENTIFIER };
+
+	size_t trailerSize = 0;
+	size_t timeOffset = 0;
+	for (size_t i = 0; i < sizeof(trailer) / sizeof(trailer[0]); i++) {
+		if (trailer[i] == PERF_SAMPLE_TIME) {
+			timeOffset = trailerSize;
+		}
+		if (format_.checkFlag(trailer[i])) {
+			trailerSize += sizeof(uint64_t);
+		}
+	}
 
-	perf_event_header *event = 0;
+	if (event->size < sizeof(perf_event_header) + trailerSize)
+		return 0;
 
-	uint64_t head = page->data_head;
-	barrier();
+	uint64_t time;
+	memcpy(&time, ((char *) event) + event->size - trailerSize + timeOffset, sizeof(time));
+	return time;
+}
 
-	if (last_read_offset_ != head) {
-		char * circularBuffer = ((char*) mmap_) + PAGE_SIZE;
+/*
+ * struct {
+ *	struct perf_event_header	header;
+ *
+ *	u32				pid, tid;
+ *	u64				addr;
+ *	u64				len;
+ *	u64				pgoff;
+ *	union {					(PERF_RECORD_MMAP2 only)
+ *		struct {
+ *			u32		maj;
+ *			u32		min;
+ *			u64		ino;
+ *			u64		ino_generation;
+ *		};
+ *		struct {			(PERF_RECORD_MISC_MMAP_BUILD_ID)
+ *			u8		build_id_size;
+ *			u8		__reserved_1;
+ *			u16		__reserved_2;
+ *			u8		build_id[20];
+ *		};
+ *	};
+ *	u32				prot, flags;	(PERF_RECORD_MMAP2 only)
+ *	char				filename[];
+ *	struct sample_id		sample_id;
+ * };
+ */
+void EventChannel::dispatchMmap(perf_event_header * event) {
+	if (!record_listener_)
+		return;
+
+	// Data mappings are only reported with attr.mmap_data, which we don't ask for
+	if (event->misc & PERF_RECORD_MISC_MMAP_DATA)
+		return;
+
+	const char * p = (const char *) (event + 1);
+	const char * end = ((const char *) event) + event->size;
+
+	size_t fixedSize = 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+	if (event->type == PERF_RECORD_MMAP2) {
+		fixedSize += 24 + 2 * sizeof(uint32_t);
+	}
+	if (p + fixedSize >= end) {
+		LOG(WARNING) << "Discarding truncated mmap record";
+		return;
+	}
 
-		size_t begin = last_read_offset_ & buffer_mask_;
+	const uint32_t * ids = (const uint32_t *) p;
+	const uint64_t * values = (const uint64_t *) (p + 2 * sizeof(uint32_t));
+	uint64_t addr = values[0];
+	uint64_t len = values[1];
+	uint64_t pgoff = values[2];
+
+	string buildId;
+	if (event->type == PERF_RECORD_MMAP2 && (event->misc & PERF_RECORD_MISC_MMAP_BUILD_ID)) {
+		const uint8_t * build = (const uint8_t *) (values + 3);
+		size_t size = min((size_t) build[0], (size_t) 20);
+
+		static const char digits[] = "0123456789abcdef";
+		for (size_t i = 0; i < size; i++) {
+			buildId += digits[build[4 + i] >> 4];
+			buildId += digits[build[4 + i] & 0xf];
+		}
+	}
 
-		event = (perf_event_header*) &circularBuffer[begin];
-		size_t eventSize = event->size;
+	// The filename is NUL terminated (and padded to 8 bytes); don't trust it to be
+	const char * filename = p + fixedSize;
+	string path(filename, strnlen(filename, end - filename));
 
-		if (begin + eventSize > buffer_size_) {
-			// The events can wrap around in the circular buffer
-			// We therefore have to copy the event
+	// Anonymous executable memory (e.g. JIT code) has no file
+	if (path == "//anon") {
+		path.clear();
+	}
 
-			event_scratch_space_.reserve(eventSize);
-			char * scratch = &event_scratch_space_[0];
-			event = (perf_event_header*) scratch;
+	record_listener_->MappingAdded(ids[0], addr, len, pgoff, path, buildId, recordTime(event));
+}
 
-			size_t tailSize = buffer_size_ - begin;
+perf_event_header * EventChannel::read(uint64_t head) {
+	char * circularBuffer = ((char*) mmap_) + PAGE_SIZE;
 
-			memcpy(scratch, event, tailSize);
-			scratch += tailSize;
+	size_t begin = last_read_offset_ & buffer_mask_;
 
-			memcpy(scratch, circularBuffer, eventSize - tailSize);
-		}
+	perf_event_header * event = (perf_event_header*) &circularBuffer[begin];
+	size_t eventSize = event->size;
+
+	// A record we're part-way through being overwritten (or a bug) shows up as a nonsense size
+	if (eventSize < sizeof(perf_event_header) || eventSize > head - last_read_offset_) {
+		return NULL;
+	}
 
-		last_read_offset_ += eventSize;
+	if (begin + eventSize > buffer_size_ || overwrite_) {
+		// The events can wrap around in the circular buffer, so we have to copy the event.
+		// In overwrite mode we always copy, because the kernel may overwrite it at any time.
+		event_scratch_space_.resize(eventSize);
+		char * scratch = &event_scratch_space_[0];
 
-		if (!overwrite_) {
-			// We need to signal that we've read here...
-			throw invalid_argument("overwrite not fully supported");
-		}
+		size_t tailSize = min(eventSize, buffer_size_ - begin);
+
+		memcpy(scratch, &circularBuffer[begin], tailSize);
+		memcpy(scratch + tailSize, circularBuffer, eventSize - tailSize);
+
+		event = (perf_event_header*) scratch;
 	}
 
+	last_read_offset_ += eventSize;
+
 	return event;
 }
 
 }
 }
 }
-
@@ -7,11 +7,15 @@
 #include <memory>
 #include <map>
 #include <utility>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
 
 #include <linux/perf_event.h>
 #include "SampleFormat.h"
+#include "EventParser.h"
 
-struct pollfd;
+struct epoll_event;
 
 namespace fathomdb {
 namespace perftools {
@@ -33,23 +37,77 @@ public:
 		return attr_;
 	}
 
-	EventSpecification(const perf_event_attr& attr, const string& name);
+	const perf_event_attr& attr() const {
+		return attr_;
+	}
+
+	/// The index of the {...} group this event belongs to, or -1 if it isn't grouped
+	int group() const {
+		return group_;
+	}
+
+	/// The first event of a group; it is opened first and the others are opened into it
+	bool isGroupLeader() const {
+		return group_ != -1 && group_leader_;
+	}
+
+	/// A non-leader member of a group: counted, and read out with each of the leader's samples
+	bool isGroupSibling() const {
+		return group_ != -1 && !group_leader_;
+	}
+
+	/// The modifiers given after the event's name; they are already applied to attr
+	const EventModifiers& modifiers() const {
+		return modifiers_;
+	}
+
+	EventSpecification(const perf_event_attr& attr, const string& name, int group = -1, bool groupLeader = false,
+			const EventModifiers& modifiers = EventModifiers());
 
 private:
 	perf_event_attr attr_;
 	string name_;
+	EventModifiers modifiers_;
+	int group_;
+	bool group_leader_;
+};
+
+/// Thrown when perf_event_open fails. error() is the errno it failed with, so callers can pick out the
+/// expected failures (ESRCH: the thread has exited; ENODEV: the CPU has gone offline).
+class EventOpenError: public invalid_argument {
+public:
+	EventOpenError(const string& what, int error) :
+		invalid_argument(what), error_(error) {
+	}
+
+	int error() const {
+		return error_;
+	}
+private:
+	int error_;
 };
 
 class Event {
 public:
 	void readEvent(void * buffer, size_t size);
 
-	Event(const EventSpecification& specification, int cpu, pid_t tid);
+	/// groupFd is the leader's descriptor when opening a group sibling, otherwise -1
+	Event(const EventSpecification& specification, int cpu, pid_t tid, int groupFd = -1);
+	~Event();
 
 	string name() const {
 		return specification_.name();
 	}
 
+	const EventSpecification& specification() const {
+		return specification_;
+	}
+
+	/// The kernel's id for the event, which identifies its value in a PERF_FORMAT_GROUP read
+	uint64_t id() const {
+		return id_;
+	}
+
 	int fileDescriptor() const {
 		return fd_;
 	}
@@ -63,15 +121,35 @@ public:
 	}
 
 	void setEnabled(bool enable);
+
+	/// Changes how often the event samples (PERF_EVENT_IOC_PERIOD): its frequency if it was opened with freq,
+	/// otherwise its period. Returns false if the kernel refused.
+	bool setSampleRate(uint64_t value);
 private:
 	EventSpecification specification_;
 	cpuid_t cpu_;
 	pid_t tid_;
 	int fd_;
+	uint64_t id_;
 
 private:
 	friend class EventSet;
-	void open();
+	void open(int groupFd);
+};
+
+/// Told about the side-band records: threads the kernel reports starting (PERF_RECORD_FORK) and exiting
+/// (PERF_RECORD_EXIT), and code being mapped (PERF_RECORD_MMAP and MMAP2).
+/// Called from inside EventChannel::readEvents, so it mustn't change the channels itself.
+class RecordListener {
+public:
+	virtual ~RecordListener() {
+	}
+
+	virtual void ThreadStarted(pid_t pid, pid_t tid) = 0;
+	virtual void ThreadExited(pid_t pid, pid_t tid) = 0;
+
+	/// time is 0 if the events don't sample PERF_SAMPLE_TIME. buildId (in hex) is empty unless the kernel supplied it.
+	virtual void MappingAdded(pid_t pid, uint64_t start, uint64_t len, uint64_t pgoff, const string& path, const string& buildId, uint64_t time) = 0;
 };
 
 class EventChannel {
@@ -84,16 +162,48 @@ class EventChannel {
 	 * We map an additional page, which is is the 'header'
 	 * The header is at the start of that page, and is of type perf_event_mmap_page.
 	 * More details are in the declaration of perf_event_mmap_page.
+	 *
+	 * In consumer mode (overwrite = false) the buffer is mapped writable, and we publish data_tail
+	 * after each batch; the kernel never overwrites records we haven't consumed, and drops new
+	 * records instead (reporting them with PERF_RECORD_LOST).
+	 * In overwrite mode the buffer is mapped read-only; the kernel ignores data_tail and keeps
+	 * writing, so we copy each record out and check that it wasn't overwritten while we did so.
 	 */
 
 public:
-	EventChannel(SampleFormat format, bool overwrite = true, int pages = DEFAULT_PAGE_COUNT);
+	EventChannel(SampleFormat format, bool overwrite = false, RecordListener * recordListener = NULL, int pages = DEFAULT_PAGE_COUNT);
+	~EventChannel();
+
+	/// The descriptor we mmapped (and poll), or -1
+	int fileDescriptor() const {
+		return mmap_fd_;
+	}
 
-	void add(int fd, class FileDescriptorPollList& pollList);
+	/// The first descriptor is mmapped and polled (with token); the rest write into its buffer
+	void add(int fd, class FileDescriptorPollList& pollList, uint64_t token);
 
 	int readEvents(EventSink& sink);
 
+	/// Records the kernel reported lost (PERF_RECORD_LOST) because this buffer was full
+	uint64_t lostCount() const {
+		return lost_.load(memory_order_relaxed);
+	}
+
+	/// Records we discarded because they were overwritten while we read them, or were corrupt
+	uint64_t tornCount() const {
+		return torn_.load(memory_order_relaxed);
+	}
+
+	/// Times the kernel throttled an event (PERF_RECORD_THROTTLE) because its samples were taking too long
+	/// to handle (see /proc/sys/kernel/perf_cpu_time_max_percent)
+	uint64_t throttledCount() const {
+		return throttled_.load(memory_order_relaxed);
+	}
+
 private:
+	/// In consumer mode, publish data_tail this often within a batch, so the kernel can reuse space
+	static const int TAIL_BATCH = 64;
+
 	void doMmap(int fd);
 
 	void joinMmap(int fd, int joinToFd);
@@ -106,10 +216,24 @@ private:
 		__sync_synchronize();
 	}
 
-	perf_event_header * read();
+	/// The next record before head, or NULL if it is malformed
+	perf_event_header * read(uint64_t head);
+
+	void dispatch(perf_event_header * event, EventSink& sink);
+
+	/// The time of a non-sample record, from the sample_id_all fields at its end (0 if they don't include it)
+	uint64_t recordTime(perf_event_header * event) const;
+
+	void dispatchMmap(perf_event_header * event);
+
+	/// Tell the kernel how far we've consumed (consumer mode)
+	void publishTail();
+
+	void recordTorn(EventSink& sink);
 
 private:
 	bool overwrite_;
+	RecordListener * record_listener_;
 	void * mmap_;
 	int mmap_fd_;
 	uint64_t last_read_offset_;
@@ -120,6 +244,10 @@ private:
 	SampleFormat format_;
 
 	string event_scratch_space_;
+
+	atomic<uint64_t> lost_;
+	atomic<uint64_t> torn_;
+	atomic<uint64_t> throttled_;
 };
 
 class EventChannelSet {
@@ -127,30 +255,106 @@ public:
 	typedef pair<cpuid_t, pid_t> key_t;
 
 public:
-	EventChannelSet(SampleFormat format) :
-		format_(format) {
+	/// overwrite selects the mode of every channel in the set; see EventChannel
+	EventChannelSet(SampleFormat format, bool overwrite = false, RecordListener * recordListener = NULL) :
+		format_(format), overwrite_(overwrite), record_listener_(recordListener), retired_lost_(0), retired_torn_(0), retired_throttled_(0) {
+	}
+
+	EventChannel& getChannel(key_t key) {
+		return channel(getIndex(key));
+	}
+
+	/// The channel's position in keys(), creating it if it doesn't exist.
+	/// The positions of removed channels are reused.
+	size_t getIndex(key_t key);
+
+	/// The channel's position in keys(), or -1 if there isn't one
+	ssize_t findIndex(key_t key) const;
+
+	EventChannel& channel(size_t index) {
+		return *channels_[index];
+	}
+
+	/// Unmaps the channel; its position is free for reuse
+	void remove(size_t index);
+
+	/// The number of positions, including those of removed channels
+	size_t size() const {
+		return channels_.size();
 	}
 
-	EventChannel& getChannel(key_t key);
+	bool isRemoved(size_t index) const {
+		return !channels_[index];
+	}
 
+	/// The keys by position; a removed channel's key stays until its position is reused
 	const vector<key_t>& keys() const {
 		return keys_;
 	}
 
+	/// Lost record counts, for each channel
+	map<key_t, uint64_t> lostCounts() const;
+
+	/// Lost records of channels that have since been removed
+	uint64_t retiredLostCount() const;
+
+	/// Total of the channels' torn record counts (including removed channels)
+	uint64_t tornCount() const;
+
+	/// Total of the channels' throttle counts (including removed channels)
+	uint64_t throttledCount() const;
+
+	bool overwrite() const {
+		return overwrite_;
+	}
+
 private:
 	// TODO: Use AssocVector?
 	// Note: We switched to map because hash wasn't defined on the pair (?)
-	map<key_t, unique_ptr<EventChannel> > channels_;
+	map<key_t, size_t> indexes_;
 
+	// In parallel, by index; removed channels are NULL, and their index is in free_
+	vector<unique_ptr<EventChannel> > channels_;
 	vector<key_t> keys_;
+	vector<size_t> free_;
+
 	SampleFormat format_;
+	bool overwrite_;
+	RecordListener * record_listener_;
+
+	uint64_t retired_lost_;
+	uint64_t retired_torn_;
+	uint64_t retired_throttled_;
+
+	// Only the polling thread changes the set, but the counts can be read from any thread
+	mutable mutex mutex_;
 };
 
+/**
+ * The CPUs we open events on. The online CPUs needn't be numbered contiguously (CPUs can be offlined,
+ * or hotplugged later), and of those we can only run on the ones in our threads' affinity masks, which
+ * a cpuset cgroup also limits. A set can be limited to the CPUs of one NUMA node.
+ */
 class CpuSet {
 public:
-	static CpuSet buildEachCpu();
+	static const char * ONLINE_PATH;
+	static const char * NODE_ROOT;
+
+	/// Each CPU that is online and that the process may run on, read afresh each time.
+	/// Unless node is -1, just those on that NUMA node.
+	static CpuSet buildEachCpu(int node = -1);
 	static CpuSet buildWildcard();
 
+	/// The NUMA nodes that have CPUs we may run on; empty if the kernel doesn't describe any
+	static vector<int> getNodes();
+
+	/// Just the CPUs that are online, sorted; unlike buildEachCpu, this doesn't look at every thread's
+	/// affinity, so is cheap enough to poll
+	static vector<cpuid_t> readOnlineCpus();
+
+	/// Parses a kernel CPU list such as "0-3,5,8-11" (as in ONLINE_PATH); throws invalid_argument if malformed
+	static vector<cpuid_t> parseCpuList(const string& list);
+
 	const vector<cpuid_t>& cpus() const {
 		return cpus_;
 	}
@@ -163,28 +367,56 @@ public:
 		return cpus_[index];
 	}
 
+	bool contains(cpuid_t cpu) const;
+
+	/// Just cpu -1: the events follow their threads onto any CPU
+	bool isWildcard() const {
+		return cpus_.size() == 1 && cpus_[0] == -1;
+	}
+
+	/// The NUMA node the set is limited to, or -1
+	int node() const {
+		return node_;
+	}
+
 private:
-	CpuSet(const vector<cpuid_t>& cpus) :
-		cpus_(cpus) {
+	friend class EventSet;
+
+	CpuSet(const vector<cpuid_t>& cpus, int node = -1) :
+		cpus_(cpus), node_(node) {
+	}
+
+	CpuSet() :
+		node_(-1) {
 	}
 
-	CpuSet() {}
+	/// Keeps the CPUs sorted
+	void add(cpuid_t cpu);
+	void remove(cpuid_t cpu);
 
-	static vector<cpuid_t> getAllCpusSimple();
+	/// The online CPUs in our affinity mask (and on node, unless it is -1), sorted
+	static vector<cpuid_t> getOnlineCpus(int node);
 private:
 	vector<cpuid_t> cpus_;
+	int node_;
 };
 
 
 class ThreadSet {
 public:
-	ThreadSet() {}
+	ThreadSet() :
+		process_(-1) {}
 
 	ThreadSet(const vector<pid_t>& threads) :
-		threads_(threads) {}
+		threads_(threads), process_(-1) {}
 
 	ThreadSet(vector<pid_t>&& threads) :
-		threads_(move(threads)) {}
+		threads_(move(threads)), process_(-1) {}
+
+	/// The process whose threads these are, if we discovered them (otherwise -1)
+	pid_t process() const {
+		return process_;
+	}
 
 	const vector<pid_t>& threads() const {
 		return threads_;
@@ -198,12 +430,23 @@ public:
 		return threads_[index];
 	}
 
-//	static ThreadSet findThreadsInProcess(pid_t pid);
+	static ThreadSet findThreadsInProcess(pid_t pid);
 	static ThreadSet buildSingleProcess(pid_t pid);
 	static ThreadSet buildWildcard();
 
 private:
 	vector<pid_t> threads_;
+	pid_t process_;
+};
+
+/// How often an event samples: samples a second if freq, otherwise events per sample
+struct SampleRate {
+	string event;
+	bool freq;
+	uint64_t value;
+
+	/// The rate multiplied by scale (so less than 1 samples less often)
+	SampleRate scaled(double scale) const;
 };
 
 class EventSetSpecifier {
@@ -228,7 +471,19 @@ public:
 		return events_[index];
 	}
 
-	static EventSetSpecifier parse(const string& eventSpec);
+	/// Whether any of the events are grouped; grouped events need PERF_SAMPLE_READ
+	bool hasGroups() const;
+
+	/// Whether any of the events ask for data addresses (the 'd' modifier); the samples then need
+	/// PERF_SAMPLE_ADDR, PERF_SAMPLE_DATA_SRC and PERF_SAMPLE_WEIGHT
+	bool hasDataAddresses() const;
+
+	/// The specified sampling rate of each sampling event
+	vector<SampleRate> sampleRates() const;
+
+	/// A comma separated list of events; events inside braces form a group, e.g. "{cycles,instructions},cache-misses".
+	/// Each event may have modifiers, e.g. "l1d-read-miss:ppd"; see EventModifiers. PMU events are looked up in pmus.
+	static EventSetSpecifier parse(const string& eventSpec, const PmuRegistry& pmus = PmuRegistry::system());
 
 private:
 	vector<EventSpecification> events_;
@@ -249,25 +504,100 @@ public:
 		return events_.size();
 	}
 
+	/// The event with the given kernel id, or NULL
+	const Event * findById(uint64_t id) const;
+
 	void setEnabled(bool enable);
 
-//	Event& attachThread(pid_t tid);
+	/// Per-thread mode: one set of events on each thread of a process (cpu -1), following threads as they
+	/// come and go, rather than one set per cpu that new threads inherit
+	bool isPerThread() const {
+		return threads_.process() != -1 && cpus_.size() == 1 && cpus_[0] == -1;
+	}
+
+	pid_t process() const {
+		return threads_.process();
+	}
+
+	bool hasThread(pid_t tid) const;
+
+	/// Per-thread mode: opens the events on a new thread (enabled if the set is), returning them.
+	/// Returns nothing if the thread has already exited.
+	vector<Event *> attachThread(pid_t tid);
+
+	/// Per-thread mode: closes the thread's events
+	void detachThread(pid_t tid);
+
+	/// Per-CPU mode: one set of events on each of a list of CPUs (see CpuSet::buildEachCpu), following CPUs
+	/// as they go online and offline
+	bool isPerCpu() const {
+		return !cpus_.isWildcard();
+	}
+
+	const CpuSet& cpus() const {
+		return cpus_;
+	}
+
+	/// Per-CPU mode: opens the events on a CPU that has come online (enabled if the set is), returning them.
+	/// Returns nothing if the CPU has already gone offline again.
+	vector<Event *> attachCpu(cpuid_t cpu);
+
+	/// Per-CPU mode: closes the CPU's events
+	void detachCpu(cpuid_t cpu);
+
+	/// Multiplies the sampling rate of each sampling event (leaders and ungrouped events) by scale,
+	/// relative to the rate it was specified with; events opened later start at the scaled rate.
+	/// The kernel only retunes the events we opened, not the copies inherited by threads started since,
+	/// so this only reaches every thread in per-thread mode.
+	void scaleSampleRates(double scale);
+
+	/// The specified sampling rate of each sampling event
+	vector<SampleRate> sampleRates() const;
 
 private:
 	void buildEvents(const EventSetSpecifier& eventSetSpec);
+
+	/// Opens each event on (cpu, tid), leaders before their siblings
+	void openEvents(cpuid_t cpu, pid_t tid, vector<unique_ptr<Event> >& events);
+
+	/// Takes ownership of events opened after the set was built, bringing them to its rate and enabled state
+	vector<Event *> adoptEvents(vector<unique_ptr<Event> >& events);
+
+	/// Sets an event's rate to its specified one times rate_scale_
+	void applyRateScale(Event& event);
+
+	bool enabled_;
+	double rate_scale_;
 };
 
+/**
+ * The descriptors we wait on, backed by epoll so there's no limit on their number and we find out
+ * exactly which ones are ready. Each descriptor is registered with a token, which poll returns.
+ *
+ * An eventfd is registered too, so that another thread can wake() a poll immediately.
+ */
 class FileDescriptorPollList {
+	static const int MAX_EVENTS = 256;
+	static const uint64_t WAKE_TOKEN = ~((uint64_t) 0);
+
 public:
-	FileDescriptorPollList(int max);
-	void add(int fd);
+	FileDescriptorPollList();
+	~FileDescriptorPollList();
+
+	void add(int fd, uint64_t token);
+	void remove(int fd);
+
+	/// Waits until a descriptor is ready (or we're woken), and appends the ready tokens to ready.
+	/// Returns the number of tokens appended, or -1 on error.
+	int poll(vector<uint64_t>& ready, int timeout = 100);
 
-	int poll(int timeout = 100);
+	/// Interrupt a poll in progress (or the next one); safe to call from any thread
+	void wake();
 
 private:
-	pollfd * pollfd_array_;
-	int count_;
-	int max_;
+	int epoll_fd_;
+	int wake_fd_;
+	unique_ptr<epoll_event[]> events_;
 };
 
 }
@@ -1,12 +1,18 @@
 // See COPYRIGHT for copyright
 #include "EventSink.h"
 
+#include <glog/logging.h>
+
 namespace fathomdb {
 namespace perftools {
 namespace hardware {
 
 using namespace std;
 
+void DumpingEventSink::HandleRecordLost(uint64_t lost) {
+	LOG(WARNING) << "Lost " << lost << " records";
+}
+
 }
 }
 }
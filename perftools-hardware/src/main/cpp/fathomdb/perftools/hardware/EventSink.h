@@ -4,6 +4,7 @@
 
 #include "SampleFormat.h"
 #include "PerfEvent.h"
+#include "EventSet.h"
 
 namespace fathomdb {
 namespace perftools {
@@ -23,6 +24,15 @@ public:
 	virtual void HandleRecordSample(PerfEvent event) {
 	}
 
+	/// Called with the number of records the kernel dropped because its buffer was full
+	virtual void HandleRecordLost(uint64_t lost) {
+	}
+
+	/// The sink that records from the given channel should go to; lets a sink fan out per channel.
+	virtual EventSink& ChannelSink(const EventChannelSet::key_t& channel) {
+		return *this;
+	}
+
 	SampleFormat format() const {
 		return format_;
 	}
@@ -40,6 +50,8 @@ public:
 	virtual void HandleRecordSample(PerfEvent event) {
 		event.dump(format());
 	}
+
+	virtual void HandleRecordLost(uint64_t lost);
 };
 
 }
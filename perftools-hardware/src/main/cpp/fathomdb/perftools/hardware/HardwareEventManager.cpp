@@ -1,6 +1,13 @@
 // See COPYRIGHT for copyright
 #include "HardwareEventManager.h"
+#include "EventSink.h"
+#include "ThreadDiscovery.h"
 
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
 #include <glog/logging.h>
 
 using namespace std;
@@ -9,17 +16,237 @@ namespace fathomdb {
 namespace perftools {
 namespace hardware {
 
+static uint64_t monotonicMillis() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 void HardwareEventManager::poll(EventSink& sink, int timeout) {
-	int events = poll_list_.poll(timeout);
+	uint64_t now = monotonicMillis();
+	uint64_t nextSweep = last_sweep_ + SWEEP_INTERVAL_MS;
+	if (now >= nextSweep) {
+		timeout = 0;
+	} else if (timeout < 0 || (uint64_t) timeout > nextSweep - now) {
+		timeout = nextSweep - now;
+	}
+
+	ready_.clear();
+	int events = poll_list_.poll(ready_, timeout);
 	if (events > 0) {
-		auto keys = channels_.keys();
-		for (auto it = keys.begin(); it != keys.end(); it++) {
-			EventChannel& channel = channels_.getChannel(*it);
-			int eventCount = channel.readEvents(sink);
+		// The tokens are channel indexes
+		for (auto it = ready_.begin(); it != ready_.end(); it++) {
+			size_t index = *it;
+			EventChannel& channel = channels_.channel(index);
+			channel.readEvents(sink.ChannelSink(channels_.keys()[index]));
+		}
+	}
+
+	now = monotonicMillis();
+	if (now >= last_sweep_ + SWEEP_INTERVAL_MS) {
+		// The kernel only wakes us when a buffer is half full, so a quiet channel (or a FORK/EXIT
+		// record) could otherwise sit there indefinitely. Checking an empty channel is just a read of data_head.
+		last_sweep_ = now;
+		for (size_t index = 0; index < channels_.size(); index++) {
+			if (!channels_.isRemoved(index)) {
+				channels_.channel(index).readEvents(sink.ChannelSink(channels_.keys()[index]));
+			}
+		}
+	}
+
+	if (now >= last_cpu_check_ + CPU_CHECK_INTERVAL_MS) {
+		last_cpu_check_ = now;
+		checkCpus(sink, now);
+	}
+
+	if (!thread_changes_.empty()) {
+		applyThreadChanges(sink);
+	}
+}
+
+void HardwareEventManager::ThreadStarted(pid_t pid, pid_t tid) {
+	ThreadChange change;
+	change.pid = pid;
+	change.tid = tid;
+	change.started = true;
+	thread_changes_.push_back(change);
+}
+
+void HardwareEventManager::ThreadExited(pid_t pid, pid_t tid) {
+	ThreadChange change;
+	change.pid = pid;
+	change.tid = tid;
+	change.started = false;
+	thread_changes_.push_back(change);
+}
+
+void HardwareEventManager::MappingAdded(pid_t pid, uint64_t start, uint64_t len, uint64_t pgoff, const string& path, const string& buildId, uint64_t time) {
+	// Inherited events also see the processes we fork; their mappings aren't ours
+	if (pid != getpid())
+		return;
+
+	address_space_->addMapping(start, len, pgoff, path, buildId, time);
+}
+
+void HardwareEventManager::applyThreadChanges(EventSink& sink) {
+	// Draining an exited thread's channel can queue more changes
+	while (!thread_changes_.empty()) {
+		vector<ThreadChange> changes;
+		changes.swap(thread_changes_);
+
+		for (auto it = changes.begin(); it != changes.end(); it++) {
+			if (it->started) {
+				attachThread(it->pid, it->tid);
+			} else {
+				detachThread(it->tid, sink);
+			}
+		}
+	}
+}
+
+void HardwareEventManager::attachThread(pid_t pid, pid_t tid) {
+	for (auto it = event_sets_.begin(); it != event_sets_.end(); it++) {
+		EventSet& eventSet = **it;
+
+		// (A fork of a new process shows up with its own pid; we don't follow those)
+		if (!eventSet.isPerThread() || eventSet.process() != pid)
+			continue;
+
+		vector<Event *> events = eventSet.attachThread(tid);
+		for (auto event = events.begin(); event != events.end(); event++) {
+			addToChannel(**event);
+		}
+	}
+}
+
+void HardwareEventManager::detachThread(pid_t tid, EventSink& sink) {
+	EventChannelSet::key_t key(-1, tid);
+	ssize_t index = channels_.findIndex(key);
+	if (index >= 0) {
+		// Deliver whatever the thread recorded before it exited
+		EventChannel& channel = channels_.channel(index);
+		channel.readEvents(sink.ChannelSink(key));
+		poll_list_.remove(channel.fileDescriptor());
+	}
+
+	for (auto it = event_sets_.begin(); it != event_sets_.end(); it++) {
+		if ((*it)->isPerThread()) {
+			(*it)->detachThread(tid);
+		}
+	}
+
+	if (index >= 0) {
+		channels_.remove(index);
+	}
+}
+
+void HardwareEventManager::checkCpus(EventSink& sink, uint64_t now) {
+	// Walking every thread's affinity is too slow to do each time, and affinities seldom change, so unless
+	// a CPU has come or gone we only do it every AFFINITY_CHECK_INTERVAL_MS
+	vector<cpuid_t> online;
+	try {
+		online = CpuSet::readOnlineCpus();
+	} catch (invalid_argument& e) {
+		LOG(WARNING) << "Cannot check for CPUs going online or offline: " << e.what();
+		return;
+	}
+	if (online == last_online_ && now < last_affinity_check_ + AFFINITY_CHECK_INTERVAL_MS) {
+		return;
+	}
+	last_online_.swap(online);
+	last_affinity_check_ = now;
+
+	for (auto it = event_sets_.begin(); it != event_sets_.end(); it++) {
+		EventSet& eventSet = **it;
+		if (!eventSet.isPerCpu())
+			continue;
+
+		const vector<cpuid_t>& current = eventSet.cpus().cpus();
+
+		vector<cpuid_t> online;
+		try {
+			online = CpuSet::buildEachCpu(eventSet.cpus().node()).cpus();
+		} catch (invalid_argument& e) {
+			LOG(WARNING) << "Cannot check for CPUs going online or offline: " << e.what();
+			return;
+		}
+
+		vector<cpuid_t> added;
+		set_difference(online.begin(), online.end(), current.begin(), current.end(), back_inserter(added));
+		vector<cpuid_t> removed;
+		set_difference(current.begin(), current.end(), online.begin(), online.end(), back_inserter(removed));
+
+		// Attach first, so the set is never left without CPUs
+		for (auto cpu = added.begin(); cpu != added.end(); cpu++) {
+			LOG(INFO) << "CPU " << *cpu << " is now available; attaching hardware events";
+			attachCpu(eventSet, *cpu);
+		}
+		for (auto cpu = removed.begin(); cpu != removed.end(); cpu++) {
+			LOG(INFO) << "CPU " << *cpu << " is no longer available; detaching hardware events";
+			detachCpu(*cpu, sink);
+		}
+	}
+}
+
+void HardwareEventManager::attachCpu(EventSet& eventSet, cpuid_t cpu) {
+	vector<Event *> events;
+	try {
+		events = eventSet.attachCpu(cpu);
+	} catch (invalid_argument& e) {
+		// We'll try again at the next check
+		LOG(WARNING) << "Cannot attach hardware events to CPU " << cpu << ": " << e.what();
+		return;
+	}
+	for (auto event = events.begin(); event != events.end(); event++) {
+		addToChannel(**event);
+	}
+}
 
-			//LOG(INFO) << it->first << "," << it->second << " => " << eventCount << endl;
+void HardwareEventManager::detachCpu(cpuid_t cpu, EventSink& sink) {
+	// Deliver whatever was recorded on the CPU before it went
+	vector<size_t> indexes;
+	for (size_t index = 0; index < channels_.size(); index++) {
+		if (channels_.isRemoved(index) || channels_.keys()[index].first != cpu)
+			continue;
+
+		EventChannel& channel = channels_.channel(index);
+		channel.readEvents(sink.ChannelSink(channels_.keys()[index]));
+		poll_list_.remove(channel.fileDescriptor());
+		indexes.push_back(index);
+	}
+
+	for (auto it = event_sets_.begin(); it != event_sets_.end(); it++) {
+		if ((*it)->isPerCpu()) {
+			(*it)->detachCpu(cpu);
 		}
 	}
+
+	for (auto it = indexes.begin(); it != indexes.end(); it++) {
+		channels_.remove(*it);
+	}
+}
+
+HardwareEventManager::Statistics HardwareEventManager::statistics() const {
+	Statistics stats;
+	stats.lost_by_channel = channels_.lostCounts();
+	stats.torn = channels_.tornCount();
+	stats.throttled = channels_.throttledCount();
+	stats.lost = channels_.retiredLostCount();
+	for (auto it = stats.lost_by_channel.begin(); it != stats.lost_by_channel.end(); it++) {
+		stats.lost += it->second;
+	}
+	return stats;
+}
+
+void HardwareEventManager::scaleSampleRates(double scale) {
+	for (auto it = event_sets_.begin(); it != event_sets_.end(); it++) {
+		(*it)->scaleSampleRates(scale);
+	}
+}
+
+/*static*/unique_ptr<CounterSet> HardwareEventManager::openCounters(const string& events, CounterSet::Breakdown breakdown, bool excludeKernel) {
+	EventSetSpecifier spec = EventSetSpecifier::parse(events);
+	return unique_ptr<CounterSet>(new CounterSet(spec, breakdown, getpid(), excludeKernel));
 }
 
 EventSet& HardwareEventManager::addEventSet(unique_ptr<EventSet> && eventSetPtr) {
@@ -27,33 +254,37 @@ EventSet& HardwareEventManager::addEventSet(unique_ptr<EventSet> && eventSetPtr)
 	EventSet& eventSet = *event_sets_.back();
 
 	for (size_t i = 0; i < eventSet.size(); i++) {
-		const Event& event = eventSet[i];
+		addToChannel(eventSet[i]);
+	}
 
-		// We separate out the channels so that multiple cpus/threads don't go into the same buffer
-		EventChannelSet::key_t key(event.cpu(), event.tid());
-		EventChannel& channel = channels_.getChannel(key);
-		channel.add(event.fileDescriptor(), poll_list_);
+	if (eventSet.isPerThread()) {
+		// Threads started while we were opening the events were forked by threads we weren't yet
+		// watching, so we won't get their PERF_RECORD_FORK; look again now we are
+		vector<pid_t> threads = LinuxThreadDiscovery::discoverThreads(eventSet.process());
+		for (auto it = threads.begin(); it != threads.end(); it++) {
+			attachThread(eventSet.process(), *it);
+		}
 	}
 	return eventSet;
 }
 
-//void HardwareEventManager::attachThread(pid_t tid) {
-//	for (auto it = event_sets_.begin(); it != event_sets_.end(); it++) {
-//		EventSet& eventSet = **it;
-//
-//		Event& event = eventSet.attachThread(tid);
-//
-//		// We separate out the channels so that multiple cpus/threads don't go into the same buffer
-//		EventChannelSet::key_t key(event.cpu(), event.tid());
-//		EventChannel& channel = channels_.getChannel(key);
-//		channel.add(event.fileDescriptor(), poll_list_);
-//
-//		event.setEnabled(true);
-//	}
-//}
-
-HardwareEventManager::HardwareEventManager(SampleFormat format) :
-poll_list_(MAX_POLL), channels_(format), format_(format) {
+void HardwareEventManager::addToChannel(const Event& event) {
+	// Siblings don't sample; their counts arrive in their leader's samples
+	if (event.specification().isGroupSibling())
+		return;
+
+	// We separate out the channels so that multiple cpus/threads don't go into the same buffer
+	EventChannelSet::key_t key(event.cpu(), event.tid());
+	size_t index = channels_.getIndex(key);
+	channels_.channel(index).add(event.fileDescriptor(), poll_list_, index);
+}
+
+HardwareEventManager::HardwareEventManager(SampleFormat format, bool overwrite, const shared_ptr<AddressSpace>& addressSpace) :
+last_sweep_(0), last_cpu_check_(0), last_affinity_check_(0), channels_(format, overwrite, this), format_(format), decoder_(format), address_space_(addressSpace) {
+	if (!address_space_) {
+		address_space_.reset(new AddressSpace());
+		address_space_->loadProcSelfMaps();
+	}
 }
 
 }
@@ -6,6 +6,9 @@
 
 #include "SampleFormat.h"
 #include "EventSet.h"
+#include "CounterSet.h"
+#include "AddressSpace.h"
+#include "SampleDecoder.h"
 
 namespace fathomdb {
 namespace perftools {
@@ -17,32 +20,124 @@ using namespace std;
 
 /**
  * Facade that simplifies working with all the underlying event system
+ *
+ * Per-thread event sets (see EventSet::isPerThread) follow the process's threads: we attach to threads
+ * when the kernel reports them starting (PERF_RECORD_FORK), and when they exit we drain their channel,
+ * close their events and unmap the channel.
+ *
+ * Per-CPU event sets (see EventSet::isPerCpu) follow the CPUs we can run on: every CPU_CHECK_INTERVAL_MS we
+ * re-read the online CPUs and our affinity, opening the events on CPUs that have appeared, and draining and
+ * closing those of CPUs that have gone.
+ *
+ * The process's code mappings are tracked from the PERF_RECORD_MMAP(2) records (see AddressSpace),
+ * starting from /proc/self/maps when the manager is created.
  */
-class HardwareEventManager {
-	static const int MAX_POLL = 1024;
-
+class HardwareEventManager: private RecordListener {
 public:
-	HardwareEventManager(SampleFormat sampleFormat);
+	struct Statistics {
+		/// Records the kernel dropped because we didn't drain its buffers in time
+		uint64_t lost;
+		map<EventChannelSet::key_t, uint64_t> lost_by_channel;
+		/// Records we discarded as overwritten or corrupt
+		uint64_t torn;
+		/// Times the kernel throttled an event for taking too long to sample
+		uint64_t throttled;
+	};
+
+	/// overwrite selects lossy overwrite mode for the perf buffers, instead of consumer mode.
+	/// Managers whose events cover different CPUs of one process can share an addressSpace (each records
+	/// the mappings reported on its CPUs); by default the manager has its own.
+	HardwareEventManager(SampleFormat sampleFormat, bool overwrite = false, const shared_ptr<AddressSpace>& addressSpace = shared_ptr<AddressSpace>());
 
 	EventSet& addEventSet(unique_ptr<EventSet> && eventSet);
 
+	/// Waits for data (or wakeup()), then drains just the channels that have some.
+	/// Every SWEEP_INTERVAL_MS it drains them all, so returns at least that often.
 	void poll(EventSink& sink, int timeout = 100);
 
+	/// Makes a poll in progress return immediately; safe to call from any thread
+	void wakeup() {
+		poll_list_.wake();
+	}
+
 	SampleFormat format() const {
 		return format_;
 	}
 
-	// If another thread is detected, add our hooks to it
-//	void attachThread(pid_t tid);
+	/// Decodes samples of our format, specialised for it when possible
+	const SampleDecoder& sampleDecoder() const {
+		return decoder_;
+	}
+
+	const vector<EventChannelSet::key_t>& channelKeys() const {
+		return channels_.keys();
+	}
+
+	/// Safe to call while another thread is polling
+	Statistics statistics() const;
+
+	/// Scales the sampling rate of every event set (see EventSet::scaleSampleRates); call it from the polling thread
+	void scaleSampleRates(double scale);
+
+	/// The code mapped into this process over time; safe to use while another thread is polling
+	const shared_ptr<AddressSpace>& addressSpace() const {
+		return address_space_;
+	}
+
+	/// Opens (disabled) counting-mode counters for this process; see CounterSet
+	static unique_ptr<CounterSet> openCounters(const string& events, CounterSet::Breakdown breakdown, bool excludeKernel = true);
 
 private:
+	struct ThreadChange {
+		pid_t pid;
+		pid_t tid;
+		bool started;
+	};
+
+	/// Maps the event into its (cpu, tid) channel
+	void addToChannel(const Event& event);
+
+	void attachThread(pid_t pid, pid_t tid);
+	void detachThread(pid_t tid, EventSink& sink);
+
+	/// Attaches and detaches CPUs to match the CPUs now online (and in our affinity mask, and on the set's node)
+	void checkCpus(EventSink& sink, uint64_t now);
+	void attachCpu(EventSet& eventSet, cpuid_t cpu);
+	void detachCpu(cpuid_t cpu, EventSink& sink);
+
+	/// Applies the thread changes queued while reading the channels
+	void applyThreadChanges(EventSink& sink);
+
+	virtual void ThreadStarted(pid_t pid, pid_t tid);
+	virtual void ThreadExited(pid_t pid, pid_t tid);
+	virtual void MappingAdded(pid_t pid, uint64_t start, uint64_t len, uint64_t pgoff, const string& path, const string& buildId, uint64_t time);
+
 	vector<unique_ptr<EventSet> > event_sets_;
 	FileDescriptorPollList poll_list_;
+	vector<uint64_t> ready_;
+	vector<ThreadChange> thread_changes_;
+
+	/// How often poll drains every channel, not just those the kernel says are ready
+	static const uint64_t SWEEP_INTERVAL_MS = 100;
+	uint64_t last_sweep_;
+
+	/// How often poll checks for CPUs going online or offline
+	static const uint64_t CPU_CHECK_INTERVAL_MS = 1000;
+	uint64_t last_cpu_check_;
+
+	/// How often the CPU check also rereads our threads' affinities, when no CPU has come or gone
+	static const uint64_t AFFINITY_CHECK_INTERVAL_MS = 10000;
+	uint64_t last_affinity_check_;
+	/// The online CPUs at the last full check
+	vector<cpuid_t> last_online_;
 
 	/* Currently all event sets share a single set of mmaps (channels) */
 	EventChannelSet channels_;
 
 	SampleFormat format_;
+	SampleDecoder decoder_;
+
+	shared_ptr<AddressSpace> address_space_;
 };
 
 }
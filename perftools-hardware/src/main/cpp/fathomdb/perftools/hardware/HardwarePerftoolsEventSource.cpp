@@ -2,6 +2,15 @@
 #include "HardwarePerftoolsEventSource.h"
 
 #include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <exception>
+#include <future>
 #include <stdexcept>
 
 #include <linux/perf_event.h>
@@ -10,7 +19,14 @@
 
 #include "EventSink.h"
 #include "HardwareEventManager.h"
+#include "DwarfUnwinder.h"
+#include "BranchProfile.h"
+#include "DataAccessProfile.h"
+#include "OverheadController.h"
+#include "StackAggregator.h"
 #include <iostream>
+#include <sstream>
+#include <mutex>
 #include <sys/syscall.h>
 
 using namespace std;
@@ -40,6 +56,50 @@ bool removeIfStartsWith(string& s, const string& find) {
 			options.backtrace = true;
 		} else if (removeIfStartsWith(leftover, "nokernel:")) {
 			options.exclude_kernel = true;
+		} else if (removeIfStartsWith(leftover, "overwrite:")) {
+			options.overwrite = true;
+		} else if (removeIfStartsWith(leftover, "perthread:")) {
+			options.per_thread = true;
+		} else if (removeIfStartsWith(leftover, "nonuma:")) {
+			options.numa = false;
+		} else if (removeIfStartsWith(leftover, "branches:")) {
+			options.branches = true;
+		} else if (removeIfStartsWith(leftover, "dwarfstack:")) {
+			options.dwarf_stack_size = DEFAULT_DWARF_STACK_SIZE;
+		} else if (removeIfStartsWith(leftover, "dwarfstack=")) {
+			size_t end = leftover.find(':');
+			if (end == string::npos) {
+				FATAL("Expected ':' after dwarfstack=BYTES");
+			}
+			int size = atoi(leftover.substr(0, end).c_str());
+			if (size <= 0 || size > (int) MAX_DWARF_STACK_SIZE) {
+				FATAL("dwarfstack size must be between 1 and 61440 bytes");
+			}
+			// The kernel wants a multiple of 8
+			options.dwarf_stack_size = (size + 7) & ~7;
+			leftover = leftover.substr(end + 1);
+		} else if (removeIfStartsWith(leftover, "budget=")) {
+			size_t end = leftover.find(':');
+			if (end == string::npos) {
+				FATAL("Expected ':' after budget=PERCENT%");
+			}
+			options.overhead_budget = atof(leftover.substr(0, end).c_str());
+			if (options.overhead_budget <= 0 || options.overhead_budget > 100) {
+				FATAL("budget must be a percentage between 0 and 100");
+			}
+			leftover = leftover.substr(end + 1);
+		} else if (removeIfStartsWith(leftover, "sync:")) {
+			options.consumer_threads = 0;
+		} else if (removeIfStartsWith(leftover, "consumers=")) {
+			size_t end = leftover.find(':');
+			if (end == string::npos) {
+				FATAL("Expected ':' after consumers=N");
+			}
+			options.consumer_threads = atoi(leftover.substr(0, end).c_str());
+			if (options.consumer_threads <= 0) {
+				FATAL("consumers must be at least 1");
+			}
+			leftover = leftover.substr(end + 1);
 		} else {
 			break;
 		}
@@ -49,34 +109,60 @@ bool removeIfStartsWith(string& s, const string& find) {
 }
 
 HardwarePerftoolsEventSource::HardwarePerftoolsEventSource(const string& event_spec, ::ProfileRecordCallback callback) :
-	callback_(callback), events_enabled_(false) {
+	callback_(callback), thread_stop_(false), shards_started_(false), events_enabled_(false) {
 	options_ = EventOptions::parse(event_spec, event_spec_);
 }
 
-HardwareEventManager& HardwarePerftoolsEventSource::getEventManager() {
-	if (!event_manager_) {
-		// The system isn't yet bootstrapped enough for this to be safe :-(
-		//		LOG(WARNING) << "Starting hardware event profiling.  Events = " << events;
+HardwarePerftoolsEventSource::~HardwarePerftoolsEventSource() {
+	StopBackgroundThread();
+}
 
-		int format = 0;
-		format |= PERF_SAMPLE_IP;
-		format |= PERF_SAMPLE_TID;
+SampleFormat HardwarePerftoolsEventSource::BuildSampleFormat(bool readGroups, bool dataAddresses) const {
+	// The system isn't yet bootstrapped enough for this to be safe :-(
+	//		LOG(WARNING) << "Starting hardware event profiling.  Events = " << events;
 
-		if (options_.backtrace) {
-			format |= PERF_SAMPLE_CALLCHAIN;
-		}
+	int format = 0;
+	format |= PERF_SAMPLE_IP;
+	format |= PERF_SAMPLE_TID;
 
-		//		format |= PERF_SAMPLE_TIME;
-		//		format |= PERF_SAMPLE_PERIOD;
-		//		format |= PERF_SAMPLE_CALLCHAIN;
-		//	format |= PERF_SAMPLE_ID;
-		//	format|= PERF_FORMAT_ID;
+	if (options_.backtrace) {
+		format |= PERF_SAMPLE_CALLCHAIN;
+	}
+
+	// Samples are resolved against the code that was mapped when they were taken
+	format |= PERF_SAMPLE_TIME;
 
-		SampleFormat sampleFormat(format);
-		event_manager_.reset(new HardwareEventManager(sampleFormat));
+	if (options_.branches) {
+		format |= PERF_SAMPLE_BRANCH_STACK;
 	}
 
-	return *event_manager_;
+	if (dataAddresses) {
+		format |= PERF_SAMPLE_ADDR | PERF_SAMPLE_DATA_SRC | PERF_SAMPLE_WEIGHT;
+	}
+
+	uint64_t regsUser = 0;
+	if (options_.dwarf_stack_size) {
+		regsUser = DwarfUnwinder::sampleRegisters();
+		if (!regsUser) {
+			FATAL("dwarfstack is not supported on this platform");
+		}
+		format |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+	}
+
+	//		format |= PERF_SAMPLE_PERIOD;
+	//		format |= PERF_SAMPLE_CALLCHAIN;
+	//	format |= PERF_SAMPLE_ID;
+	//	format|= PERF_FORMAT_ID;
+
+	// Every event shares the channels' format, so if any event is grouped they all carry a read_format
+	// (ungrouped events read as groups of one)
+	uint64_t readFormat = 0;
+	if (readGroups) {
+		format |= PERF_SAMPLE_READ;
+		readFormat = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+	}
+
+	return SampleFormat(format, readFormat, regsUser);
 }
 
 void HardwarePerftoolsEventSource::RegisterThread(int callback_count) {
@@ -85,33 +171,282 @@ void HardwarePerftoolsEventSource::RegisterThread(int callback_count) {
 	//	getEventManager().attachThread(tid);
 }
 
+// Samples lost by the kernel (or by us) are attributed to this function, so that a profile shows
+// them as a "lost samples" frame instead of silently under-representing busy CPUs
+extern "C" void __attribute__((noinline)) hardware_lost_samples() {
+	asm volatile("");
+}
+
+static uint64_t clockNanos(clockid_t clock) {
+	timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+class ProfilerEventSink: public EventSink {
+public:
+	/// Stacks are counted in aggregator, which passes them on to the profiler
+	ProfilerEventSink(const HardwareEventManager& eventManager, StackAggregator& aggregator, const shared_ptr<BranchProfile>& branches,
+			const shared_ptr<DataAccessProfile>& dataAccesses) :
+		EventSink(eventManager.format()), aggregator_(aggregator), decoder_(eventManager.sampleDecoder()), branches_(branches),
+				data_accesses_(dataAccesses) {
+		if (format().checkFlag(PERF_SAMPLE_STACK_USER)) {
+			unwinder_.reset(new DwarfUnwinder());
+		}
+	}
+
+	virtual void HandleRecordLost(uint64_t lost) {
+		void * frame[1] = { (void *) &hardware_lost_samples };
+		while (lost > 0) {
+			int count = (int) min(lost, (uint64_t) INT_MAX);
+			// Our own code is always mapped, so any time will do
+			aggregator_.add(count, frame, 1, 0);
+			lost -= count;
+		}
+	}
+
+	virtual void HandleRecordSample(PerfEvent event) {
+		if (unwinder_ || branches_ || data_accesses_) {
+			HandleDecodedSample(event);
+			return;
+		}
+
+		ProfileSample decoded;
+		decoder_.decode(event, decoded);
+
+		if (decoded.callchain_size == 0) {
+			uint64_t fake_backtrace[1];
+			fake_backtrace[0] = decoded.ip;
+			aggregator_.add(1, (void**) fake_backtrace, 1, decoded.time);
+		} else {
+			aggregator_.add(1, (void**) decoded.callchain, decoded.callchain_size, decoded.time);
+		}
+	}
+
+private:
+	/// The most frames we pass to the profiler (its own limit is 64)
+	static const int MAX_UNWIND_DEPTH = 64;
+
+	/// The samples our specialised decoder doesn't handle: those with branch stacks or data sources, and
+	/// those we unwind ourselves (dwarfstack), falling back to the kernel's callchain or the ip
+	void HandleDecodedSample(PerfEvent event) {
+		DecodedPerfEvent decoded;
+		event.decode(format(), decoded);
+
+		if (branches_) {
+			branches_->addSample(decoded);
+		}
+		if (data_accesses_) {
+			data_accesses_->addSample(decoded);
+		}
+
+		uint64_t ips[MAX_UNWIND_DEPTH];
+		int depth = unwinder_ ? unwinder_->unwind(decoded, ips, MAX_UNWIND_DEPTH) : 0;
+		if (depth == 0 && decoded.callchain_size != 0) {
+			depth = min((int) decoded.callchain_size, MAX_UNWIND_DEPTH);
+			memcpy(ips, decoded.callchain, depth * sizeof(uint64_t));
+		} else if (depth == 0) {
+			ips[0] = decoded.ip;
+			depth = 1;
+		}
+
+		aggregator_.add(1, (void**) ips, depth, decoded.time);
+	}
+
+	/// This shard's
+	StackAggregator& aggregator_;
+	SampleDecoder decoder_;
+	unique_ptr<DwarfUnwinder> unwinder_;
+
+	/// Where branch stacks are aggregated ("branches:"), or NULL
+	shared_ptr<BranchProfile> branches_;
+
+	/// Where data addresses are aggregated (the 'd' event modifier), or NULL
+	shared_ptr<DataAccessProfile> data_accesses_;
+};
+
+static mutex profiled_mutex;
+static shared_ptr<AddressSpace> profiled_address_space;
+
+static shared_ptr<BranchProfile> profiled_branches;
+static shared_ptr<DataAccessProfile> profiled_data_accesses;
+static shared_ptr<OverheadController> profiled_overhead;
+
+/*static*/shared_ptr<AddressSpace> HardwarePerftoolsEventSource::profiledAddressSpace() {
+	lock_guard<mutex> lock(profiled_mutex);
+	return profiled_address_space;
+}
+
+/*static*/shared_ptr<BranchProfile> HardwarePerftoolsEventSource::profiledBranches() {
+	lock_guard<mutex> lock(profiled_mutex);
+	return profiled_branches;
+}
+
+/*static*/shared_ptr<DataAccessProfile> HardwarePerftoolsEventSource::profiledDataAccesses() {
+	lock_guard<mutex> lock(profiled_mutex);
+	return profiled_data_accesses;
+}
+
+/*static*/shared_ptr<OverheadController> HardwarePerftoolsEventSource::profiledOverhead() {
+	lock_guard<mutex> lock(profiled_mutex);
+	return profiled_overhead;
+}
+
+struct HardwarePerftoolsEventSource::DrainShard {
+	DrainShard(HardwarePerftoolsEventSource * source, int node, const EventSetSpecifier& eventSetSpec, const SampleFormat& format) :
+		source(source), node(node), event_set_spec(eventSetSpec), format(format), event_set(NULL), thread(0), cpu_ns(0), consumer_cpu_ns(0),
+				last_control_ms(0),
+				rate_scale(1.0) {
+	}
+
+	HardwarePerftoolsEventSource * source;
+
+	/// The NUMA node whose CPUs we have, or -1 for all of them
+	int node;
+
+	EventSetSpecifier event_set_spec;
+	SampleFormat format;
+
+	unique_ptr<HardwareEventManager> event_manager;
+	EventSet * event_set;
+
+	/// Where we count stacks before merging them into the profile, marking the mappings they hit
+	unique_ptr<StackAggregator> aggregator;
+
+	/// Passes each sample to the aggregator
+	unique_ptr<EventSink> profiler_sink;
+	unique_ptr<SamplePipeline> pipeline;
+
+	pthread_t thread;
+
+	/// Set by the thread once it has built the shard, or failed to
+	promise<void> ready;
+
+	/// The thread's CPU time, as of its last control interval
+	atomic<uint64_t> cpu_ns;
+	/// Its consumer threads' CPU time (in sync mode, samples are delivered on the thread itself)
+	atomic<uint64_t> consumer_cpu_ns;
+	uint64_t last_control_ms;
+	double rate_scale;
+};
+
+// Keeps the calling thread on the node's CPUs, so that its allocations (and the threads it starts) are local to the node
+static void pinToNode(int node) {
+	CpuSet cpus = CpuSet::buildEachCpu(node);
+	if (cpus.size() == 0)
+		return;
+
+	int size = cpus[cpus.size() - 1] + 1;
+	cpu_set_t * mask = CPU_ALLOC(size);
+	size_t bytes = CPU_ALLOC_SIZE(size);
+	CPU_ZERO_S(bytes, mask);
+	for (size_t i = 0; i < cpus.size(); i++) {
+		CPU_SET_S(cpus[i], bytes, mask);
+	}
+	if (sched_setaffinity(0, bytes, mask) != 0) {
+		LOG(WARNING) << "Cannot pin hardware profiling thread to NUMA node " << node;
+	}
+	CPU_FREE(mask);
+}
+
 void HardwarePerftoolsEventSource::StartBackgroundThread() {
-	if (thread_) {
+	if (!shards_.empty() && shards_[0]->thread) {
 		FATAL("Background thread already running");
 	}
 
-	EventSet& eventSet = BuildEventSystem(event_spec_);
+	// The previous profile's events are closed
+	shards_.clear();
 
-	thread_stop_ = false;
+	EventSetSpecifier eventSetSpec = EventSetSpecifier::parse(event_spec_);
+	if (eventSetSpec.hasGroups() && !options_.per_thread) {
+		// Groups are read with PERF_SAMPLE_READ, which can't be inherited, so a per-cpu event on our pid
+		// would only ever see the main thread.  Per-thread mode opens each thread's events itself.
+		LOG(INFO) << "Event groups can't follow new threads per-cpu; profiling per-thread";
+		options_.per_thread = true;
+	}
+	if (options_.overhead_budget && !options_.per_thread) {
+		FATAL("budget= needs perthread:, because new threads' inherited per-cpu events can't be retuned");
+	}
+	SampleFormat format = BuildSampleFormat(eventSetSpec.hasGroups(), eventSetSpec.hasDataAddresses());
+	PrepareEvents(eventSetSpec, format);
 
-	pthread_t thread;
-	if (pthread_create(&thread, nullptr, BackgroundThreadMain, this)) {
-		FATAL("Cannot create timer thread");
+	// Only mappings replaced during this profile matter to it
+	address_space_.reset(new AddressSpace());
+	address_space_->loadProcSelfMaps();
+
+	branches_.reset();
+	if (options_.branches) {
+		branches_.reset(new BranchProfile());
+	}
+	data_accesses_.reset();
+	if (format.checkFlag(PERF_SAMPLE_DATA_SRC)) {
+		data_accesses_.reset(new DataAccessProfile());
 	}
 
-	thread_ = thread;
+	overhead_.reset();
+	if (options_.overhead_budget) {
+		overhead_.reset(new OverheadController(options_.overhead_budget / 100, eventSetSpec.sampleRates()));
+	}
 
-	eventSet.setEnabled(true);
-}
+	{
+		lock_guard<mutex> lock(profiled_mutex);
+		profiled_address_space = address_space_;
+		profiled_branches = branches_;
+		profiled_data_accesses = data_accesses_;
+		profiled_overhead = overhead_;
+	}
+
+	// Per-thread events follow their threads across nodes, so they can't be sharded
+	vector<int> nodes;
+	if (options_.numa && !options_.per_thread) {
+		nodes = CpuSet::getNodes();
+	}
+	if (nodes.size() < 2) {
+		nodes.assign(1, -1);
+	}
+
+	for (auto it = nodes.begin(); it != nodes.end(); it++) {
+		shards_.push_back(unique_ptr<DrainShard>(new DrainShard(this, *it, eventSetSpec, format)));
+	}
+
+	thread_stop_ = false;
+	shards_started_ = false;
 
-EventSet& HardwarePerftoolsEventSource::BuildEventSystem(const string& events_arg) {
-	// We gradually whittle down the events_arg as we parse it
-	string events(events_arg);
+	// Each shard is built on its own thread, once that is pinned to the shard's node
+	exception_ptr error;
+	for (auto it = shards_.begin(); it != shards_.end(); it++) {
+		DrainShard& shard = **it;
+		future<void> ready = shard.ready.get_future();
+
+		pthread_t thread;
+		if (pthread_create(&thread, nullptr, BackgroundThreadMain, &shard)) {
+			error = make_exception_ptr(invalid_argument("Cannot create timer thread"));
+			break;
+		}
+		shard.thread = thread;
+
+		try {
+			ready.get();
+		} catch (...) {
+			error = current_exception();
+			break;
+		}
+	}
+
+	if (error) {
+		StopBackgroundThread();
+		shards_.clear();
+		rethrow_exception(error);
+	}
 
-	HardwareEventManager& eventManager = getEventManager();
+	shards_started_ = true;
 
-	EventSetSpecifier eventSetSpec = EventSetSpecifier::parse(events);
+	if (shards_.size() > 1) {
+		LOG(INFO) << "Hardware profiling with one drain thread on each of " << shards_.size() << " NUMA nodes";
+	}
+}
 
+void HardwarePerftoolsEventSource::PrepareEvents(EventSetSpecifier& eventSetSpec, const SampleFormat& format) const {
 	for (size_t j = 0; j < eventSetSpec.size(); j++) {
 		EventSpecification& eventSpec = eventSetSpec[j];
 
@@ -127,9 +462,13 @@ EventSet& HardwarePerftoolsEventSource::BuildEventSystem(const string& events_ar
 		// This lets us profile with unpriviledged users
 		// We only need this if /proc/sys/kernel/perf_event_paranoid == 2 (in single proc mode)
 		// TODO: Detect when this is required?
-		attr.exclude_kernel = options_.exclude_kernel ? 1 : 0;
+		// An event's own u or k modifier takes precedence
+		if (!eventSpec.modifiers().specifiesPrivilege()) {
+			attr.exclude_kernel = options_.exclude_kernel ? 1 : 0;
+		}
 
-		attr.sample_type = eventManager.format();
+		attr.sample_type = format;
+		attr.read_format = format.readFormat();
 
 		//attr.freq = 1; /* use freq, not period  */
 		//events_[i].hw_.sample_frequence = ???
@@ -137,75 +476,238 @@ EventSet& HardwarePerftoolsEventSource::BuildEventSystem(const string& events_ar
 		// trace fork/exit
 		attr.task = 1;
 
+		// Report code being mapped, with the time (and so the sample_type identity fields) on each record.
+		// Every event would report each mapping, so only the first one asks.
+		attr.mmap = (j == 0) ? 1 : 0;
+		attr.mmap2 = attr.mmap;
+		attr.sample_id_all = 1;
+
+		if (options_.branches) {
+			// Any taken branch, at the privilege levels the event samples
+			attr.branch_sample_type = PERF_SAMPLE_BRANCH_ANY;
+		}
+
+		if (options_.dwarf_stack_size) {
+			attr.sample_regs_user = format.regsUser();
+			attr.sample_stack_user = options_.dwarf_stack_size;
+		}
+
 		// inherit works in "one cpu, one pid" mode
 		// inherit does not work in "all cpus, one tid" mode
-		attr.inherit = 1;
+		// In per-thread mode we attach to new threads ourselves (from the FORK records)
+		attr.inherit = options_.per_thread ? 0 : 1;
 
-		// TODO: Expose this in the event spec string??
-		// (or compute a sensible default value??)
-		//attr.sample_period = 100000;
 		// By default, we ask the kernel to auto-tune to match our target
 		// sample_freq is events per second i.e. Hz
-		attr.freq = 1;
-		attr.sample_freq = 1000;
-	}
-
-	unique_ptr<EventSet> eventSetPtr(new EventSet(eventSetSpec, CpuSet::buildEachCpu(), ThreadSet::buildSingleProcess(getpid())));
+		// An event's period= or freq= modifier sets its own rate (already in attr)
+		if (!eventSpec.modifiers().specifiesRate()) {
+			attr.freq = 1;
+			attr.sample_freq = 1000;
+		}
 
-	EventSet& eventSet = eventManager.addEventSet(move(eventSetPtr));
-	return eventSet;
-}
+		if (attr.sample_type & PERF_SAMPLE_READ) {
+			// The kernel refuses PERF_SAMPLE_READ on inherited events (we're per-thread, so none are)
+			attr.inherit = 0;
+		}
 
-class ProfilerEventSink: public EventSink {
-public:
-	ProfilerEventSink(SampleFormat format, ProfileRecordCallback callback) :
-		EventSink(format), callback_(callback) {
+		if (eventSpec.isGroupSibling()) {
+			// Siblings just count: the leader enables, schedules and samples the whole group
+			if (eventSpec.modifiers().specifiesRate()) {
+				FATAL("Only a group's leader samples, so only it can have a period or freq: " + eventSpec.name());
+			}
+			attr.disabled = 0;
+			attr.enable_on_exec = 0;
+			attr.pinned = 0;
+			attr.task = 0;
+			attr.freq = 0;
+			attr.sample_period = 0;
+		}
 	}
+}
 
-	virtual void HandleRecordSample(PerfEvent event) {
-		DecodedPerfEvent decoded;
-		event.decode(format(), decoded);
-
-		if (decoded.callchain_size == 0) {
-			uint64_t fake_backtrace[1];
-			fake_backtrace[0] = decoded.ip;
-			callback_(1, (void**) fake_backtrace, 1);
-		} else {
-			callback_(1, (void**) decoded.callchain, decoded.callchain_size);
+void HardwarePerftoolsEventSource::BuildShard(DrainShard& shard) {
+	shard.event_manager.reset(new HardwareEventManager(shard.format, options_.overwrite, address_space_));
+	HardwareEventManager& eventManager = *shard.event_manager;
+
+	unique_ptr<EventSet> eventSetPtr;
+	if (options_.per_thread) {
+		eventSetPtr.reset(new EventSet(shard.event_set_spec, CpuSet::buildWildcard(), ThreadSet::findThreadsInProcess(getpid())));
+	} else {
+		CpuSet cpus = CpuSet::buildEachCpu(shard.node);
+		if (cpus.size() == 0) {
+			ostringstream message;
+			message << "No CPUs to profile on NUMA node " << shard.node;
+			FATAL(message.str());
 		}
+		eventSetPtr.reset(new EventSet(shard.event_set_spec, cpus, ThreadSet::buildSingleProcess(getpid())));
+	}
+	shard.event_set = &eventManager.addEventSet(move(eventSetPtr));
+
+	// The profiler's callback isn't safe to call from several threads at once: several shards, or
+	// several consumers draining one shard, meet only in the aggregators' merges. Merging is also
+	// when we resolve the frames, so the address space isn't locked for every sample.
+	shard.aggregator.reset(new StackAggregator(callback_, merge_mutex_, address_space_));
+
+	shard.profiler_sink.reset(new ProfilerEventSink(eventManager, *shard.aggregator, branches_, data_accesses_));
+	if (options_.consumer_threads > 0) {
+		// The consumers inherit our affinity, so they stay on the node too
+		shard.pipeline.reset(new SamplePipeline(*shard.profiler_sink, eventManager.channelKeys(), options_.consumer_threads));
+		shard.pipeline->start();
 	}
 
-private:
-	ProfileRecordCallback callback_;
-};
+	// Enable before we start polling, because in per-thread mode that changes the event set
+	shard.event_set->setEnabled(true);
+}
 
 void * HardwarePerftoolsEventSource::BackgroundThreadMain(void * arg) {
-	HardwarePerftoolsEventSource * instance = (HardwarePerftoolsEventSource*) arg;
+	DrainShard& shard = *(DrainShard *) arg;
+	HardwarePerftoolsEventSource * instance = shard.source;
+
+	try {
+		if (shard.node != -1) {
+			pinToNode(shard.node);
+		}
+		instance->BuildShard(shard);
+	} catch (...) {
+		shard.ready.set_exception(current_exception());
+		return 0;
+	}
+	shard.ready.set_value();
 
-	HardwareEventManager& eventManager = instance->getEventManager();
+	HardwareEventManager& eventManager = *shard.event_manager;
 
-	ProfilerEventSink sink(eventManager.format(), instance->callback_);
+	EventSink& sink = shard.pipeline ? shard.pipeline->producer() : *shard.profiler_sink;
 
 	while (!instance->thread_stop_) {
-		int timeout = 100;
+		// StopBackgroundThread wakes us, so this only bounds how long an idle poll sleeps
+		int timeout = 1000;
 		eventManager.poll(sink, timeout);
 		//		LOG(INFO) << "Completed poll loop";
+
+		shard.aggregator->flushIfDue();
+
+		if (instance->overhead_ && instance->shards_started_) {
+			instance->ControlOverhead(shard);
+		}
 	}
 
 	return 0;
 }
 
+void HardwarePerftoolsEventSource::ControlOverhead(DrainShard& shard) {
+	// poll returns at least every sweep interval, so this is close enough
+	uint64_t now = clockNanos(CLOCK_MONOTONIC) / 1000000;
+	if (now < shard.last_control_ms + OverheadController::CONTROL_INTERVAL_MS) {
+		return;
+	}
+	shard.last_control_ms = now;
+	shard.cpu_ns = clockNanos(CLOCK_THREAD_CPUTIME_ID);
+	if (shard.pipeline) {
+		shard.consumer_cpu_ns = shard.pipeline->consumerCpuNanos();
+	}
+
+	double scale;
+	if (&shard == shards_[0].get()) {
+		// The other shards' times are up to an interval old, which evens out
+		uint64_t pollNs = 0;
+		uint64_t consumerNs = 0;
+		uint64_t throttled = 0;
+		for (auto it = shards_.begin(); it != shards_.end(); it++) {
+			pollNs += (*it)->cpu_ns;
+			consumerNs += (*it)->consumer_cpu_ns;
+			if ((*it)->event_manager) {
+				throttled += (*it)->event_manager->statistics().throttled;
+			}
+		}
+		scale = overhead_->update(clockNanos(CLOCK_PROCESS_CPUTIME_ID), pollNs, consumerNs, throttled);
+	} else {
+		scale = overhead_->rateScale();
+	}
+
+	// Only our own thread changes our events
+	if (scale != shard.rate_scale) {
+		shard.rate_scale = scale;
+		shard.event_manager->scaleSampleRates(scale);
+	}
+}
+
 void HardwarePerftoolsEventSource::StopBackgroundThread() {
-	if (thread_) {
-		thread_stop_ = true;
-		if (pthread_join(thread_, NULL)) {
-			LOG(FATAL) << "Cannot stop background thread " << errno;
+	thread_stop_ = true;
+	for (auto it = shards_.begin(); it != shards_.end(); it++) {
+		DrainShard& shard = **it;
+		if (shard.thread) {
+			if (shard.event_manager) {
+				shard.event_manager->wakeup();
+			}
+			if (pthread_join(shard.thread, NULL)) {
+				LOG(FATAL) << "Cannot stop background thread " << errno;
+			}
+			shard.thread = 0;
+		}
+	}
+
+	HardwareEventManager::Statistics total;
+	total.lost = total.torn = total.throttled = 0;
+	uint64_t aggregated = 0;
+	uint64_t merged = 0;
+	for (auto it = shards_.begin(); it != shards_.end(); it++) {
+		DrainShard& shard = **it;
+		if (shard.pipeline) {
+			shard.pipeline->stop();
 		}
-		thread_ = 0;
+		if (shard.aggregator) {
+			shard.aggregator->flush();
+			aggregated += shard.aggregator->sampleCount();
+			merged += shard.aggregator->mergeCount();
+		}
+		if (shard.event_manager) {
+			HardwareEventManager::Statistics stats = shard.event_manager->statistics();
+			total.lost += stats.lost;
+			total.torn += stats.torn;
+			total.throttled += stats.throttled;
+		}
+	}
+
+	if (!shards_.empty() && shards_[0]->pipeline) {
+		SamplePipeline::Stats stats = pipelineStats();
+		LOG(INFO) << "Hardware samples read: " << stats.read << " delivered: " << stats.delivered << " dropped: " << stats.dropped;
+	}
+	if (shards_.size() > 1) {
+		LOG(INFO) << "Merged " << aggregated << " hardware samples from " << shards_.size() << " NUMA shards in " << merged << " profile records";
+	}
+
+	if (total.lost) {
+		LOG(WARNING) << "Kernel lost " << total.lost << " hardware sample records";
+	}
+	if (total.torn) {
+		LOG(WARNING) << "Discarded " << total.torn << " overwritten hardware sample records";
+	}
+	if (total.throttled) {
+		LOG(WARNING) << "Kernel throttled hardware sampling " << total.throttled << " times";
+	}
+
+	if (overhead_) {
+		OverheadController::Stats stats = overhead_->stats();
+		LOG(INFO) << "Hardware profiling overhead: " << (stats.overhead * 100) << "% (budget " << (stats.budget * 100) << "%), sampling at "
+				<< (stats.rate_scale * 100) << "% of the specified rates";
 	}
 	return;
 }
 
+SamplePipeline::Stats HardwarePerftoolsEventSource::pipelineStats() const {
+	SamplePipeline::Stats total;
+	total.read = total.delivered = total.dropped = 0;
+	for (auto it = shards_.begin(); it != shards_.end(); it++) {
+		if ((*it)->pipeline) {
+			SamplePipeline::Stats stats = (*it)->pipeline->stats();
+			total.read += stats.read;
+			total.delivered += stats.delivered;
+			total.dropped += stats.dropped;
+		}
+	}
+	return total;
+}
+
 void HardwarePerftoolsEventSource::Reset() {
 	StopBackgroundThread();
 }
@@ -4,8 +4,12 @@
 
 #include <string>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 #include "google/profiler_extension.h"
+#include "SamplePipeline.h"
 
 namespace fathomdb {
 namespace perftools {
@@ -14,15 +18,59 @@ namespace hardware {
 using namespace std;
 
 class HardwareEventManager;
+class AddressSpace;
+class BranchProfile;
+class DataAccessProfile;
+class OverheadController;
 class EventSet;
+class EventSetSpecifier;
+class EventSink;
+class SampleFormat;
 
 class EventOptions {
 public:
 	bool backtrace;
 	bool exclude_kernel;
 
+	/// Threads delivering samples to the profiler ("consumers=N:"); 0 delivers them on the
+	/// polling thread ("sync:"). With more than one, stacks are merged into the profile through a
+	/// StackAggregator, so the profiler's callback is still only called by one thread at a time.
+	int consumer_threads;
+
+	/// Let the kernel overwrite unread records ("overwrite:") rather than drop new ones when a buffer is full
+	bool overwrite;
+
+	/// Open events on each thread of the process ("perthread:"), following new threads as they start,
+	/// instead of on each cpu. Uses threads * events descriptors rather than cpus * events. Always on when
+	/// the events include a {group}, because group reads can't be inherited by new threads.
+	bool per_thread;
+
+	/// Bytes of user stack to copy with each sample, along with the user registers, so we can unwind
+	/// it with the DWARF unwind tables ("dwarfstack:" or "dwarfstack=BYTES:"); 0 if off.
+	/// Gives call graphs from code built without frame pointers, at the cost of copying the stack.
+	uint32_t dwarf_stack_size;
+
+	/// Sample the branch stack (LBR) too ("branches:"), aggregating it into a BranchProfile for AutoFDO.
+	/// Fails on machines without LBR.
+	bool branches;
+
+	/// Keep the profiler's own CPU time under this percentage of the process's ("budget=PERCENT%:"), by
+	/// lowering the sampling rates as needed; 0 if off. See OverheadController. Needs per_thread, because
+	/// only the events we open ourselves can be retuned: in per-cpu mode, new threads' would keep their rates.
+	double overhead_budget;
+
+	/// In per-cpu mode on a host with several NUMA nodes, shard the events by node (unless "nonuma:"): each
+	/// node's channels are drained by their own thread pinned to the node's CPUs, and its samples are
+	/// aggregated before they are merged into the profile.
+	bool numa;
+
+	static const uint32_t DEFAULT_DWARF_STACK_SIZE = 8192;
+
+	/// The kernel limits the whole sample record to 64KB
+	static const uint32_t MAX_DWARF_STACK_SIZE = 60 * 1024;
+
 	EventOptions() :
-		backtrace(false), exclude_kernel(false) {
+		backtrace(false), exclude_kernel(false), consumer_threads(1), overwrite(false), per_thread(false), dwarf_stack_size(0), branches(false), overhead_budget(0), numa(true) {
 	}
 
 	static EventOptions parse(const string& spec, string& leftover);
@@ -31,6 +79,7 @@ public:
 class HardwarePerftoolsEventSource: public ProfileEventSource {
 public:
 	HardwarePerftoolsEventSource(const string& event_spec, ::ProfileRecordCallback callback);
+	~HardwarePerftoolsEventSource();
 
 	void RegisterThread(int callback_count);
 
@@ -46,25 +95,69 @@ public:
 
 	void Reset();
 
-	EventSet& BuildEventSystem(const string& events);
+	/// Counters for the current (or last) profiling run, over all its shards; all zero in sync mode.
+	SamplePipeline::Stats pipelineStats() const;
+
+	/// The code mappings of the most recently started hardware profile, to export alongside it
+	/// (instead of /proc/self/maps); NULL if there hasn't been one
+	static shared_ptr<AddressSpace> profiledAddressSpace();
+
+	/// The branch edges of the most recently started hardware profile, if it used "branches:"; otherwise NULL
+	static shared_ptr<BranchProfile> profiledBranches();
+
+	/// The data addresses of the most recently started hardware profile, if any of its events had the 'd'
+	/// modifier; otherwise NULL
+	static shared_ptr<DataAccessProfile> profiledDataAccesses();
+
+	/// The overhead controller of the most recently started hardware profile, if it had a budget; otherwise NULL.
+	/// Its stats() are the measured overhead and current sampling rates.
+	static shared_ptr<OverheadController> profiledOverhead();
 
 private:
-	HardwareEventManager& getEventManager();
+	/// One NUMA node's events, with their own channels, drained by their own thread
+	struct DrainShard;
+
+	/// readGroups adds the group counter values to each sample, and dataAddresses the data address, source
+	/// and weight
+	SampleFormat BuildSampleFormat(bool readGroups, bool dataAddresses) const;
+
+	/// Sets up the parsed events' attributes for profiling with our options, in format
+	void PrepareEvents(EventSetSpecifier& eventSetSpec, const SampleFormat& format) const;
+
+	/// Called by a shard's thread: opens its events, and starts delivering them to the profiler
+	void BuildShard(DrainShard& shard);
 
 	//  SpinLock lock_;
 	string event_spec_;
 	ProfileRecordCallback callback_;
 
-	unique_ptr<HardwareEventManager> event_manager_;
+	/// A single shard (node -1), unless we shard by NUMA node
+	vector<unique_ptr<DrainShard> > shards_;
+
+	/// Held by the shards' StackAggregators while they call the profiler
+	mutex merge_mutex_;
 
 	void StartBackgroundThread();
 	void StopBackgroundThread();
 
-	pthread_t thread_;
-	bool thread_stop_;
+	/// Called by each shard's thread: every control interval, the first shard measures our overhead and
+	/// picks the rate, and each shard applies it to its events
+	void ControlOverhead(DrainShard& shard);
+
+	atomic<bool> thread_stop_;
+	/// Set once every shard is built; until then the shards only poll
+	atomic<bool> shards_started_;
 	bool events_enabled_;
 	EventOptions options_;
 
+	/// Shared by the shards of the current profile
+	shared_ptr<AddressSpace> address_space_;
+	shared_ptr<BranchProfile> branches_;
+	shared_ptr<DataAccessProfile> data_accesses_;
+
+	/// When options_.overhead_budget is set
+	shared_ptr<OverheadController> overhead_;
+
 	static void * BackgroundThreadMain(void * arg);
 };
 
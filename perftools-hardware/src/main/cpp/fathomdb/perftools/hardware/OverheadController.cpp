@@ -0,0 +1,95 @@
+// See COPYRIGHT for copyright
+#include "OverheadController.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+/// We never sample less than this fraction of the specified rates
+static const double MIN_RATE_SCALE = 0.001;
+
+/// Under this fraction of the budget, the rates recover by RECOVERY_STEP each interval
+static const double RECOVERY_THRESHOLD = 0.5;
+static const double RECOVERY_STEP = 1.25;
+
+/// A throttled interval halves the rates
+static const double THROTTLED_STEP = 0.5;
+
+/// Intervals with less process CPU time than this say too little about our share of it
+static const uint64_t MIN_PROCESS_NS = 10 * 1000 * 1000;
+
+OverheadController::OverheadController(double budget, const vector<SampleRate>& rates) :
+	budget_(budget), rates_(rates), last_process_ns_(0), last_profiler_ns_(0), last_throttled_(0), overhead_(0), rate_scale_(1.0),
+			poll_cpu_ns_(0), consumer_cpu_ns_(0), adjustments_(0) {
+}
+
+double OverheadController::update(uint64_t processCpuNs, uint64_t pollCpuNs, uint64_t consumerCpuNs, uint64_t throttled) {
+	lock_guard<mutex> lock(mutex_);
+
+	uint64_t profilerNs = pollCpuNs + consumerCpuNs;
+	poll_cpu_ns_ = pollCpuNs;
+	consumer_cpu_ns_ = consumerCpuNs;
+
+	uint64_t processDelta = processCpuNs - last_process_ns_;
+	if (processDelta < MIN_PROCESS_NS && throttled == last_throttled_) {
+		return rate_scale_;
+	}
+
+	uint64_t profilerDelta = profilerNs - last_profiler_ns_;
+	bool wasThrottled = (throttled != last_throttled_);
+
+	last_process_ns_ = processCpuNs;
+	last_profiler_ns_ = profilerNs;
+	last_throttled_ = throttled;
+
+	overhead_ = processDelta ? (double) profilerDelta / processDelta : 0;
+
+	double scale = rate_scale_;
+	if (overhead_ > budget_) {
+		// Our cost is roughly proportional to the rate; aim a little under the budget
+		scale *= max(0.1, 0.9 * budget_ / overhead_);
+	}
+	if (wasThrottled) {
+		scale = min(scale, rate_scale_ * THROTTLED_STEP);
+	}
+	if (!wasThrottled && overhead_ < budget_ * RECOVERY_THRESHOLD) {
+		scale *= RECOVERY_STEP;
+	}
+	scale = max(MIN_RATE_SCALE, min(1.0, scale));
+
+	if (scale != rate_scale_) {
+		rate_scale_ = scale;
+		adjustments_++;
+	}
+	return rate_scale_;
+}
+
+double OverheadController::rateScale() const {
+	lock_guard<mutex> lock(mutex_);
+	return rate_scale_;
+}
+
+OverheadController::Stats OverheadController::stats() const {
+	lock_guard<mutex> lock(mutex_);
+
+	Stats stats;
+	stats.budget = budget_;
+	stats.overhead = overhead_;
+	stats.rate_scale = rate_scale_;
+	stats.poll_cpu_ns = poll_cpu_ns_;
+	stats.consumer_cpu_ns = consumer_cpu_ns_;
+	stats.throttled = last_throttled_;
+	stats.adjustments = adjustments_;
+	for (auto it = rates_.begin(); it != rates_.end(); it++) {
+		stats.rates.push_back(it->scaled(rate_scale_));
+	}
+	return stats;
+}
+
+}
+}
+}
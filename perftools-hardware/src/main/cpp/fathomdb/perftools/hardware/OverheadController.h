@@ -0,0 +1,87 @@
+// See COPYRIGHT for copyright
+#ifndef OVERHEADCONTROLLER_H_
+#define OVERHEADCONTROLLER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+#include "EventSet.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Keeps the profiler's cost under a budget, a fraction of the process's CPU time ("budget=1%:"), by
+ * scaling the sampling rate of every event.
+ *
+ * The polling thread calls update() every CONTROL_INTERVAL_MS with the cumulative CPU time of the
+ * process, of the polling threads and of the consumer threads that deliver their samples, and the number
+ * of times the kernel has throttled our events. Over budget, or
+ * throttled, the rates are cut in proportion to the excess; well under budget, they recover gradually
+ * up to the rates the events were specified with.
+ *
+ * The kernel's own cost of taking samples isn't measured, except through throttling.
+ *
+ * Safe to use from several threads.
+ */
+class OverheadController {
+public:
+	static const uint64_t CONTROL_INTERVAL_MS = 1000;
+
+	struct Stats {
+		/// The budget, as a fraction of the process's CPU time
+		double budget;
+
+		/// The profiler's share of the process's CPU time in the last interval
+		double overhead;
+
+		/// The current rates as a fraction of the specified ones
+		double rate_scale;
+
+		uint64_t poll_cpu_ns;
+		uint64_t consumer_cpu_ns;
+		uint64_t throttled;
+		uint64_t adjustments;
+
+		/// Each sampling event's current rate
+		vector<SampleRate> rates;
+	};
+
+	/// rates are those the events were specified with
+	OverheadController(double budget, const vector<SampleRate>& rates);
+
+	/// Called by the polling thread with cumulative times and counts; returns the rate scale to apply
+	double update(uint64_t processCpuNs, uint64_t pollCpuNs, uint64_t consumerCpuNs, uint64_t throttled);
+
+	Stats stats() const;
+
+	/// The current rates as a fraction of the specified ones (as last returned by update)
+	double rateScale() const;
+
+private:
+	double budget_;
+	vector<SampleRate> rates_;
+
+	/// The totals at the last update
+	uint64_t last_process_ns_;
+	uint64_t last_profiler_ns_;
+	uint64_t last_throttled_;
+
+	double overhead_;
+	double rate_scale_;
+	uint64_t poll_cpu_ns_;
+	uint64_t consumer_cpu_ns_;
+	uint64_t adjustments_;
+
+	mutable mutex mutex_;
+};
+
+}
+}
+}
+
+#endif /* OVERHEADCONTROLLER_H_ */
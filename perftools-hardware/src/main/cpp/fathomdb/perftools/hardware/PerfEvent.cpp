@@ -1,8 +1,10 @@
 // See COPYRIGHT for copyright
 #include "PerfEvent.h"
+#include <linux/perf_event.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <sstream>
+#include <algorithm>
 
 using namespace std;
 
@@ -41,6 +43,20 @@ namespace hardware {
  *
  *	{ u32			size;
  *	  char                  data[size];}&& PERF_SAMPLE_RAW
+ *
+ *	{ u64			nr;
+ *	  { u64			hw_idx; } && PERF_SAMPLE_BRANCH_HW_INDEX
+ *	  { u64 from, to, flags } lbr[nr]; } && PERF_SAMPLE_BRANCH_STACK
+ *
+ *	{ u64			abi;
+ *	  u64			regs[weight(mask)]; } && PERF_SAMPLE_REGS_USER
+ *
+ *	{ u64			size;
+ *	  char			data[size];
+ *	  u64			dyn_size; } && PERF_SAMPLE_STACK_USER
+ *
+ *	{ u64			weight;   } && PERF_SAMPLE_WEIGHT
+ *	{ u64			data_src; } && PERF_SAMPLE_DATA_SRC
  * };
  */
 
@@ -97,7 +113,15 @@ void PerfEvent::dump(SampleFormat flags) {
 	}
 
 	//	* {	struct read_format values;}&& PERF_SAMPLE_READ
-	// TODO: ????
+	if (flags.checkFlag(PERF_SAMPLE_READ)) {
+		s << " read:" << dec;
+		for (uint64_t i = 0; i < event.read_count; i++) {
+			s << " " << event.readValue(i);
+			if (flags.checkReadFlag(PERF_FORMAT_ID)) {
+				s << "(id " << event.readId(i) << ")";
+			}
+		}
+	}
 
 	//	* {	u64 nr,
 	//		* u64 ips[nr];}&& PERF_SAMPLE_CALLCHAIN
@@ -112,6 +136,36 @@ void PerfEvent::dump(SampleFormat flags) {
 		}
 	}
 
+	if (flags.checkFlag(PERF_SAMPLE_BRANCH_STACK)) {
+		s << " branches:" << hex;
+		for (uint64_t i = 0; i < event.branch_count; i++) {
+			const perf_branch_entry& branch = event.branches[i];
+			s << " " << branch.from << "->" << branch.to;
+			if (branch.mispred) {
+				s << "(mispredicted)";
+			}
+		}
+	}
+
+	if (flags.checkFlag(PERF_SAMPLE_REGS_USER)) {
+		s << " regs:" << hex;
+		for (uint64_t i = 0; i < event.regs_count; i++) {
+			s << " " << event.regs_user[i];
+		}
+	}
+
+	if (flags.checkFlag(PERF_SAMPLE_STACK_USER)) {
+		s << " stack: " << dec << event.stack_dyn_size << "/" << event.stack_size;
+	}
+
+	if (flags.checkFlag(PERF_SAMPLE_WEIGHT)) {
+		s << " weight: " << dec << event.weight;
+	}
+
+	if (flags.checkFlag(PERF_SAMPLE_DATA_SRC)) {
+		s << " data_src: " << hex << event.data_src;
+	}
+
 	LOG(WARNING) << "Record: " << s.str();
 }
 
@@ -171,8 +225,59 @@ void PerfEvent::decode(SampleFormat flags, DecodedPerfEvent& decoded) {
 		p += 8;
 	}
 
-	//	* {	struct read_format values;}&& PERF_SAMPLE_READ
-	// TODO: ????
+	/*
+	 * {	struct read_format values;}&& PERF_SAMPLE_READ
+	 *
+	 * struct read_format {
+	 *	{ u64		value;
+	 *	  { u64		time_enabled; } && PERF_FORMAT_TOTAL_TIME_ENABLED
+	 *	  { u64		time_running; } && PERF_FORMAT_TOTAL_TIME_RUNNING
+	 *	  { u64		id;           } && PERF_FORMAT_ID
+	 *	} && !PERF_FORMAT_GROUP
+	 *
+	 *	{ u64		nr;
+	 *	  { u64		time_enabled; } && PERF_FORMAT_TOTAL_TIME_ENABLED
+	 *	  { u64		time_running; } && PERF_FORMAT_TOTAL_TIME_RUNNING
+	 *	  { u64		value;
+	 *	    { u64	id;           } && PERF_FORMAT_ID
+	 *	  }		cntr[nr];
+	 *	} && PERF_FORMAT_GROUP
+	 * };
+	 */
+	decoded.read_count = 0;
+	decoded.time_enabled = 0;
+	decoded.time_running = 0;
+	decoded.read_stride = flags.checkReadFlag(PERF_FORMAT_ID) ? 2 : 1;
+
+	if (flags.checkFlag(PERF_SAMPLE_READ)) {
+		uint64_t * values = (uint64_t *) p;
+		if (flags.checkReadFlag(PERF_FORMAT_GROUP)) {
+			decoded.read_count = *values++;
+			if (flags.checkReadFlag(PERF_FORMAT_TOTAL_TIME_ENABLED)) {
+				decoded.time_enabled = *values++;
+			}
+			if (flags.checkReadFlag(PERF_FORMAT_TOTAL_TIME_RUNNING)) {
+				decoded.time_running = *values++;
+			}
+			decoded.read_values = values;
+			values += decoded.read_count * decoded.read_stride;
+		} else {
+			// The times sit between the value and the id, so copy the pair out
+			decoded.read_count = 1;
+			decoded.read_single[0] = *values++;
+			if (flags.checkReadFlag(PERF_FORMAT_TOTAL_TIME_ENABLED)) {
+				decoded.time_enabled = *values++;
+			}
+			if (flags.checkReadFlag(PERF_FORMAT_TOTAL_TIME_RUNNING)) {
+				decoded.time_running = *values++;
+			}
+			if (flags.checkReadFlag(PERF_FORMAT_ID)) {
+				decoded.read_single[1] = *values++;
+			}
+			decoded.read_values = decoded.read_single;
+		}
+		p = (uint8_t *) values;
+	}
 
 	//	* {	u64 nr,
 	//		* u64 ips[nr];}&& PERF_SAMPLE_CALLCHAIN
@@ -192,6 +297,67 @@ void PerfEvent::decode(SampleFormat flags, DecodedPerfEvent& decoded) {
 			p += sizeof(uint64_t) * decoded.callchain_size;
 		}
 	}
+
+	//	* {	u32 size;
+	//		* char data[size];}&& PERF_SAMPLE_RAW
+	if (flags.checkFlag(PERF_SAMPLE_RAW)) {
+		// The size includes the padding that aligns the record
+		p += 4 + *((uint32_t*) p);
+	}
+
+	//	* {	u64 nr;
+	//		* { u64 from, to, flags } lbr[nr];}&& PERF_SAMPLE_BRANCH_STACK
+	decoded.branch_count = 0;
+	if (flags.checkFlag(PERF_SAMPLE_BRANCH_STACK)) {
+		decoded.branch_count = *((uint64_t*) p);
+		p += 8;
+		decoded.branches = (perf_branch_entry*) p;
+		p += sizeof(perf_branch_entry) * decoded.branch_count;
+	}
+
+	//	* {	u64 abi;
+	//		* u64 regs[weight(mask)];}&& PERF_SAMPLE_REGS_USER
+	decoded.regs_abi = PERF_SAMPLE_REGS_ABI_NONE;
+	decoded.regs_count = 0;
+	if (flags.checkFlag(PERF_SAMPLE_REGS_USER)) {
+		decoded.regs_abi = *((uint64_t*) p);
+		p += 8;
+		if (decoded.regs_abi != PERF_SAMPLE_REGS_ABI_NONE) {
+			decoded.regs_count = __builtin_popcountll(flags.regsUser());
+			decoded.regs_user = (uint64_t*) p;
+			p += sizeof(uint64_t) * decoded.regs_count;
+		}
+	}
+
+	//	* {	u64 size;
+	//		* char data[size];
+	//		* u64 dyn_size;}&& PERF_SAMPLE_STACK_USER (dyn_size only if size != 0)
+	decoded.stack_size = 0;
+	decoded.stack_dyn_size = 0;
+	if (flags.checkFlag(PERF_SAMPLE_STACK_USER)) {
+		decoded.stack_size = *((uint64_t*) p);
+		p += 8;
+		if (decoded.stack_size != 0) {
+			decoded.stack_data = (char*) p;
+			p += decoded.stack_size;
+			decoded.stack_dyn_size = min(*((uint64_t*) p), decoded.stack_size);
+			p += 8;
+		}
+	}
+
+	//	* {	u64 weight;}&& PERF_SAMPLE_WEIGHT
+	decoded.weight = 0;
+	if (flags.checkFlag(PERF_SAMPLE_WEIGHT)) {
+		decoded.weight = *((uint64_t*) p);
+		p += 8;
+	}
+
+	//	* {	u64 data_src;}&& PERF_SAMPLE_DATA_SRC
+	decoded.data_src = 0;
+	if (flags.checkFlag(PERF_SAMPLE_DATA_SRC)) {
+		decoded.data_src = *((uint64_t*) p);
+		p += 8;
+	}
 }
 
 }
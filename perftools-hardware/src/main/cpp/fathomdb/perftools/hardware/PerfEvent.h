@@ -2,9 +2,12 @@
 #ifndef PERFEVENT_H_
 #define PERFEVENT_H_
 
+#include <stddef.h>
+
 #include "SampleFormat.h"
 
 struct perf_event_header;
+struct perf_branch_entry;
 
 namespace fathomdb {
 namespace perftools {
@@ -28,6 +31,10 @@ public:
 
 	void decode(SampleFormat flags, DecodedPerfEvent& decoded);
 
+	perf_event_header * header() const {
+		return header_;
+	}
+
 private:
 	// Lightweight... copy-by-value is OK
 	perf_event_header * header_;
@@ -49,6 +56,48 @@ public:
 
 	uint64_t callchain_size;
 	uint64_t * callchain;
+
+	// PERF_SAMPLE_READ: the counters of the sampled event's group (just the event, if it isn't grouped)
+	// The values are running totals; take the difference between samples for a rate.
+	uint64_t read_count;
+	uint64_t time_enabled;
+	uint64_t time_running;
+
+	uint64_t readValue(size_t i) const {
+		return read_values[i * read_stride];
+	}
+
+	/// The PERF_EVENT_IOC_ID of the counter, if PERF_FORMAT_ID was requested (otherwise 0)
+	uint64_t readId(size_t i) const {
+		return read_stride > 1 ? read_values[i * read_stride + 1] : 0;
+	}
+
+	uint64_t * read_values;
+	size_t read_stride;
+	uint64_t read_single[2];
+
+	// PERF_SAMPLE_BRANCH_STACK: the most recent branches first (we don't ask for PERF_SAMPLE_BRANCH_HW_INDEX)
+	uint64_t branch_count;
+	perf_branch_entry * branches;
+
+	// PERF_SAMPLE_REGS_USER: the format's regsUser() registers, in bit order; none if regs_abi is
+	// PERF_SAMPLE_REGS_ABI_NONE (the sample wasn't taken in user space)
+	uint64_t regs_abi;
+	uint64_t regs_count;
+	uint64_t * regs_user;
+
+	// PERF_SAMPLE_STACK_USER: a copy of the user stack from the sampled stack pointer up.
+	// Only the first stack_dyn_size bytes are valid.
+	uint64_t stack_size;
+	char * stack_data;
+	uint64_t stack_dyn_size;
+
+	// PERF_SAMPLE_WEIGHT: the cost of the sampled access (for memory events, its latency in cycles); 0 if unknown
+	uint64_t weight;
+
+	// PERF_SAMPLE_DATA_SRC: where the sampled access was satisfied, a perf_mem_data_src (its fields are
+	// PERF_MEM_*_NA if the PMU doesn't know); 0 if not sampled
+	uint64_t data_src;
 };
 
 }
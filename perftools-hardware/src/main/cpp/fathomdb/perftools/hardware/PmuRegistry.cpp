@@ -0,0 +1,233 @@
+// See COPYRIGHT for copyright
+#include "PmuRegistry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+/*static*/const char * PmuRegistry::DEFAULT_ROOT = "/sys/bus/event_source/devices";
+
+// The names in a directory (without . and ..); empty if it can't be read
+static vector<string> listDirectory(const string& dir) {
+	vector<string> names;
+
+	struct dirent **namelist = nullptr;
+	int n = scandir(dir.c_str(), &namelist, nullptr, alphasort);
+	if (n < 0) {
+		return names;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (namelist[i]->d_name[0] != '.') {
+			names.push_back(namelist[i]->d_name);
+		}
+		free(namelist[i]);
+	}
+	free(namelist);
+	return names;
+}
+
+// The first line of a (sysfs) file, without its newline
+static bool readLine(const string& path, string& line) {
+	ifstream ifs(path.c_str());
+	if (ifs.fail()) {
+		return false;
+	}
+	getline(ifs, line);
+	return true;
+}
+
+static bool parseNumber(const string& s, uint64_t& value) {
+	if (s.empty())
+		return false;
+	char * end;
+	value = strtoull(s.c_str(), &end, 0);
+	return *end == '\0';
+}
+
+/*static*/const PmuRegistry& PmuRegistry::system() {
+	static const PmuRegistry registry;
+	return registry;
+}
+
+PmuRegistry::PmuRegistry(const string& root) {
+	vector<string> names = listDirectory(root);
+	for (auto it = names.begin(); it != names.end(); it++) {
+		loadPmu(*it, root + "/" + *it);
+	}
+}
+
+void PmuRegistry::loadPmu(const string& name, const string& dir) {
+	Pmu pmu;
+	pmu.name = name;
+
+	string type;
+	uint64_t value;
+	if (!readLine(dir + "/type", type) || !parseNumber(type, value)) {
+		LOG(WARNING) << "Ignoring PMU without a type: " << dir;
+		return;
+	}
+	pmu.type = value;
+
+	vector<string> formats = listDirectory(dir + "/format");
+	for (auto it = formats.begin(); it != formats.end(); it++) {
+		string spec;
+		if (!readLine(dir + "/format/" + *it, spec))
+			continue;
+		try {
+			pmu.formats[*it] = parseFormat(spec);
+		} catch (invalid_argument& e) {
+			LOG(WARNING) << "Ignoring PMU format " << name << "/" << *it << ": " << e.what();
+		}
+	}
+
+	vector<string> events = listDirectory(dir + "/events");
+	for (auto it = events.begin(); it != events.end(); it++) {
+		// Alongside the events are their .scale, .unit etc.
+		if (it->find('.') != string::npos)
+			continue;
+		string terms;
+		if (readLine(dir + "/events/" + *it, terms)) {
+			pmu.events[*it] = terms;
+		}
+	}
+
+	pmus_[name] = pmu;
+}
+
+/*static*/PmuRegistry::FormatField PmuRegistry::parseFormat(const string& spec) {
+	// e.g. "config:0-7", "config1:0-31" or "config:0-7,21"
+	FormatField field;
+
+	size_t colon = spec.find(':');
+	string config = spec.substr(0, colon);
+	if (config == "config") {
+		field.config = 0;
+	} else if (config == "config1") {
+		field.config = 1;
+	} else if (config == "config2") {
+		field.config = 2;
+	} else {
+		throw invalid_argument("Unknown config field: " + spec);
+	}
+
+	if (colon == string::npos) {
+		throw invalid_argument("Expected bits: " + spec);
+	}
+
+	istringstream in(spec.substr(colon + 1));
+	string range;
+	while (getline(in, range, ',')) {
+		// "low-high", or a single bit
+		int low, high;
+		char dash = '-';
+		int fields = sscanf(range.c_str(), "%d%c%d", &low, &dash, &high);
+		if (fields == 1) {
+			high = low;
+		}
+		if (fields == 0 || fields == 2 || dash != '-' || low < 0 || high < low || high > 63)
+			throw invalid_argument("Bad bit range: " + spec);
+		field.ranges.push_back(make_pair(low, high));
+	}
+	return field;
+}
+
+bool PmuRegistry::FormatField::apply(uint64_t value, perf_event_attr *attr) const {
+	__u64 * target = (config == 0) ? &attr->config : (config == 1) ? &attr->config1 : &attr->config2;
+
+	for (auto it = ranges.begin(); it != ranges.end(); it++) {
+		int width = it->second - it->first + 1;
+		uint64_t mask = (width == 64) ? ~((uint64_t) 0) : ((((uint64_t) 1) << width) - 1);
+		*target = (*target & ~(mask << it->first)) | ((value & mask) << it->first);
+		value = (width == 64) ? 0 : (value >> width);
+	}
+	return value == 0;
+}
+
+const PmuRegistry::Pmu * PmuRegistry::findPmu(const string& name) const {
+	auto it = pmus_.find(name);
+	if (it == pmus_.end())
+		return NULL;
+	return &it->second;
+}
+
+const PmuRegistry::Pmu * PmuRegistry::findEvent(const string& eventName) const {
+	const Pmu * cpu = findPmu("cpu");
+	if (cpu && cpu->events.count(eventName))
+		return cpu;
+
+	for (auto it = pmus_.begin(); it != pmus_.end(); it++) {
+		if (it->second.events.count(eventName))
+			return &it->second;
+	}
+	return NULL;
+}
+
+void PmuRegistry::fillAttributes(const string& pmuName, const string& terms, perf_event_attr *attr) const {
+	const Pmu * pmu = findPmu(pmuName);
+	if (!pmu) {
+		throw invalid_argument("Unknown PMU: " + pmuName);
+	}
+
+	attr->type = pmu->type;
+	attr->config = 0;
+	attr->config1 = 0;
+	attr->config2 = 0;
+	applyTerms(*pmu, terms, true, attr);
+}
+
+void PmuRegistry::applyTerms(const Pmu& pmu, const string& terms, bool allowEvents, perf_event_attr *attr) const {
+	istringstream in(terms);
+	string term;
+	while (getline(in, term, ',')) {
+		if (term.empty())
+			continue;
+
+		string name = term;
+		uint64_t value = 1;
+		size_t equals = term.find('=');
+		if (equals != string::npos) {
+			name = term.substr(0, equals);
+			string valueString = term.substr(equals + 1);
+			if (valueString == "?") {
+				throw invalid_argument("PMU " + pmu.name + " needs a value for term: " + name);
+			}
+			if (!parseNumber(valueString, value)) {
+				throw invalid_argument("Bad value for PMU term: " + term);
+			}
+		}
+
+		auto format = pmu.formats.find(name);
+		if (format != pmu.formats.end()) {
+			if (!format->second.apply(value, attr)) {
+				throw invalid_argument("Value too large for PMU term: " + term);
+			}
+		} else if (name == "config") {
+			attr->config = value;
+		} else if (name == "config1") {
+			attr->config1 = value;
+		} else if (name == "config2") {
+			attr->config2 = value;
+		} else if (allowEvents && equals == string::npos && pmu.events.count(name)) {
+			applyTerms(pmu, pmu.events.find(name)->second, false, attr);
+		} else {
+			throw invalid_argument("Unknown term for PMU " + pmu.name + ": " + name);
+		}
+	}
+}
+
+}
+}
+}
@@ -0,0 +1,90 @@
+// See COPYRIGHT for copyright
+#ifndef PMUREGISTRY_H_
+#define PMUREGISTRY_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+#include <linux/perf_event.h>
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * The PMUs the kernel describes in sysfs (/sys/bus/event_source/devices/<pmu>/), so we can open
+ * model-specific and uncore events as perf does:
+ *
+ *	type		the perf_event_attr type to open the PMU's events with
+ *	format/<term>	where a term's value goes in the config fields, e.g. "config:0-7" or "config1:0-31"
+ *	events/<name>	a named event, as terms, e.g. "event=0x3c,umask=0x00"
+ *
+ * Everything is read when the registry is constructed. system() is the registry of this machine, read
+ * on first use; a registry can also be built from another root, e.g. a copy of some other machine's tree.
+ */
+class PmuRegistry {
+public:
+	/// Where a term's value goes: bit ranges of config, config1 or config2, filled from the value's low bits up
+	struct FormatField {
+		int config;
+		vector<pair<int, int> > ranges;
+
+		/// Sets the field's bits of attr to value; returns false if value doesn't fit
+		bool apply(uint64_t value, perf_event_attr *attr) const;
+	};
+
+	struct Pmu {
+		string name;
+		uint32_t type;
+		map<string, FormatField> formats;
+
+		/// Each named event's terms
+		map<string, string> events;
+	};
+
+	static const char * DEFAULT_ROOT;
+
+	/// The PMUs of this machine, read once
+	static const PmuRegistry& system();
+
+	explicit PmuRegistry(const string& root = DEFAULT_ROOT);
+
+	/// The PMU, or NULL if there isn't one of that name
+	const Pmu * findPmu(const string& name) const;
+
+	/// The PMU with a named event of that name, preferring "cpu"; NULL if none has one
+	const Pmu * findEvent(const string& eventName) const;
+
+	/**
+	 * Fills attr with a PMU's event, from comma-separated terms as in "event=0x3c,umask=0x0,cmask=1":
+	 * each term is one of the PMU's formats, config, config1 or config2, or one of its named events (whose
+	 * terms are applied in its place, so later terms override them). A term without a value is 1.
+	 * Throws invalid_argument on an unknown PMU or term.
+	 */
+	void fillAttributes(const string& pmuName, const string& terms, perf_event_attr *attr) const;
+
+	const map<string, Pmu>& pmus() const {
+		return pmus_;
+	}
+
+private:
+	void loadPmu(const string& name, const string& dir);
+
+	/// Applies terms to attr; an event's own terms can't name another event
+	void applyTerms(const Pmu& pmu, const string& terms, bool allowEvents, perf_event_attr *attr) const;
+
+	static FormatField parseFormat(const string& spec);
+
+	map<string, Pmu> pmus_;
+};
+
+}
+}
+}
+
+#endif /* PMUREGISTRY_H_ */
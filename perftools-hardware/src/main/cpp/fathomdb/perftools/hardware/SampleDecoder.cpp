@@ -0,0 +1,58 @@
+// See COPYRIGHT for copyright
+#include "SampleDecoder.h"
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+static constexpr uint64_t specialisedFlags[] = { PERF_SAMPLE_IP, PERF_SAMPLE_TID, PERF_SAMPLE_TIME, PERF_SAMPLE_ADDR,
+		PERF_SAMPLE_CPU, PERF_SAMPLE_PERIOD, PERF_SAMPLE_CALLCHAIN };
+
+static const size_t SPECIALISED_FLAG_COUNT = sizeof(specialisedFlags) / sizeof(specialisedFlags[0]);
+
+// Walks the specialised flags, instantiating decodeSample for every combination of them
+// (2^7 small functions), and returns the one matching format
+template<size_t Bit, uint64_t Format>
+struct DecoderSelector {
+	static SampleDecoder::DecodeFunction select(uint64_t format) {
+		if (format & specialisedFlags[Bit]) {
+			return DecoderSelector<Bit + 1, Format | specialisedFlags[Bit]>::select(format);
+		}
+		return DecoderSelector<Bit + 1, Format>::select(format);
+	}
+};
+
+template<uint64_t Format>
+struct DecoderSelector<SPECIALISED_FLAG_COUNT, Format> {
+	static SampleDecoder::DecodeFunction select(uint64_t format) {
+		return &decodeSample<Format>;
+	}
+};
+
+SampleDecoder::SampleDecoder(SampleFormat format) :
+	format_(format), decode_(NULL) {
+	if (((uint64_t) format & ~SPECIALISED_SAMPLE_FLAGS) == 0) {
+		decode_ = DecoderSelector<0, 0>::select(format);
+	}
+}
+
+void SampleDecoder::decodeGeneric(PerfEvent event, ProfileSample& sample) const {
+	DecodedPerfEvent decoded;
+	event.decode(format_, decoded);
+
+	sample.ip = format_.checkFlag(PERF_SAMPLE_IP) ? decoded.ip : 0;
+	sample.pid = format_.checkFlag(PERF_SAMPLE_TID) ? decoded.pid : 0;
+	sample.tid = format_.checkFlag(PERF_SAMPLE_TID) ? decoded.tid : 0;
+	sample.time = format_.checkFlag(PERF_SAMPLE_TIME) ? decoded.time : 0;
+	sample.addr = format_.checkFlag(PERF_SAMPLE_ADDR) ? decoded.addr : 0;
+	sample.cpu = format_.checkFlag(PERF_SAMPLE_CPU) ? decoded.cpu : 0;
+	sample.period = format_.checkFlag(PERF_SAMPLE_PERIOD) ? decoded.period : 0;
+	sample.callchain_size = decoded.callchain_size;
+	sample.callchain = decoded.callchain_size ? decoded.callchain : NULL;
+}
+
+}
+}
+}
@@ -0,0 +1,113 @@
+// See COPYRIGHT for copyright
+#ifndef SAMPLEDECODER_H_
+#define SAMPLEDECODER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/perf_event.h>
+
+#include "SampleFormat.h"
+#include "PerfEvent.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/// The fields of a PERF_RECORD_SAMPLE that the profiler uses; those not in the format are 0
+struct ProfileSample {
+	uint64_t ip;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t time;
+	uint64_t addr;
+	uint32_t cpu;
+	uint64_t period;
+
+	uint64_t callchain_size;
+	uint64_t * callchain;
+};
+
+/// The sample_type bits we specialise decoders on; any other bit (e.g. PERF_SAMPLE_READ) uses PerfEvent::decode
+static const uint64_t SPECIALISED_SAMPLE_FLAGS = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR
+		| PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD | PERF_SAMPLE_CALLCHAIN;
+
+constexpr size_t sampleFieldSize(uint64_t format, uint64_t flag) {
+	return (format & flag) ? 8 : 0;
+}
+
+/**
+ * The offset of each field from the start of the record, for a sample_type known at compile time.
+ * The fields are laid out in the order of the flags' values (see PerfEvent.cpp), each 8 bytes.
+ */
+template<uint64_t Format>
+struct SampleLayout {
+	static constexpr size_t IP = sizeof(perf_event_header);
+	static constexpr size_t TID = IP + sampleFieldSize(Format, PERF_SAMPLE_IP);
+	static constexpr size_t TIME = TID + sampleFieldSize(Format, PERF_SAMPLE_TID);
+	static constexpr size_t ADDR = TIME + sampleFieldSize(Format, PERF_SAMPLE_TIME);
+	static constexpr size_t CPU = ADDR + sampleFieldSize(Format, PERF_SAMPLE_ADDR);
+	static constexpr size_t PERIOD = CPU + sampleFieldSize(Format, PERF_SAMPLE_CPU);
+	static constexpr size_t CALLCHAIN = PERIOD + sampleFieldSize(Format, PERF_SAMPLE_PERIOD);
+};
+
+/// Decodes a sample of exactly this Format; the tests of Format are resolved at compile time
+template<uint64_t Format>
+void decodeSample(const perf_event_header * header, ProfileSample& sample) {
+	typedef SampleLayout<Format> Layout;
+	const uint8_t * p = (const uint8_t *) header;
+
+	sample.ip = (Format & PERF_SAMPLE_IP) ? *((const uint64_t *) (p + Layout::IP)) : 0;
+	sample.pid = (Format & PERF_SAMPLE_TID) ? *((const uint32_t *) (p + Layout::TID)) : 0;
+	sample.tid = (Format & PERF_SAMPLE_TID) ? *((const uint32_t *) (p + Layout::TID + 4)) : 0;
+	sample.time = (Format & PERF_SAMPLE_TIME) ? *((const uint64_t *) (p + Layout::TIME)) : 0;
+	sample.addr = (Format & PERF_SAMPLE_ADDR) ? *((const uint64_t *) (p + Layout::ADDR)) : 0;
+	sample.cpu = (Format & PERF_SAMPLE_CPU) ? *((const uint32_t *) (p + Layout::CPU)) : 0;
+	sample.period = (Format & PERF_SAMPLE_PERIOD) ? *((const uint64_t *) (p + Layout::PERIOD)) : 0;
+
+	if (Format & PERF_SAMPLE_CALLCHAIN) {
+		sample.callchain_size = *((const uint64_t *) (p + Layout::CALLCHAIN));
+		sample.callchain = (uint64_t *) (p + Layout::CALLCHAIN + 8);
+	} else {
+		sample.callchain_size = 0;
+		sample.callchain = NULL;
+	}
+}
+
+/**
+ * Decodes samples with a decoder specialised for the format, chosen once when the decoder is built,
+ * rather than testing each flag of the format on every sample as PerfEvent::decode does.
+ */
+class SampleDecoder {
+public:
+	typedef void (*DecodeFunction)(const perf_event_header * header, ProfileSample& sample);
+
+	explicit SampleDecoder(SampleFormat format);
+
+	void decode(PerfEvent event, ProfileSample& sample) const {
+		if (decode_) {
+			decode_(event.header(), sample);
+		} else {
+			decodeGeneric(event, sample);
+		}
+	}
+
+	/// False if the format has fields we don't specialise on, so we fall back to PerfEvent::decode
+	bool isSpecialised() const {
+		return decode_ != NULL;
+	}
+
+private:
+	void decodeGeneric(PerfEvent event, ProfileSample& sample) const;
+
+	SampleFormat format_;
+	DecodeFunction decode_;
+};
+
+}
+}
+}
+
+#endif /* SAMPLEDECODER_H_ */
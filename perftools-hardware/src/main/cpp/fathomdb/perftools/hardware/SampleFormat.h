@@ -16,19 +16,35 @@ using namespace std;
  */
 class SampleFormat {
 public:
-	SampleFormat(uint64_t format) :
-		format_(format) {
+	SampleFormat(uint64_t format, uint64_t readFormat = 0, uint64_t regsUser = 0) :
+		format_(format), read_format_(readFormat), regs_user_(regsUser) {
 	}
 
 	bool checkFlag(perf_event_sample_format flag) const {
 		return format_ & flag;
 	}
 
+	/// The read_format of the events, which determines the layout of PERF_SAMPLE_READ values
+	uint64_t readFormat() const {
+		return read_format_;
+	}
+
+	bool checkReadFlag(perf_event_read_format flag) const {
+		return read_format_ & flag;
+	}
+
+	/// The sample_regs_user of the events: which registers PERF_SAMPLE_REGS_USER records, in bit order
+	uint64_t regsUser() const {
+		return regs_user_;
+	}
+
 	operator uint64_t() const {
 		return format_;
 	}
 private:
 	uint64_t format_;
+	uint64_t read_format_;
+	uint64_t regs_user_;
 };
 
 }
@@ -0,0 +1,196 @@
+// See COPYRIGHT for copyright
+#include "SamplePipeline.h"
+
+#include <unistd.h>
+#include <time.h>
+#include <stdexcept>
+
+#include <linux/perf_event.h>
+#include <glog/logging.h>
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+SamplePipeline::SamplePipeline(EventSink& downstream, const vector<EventChannelSet::key_t>& channels, int consumers, size_t ringSize) :
+	downstream_(downstream), producer_(*this), stopping_(false), read_(0), delivered_(0) {
+	CHECK_GT(consumers, 0);
+
+	for (auto it = channels.begin(); it != channels.end(); it++) {
+		unique_ptr<RingSink> ring(new RingSink(*this, ringSize));
+		channel_sinks_[*it] = ring.get();
+		rings_.push_back(move(ring));
+	}
+
+	// No point having consumers with no rings
+	size_t count = min((size_t) consumers, max(rings_.size(), (size_t) 1));
+	consumers_.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		consumers_[i].pipeline = this;
+		consumers_[i].index = i;
+		consumers_[i].thread = 0;
+	}
+}
+
+SamplePipeline::~SamplePipeline() {
+	stop();
+}
+
+void SamplePipeline::RingSink::HandleRecordSample(PerfEvent event) {
+	perf_event_header * header = event.header();
+
+	pipeline_.read_.fetch_add(1, memory_order_relaxed);
+	if (!ring_.push(header, header->size)) {
+		dropped_.fetch_add(1, memory_order_relaxed);
+	}
+}
+
+// Queued in order with the samples, as a record in the kernel's format
+struct LostRecord {
+	perf_event_header header;
+	uint64_t id;
+	uint64_t lost;
+};
+
+void SamplePipeline::RingSink::HandleRecordLost(uint64_t lost) {
+	LostRecord record;
+	record.header.type = PERF_RECORD_LOST;
+	record.header.misc = 0;
+	record.header.size = sizeof(record);
+	record.id = 0;
+	record.lost = lost;
+
+	if (!ring_.push(&record, sizeof(record))) {
+		dropped_.fetch_add(lost, memory_order_relaxed);
+	}
+}
+
+EventSink& SamplePipeline::ProducerSink::ChannelSink(const EventChannelSet::key_t& channel) {
+	auto it = pipeline_.channel_sinks_.find(channel);
+	if (it == pipeline_.channel_sinks_.end()) {
+		// A channel that was added after we were built (e.g. a new thread).
+		if (pipeline_.rings_.empty()) {
+			return pipeline_.downstream_;
+		}
+
+		// All the rings have the one producer (the polling thread), so channels can share a ring
+		size_t index = (size_t) (channel.first + 1) * 31 + channel.second;
+		RingSink * ring = pipeline_.rings_[index % pipeline_.rings_.size()].get();
+		pipeline_.channel_sinks_[channel] = ring;
+		return *ring;
+	}
+	return *it->second;
+}
+
+void SamplePipeline::start() {
+	stopping_ = false;
+
+	for (auto it = consumers_.begin(); it != consumers_.end(); it++) {
+		if (pthread_create(&it->thread, nullptr, ConsumerMain, &*it)) {
+			throw invalid_argument("Cannot create sample consumer thread");
+		}
+	}
+}
+
+void SamplePipeline::stop() {
+	stopping_ = true;
+
+	for (auto it = consumers_.begin(); it != consumers_.end(); it++) {
+		if (it->thread) {
+			if (pthread_join(it->thread, NULL)) {
+				LOG(FATAL) << "Cannot stop sample consumer thread " << errno;
+			}
+			it->thread = 0;
+		}
+	}
+}
+
+uint64_t SamplePipeline::consumerCpuNanos() const {
+	uint64_t total = 0;
+	for (auto it = consumers_.begin(); it != consumers_.end(); it++) {
+		clockid_t clock;
+		timespec time;
+		if (it->thread && pthread_getcpuclockid(it->thread, &clock) == 0 && clock_gettime(clock, &time) == 0) {
+			total += (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+		}
+	}
+	return total;
+}
+
+SamplePipeline::Stats SamplePipeline::stats() const {
+	Stats stats;
+	stats.read = read_.load(memory_order_relaxed);
+	stats.delivered = delivered_.load(memory_order_relaxed);
+	stats.dropped = 0;
+	for (auto it = rings_.begin(); it != rings_.end(); it++) {
+		stats.dropped += (*it)->dropped_.load(memory_order_relaxed);
+	}
+	return stats;
+}
+
+size_t SamplePipeline::drain(RingSink& sink, size_t max) {
+	SampleRing& ring = sink.ring();
+
+	size_t count = 0;
+	while (count < max) {
+		size_t size;
+		const void * record = ring.front(&size);
+		if (!record) {
+			break;
+		}
+
+		perf_event_header * header = (perf_event_header *) record;
+		if (header->type == PERF_RECORD_LOST) {
+			downstream_.HandleRecordLost(((const LostRecord *) record)->lost);
+		} else {
+			downstream_.HandleRecordSample(PerfEvent(header));
+			count++;
+		}
+
+		ring.pop(size);
+	}
+
+	if (count) {
+		delivered_.fetch_add(count, memory_order_relaxed);
+	}
+
+	// What we dropped ourselves is as lost as what the kernel dropped
+	uint64_t dropped = sink.dropped_.load(memory_order_relaxed);
+	if (dropped != sink.reported_dropped_) {
+		downstream_.HandleRecordLost(dropped - sink.reported_dropped_);
+		sink.reported_dropped_ = dropped;
+	}
+
+	return count;
+}
+
+void * SamplePipeline::ConsumerMain(void * arg) {
+	Consumer * consumer = (Consumer *) arg;
+	SamplePipeline * pipeline = consumer->pipeline;
+	size_t stride = pipeline->consumers_.size();
+
+	while (true) {
+		// Read the flag first, so a final pass after it is set sees everything the producer wrote
+		bool stopping = pipeline->stopping_.load(memory_order_acquire);
+
+		size_t count = 0;
+		for (size_t i = consumer->index; i < pipeline->rings_.size(); i += stride) {
+			count += pipeline->drain(*pipeline->rings_[i], MAX_BATCH);
+		}
+
+		if (count == 0) {
+			if (stopping) {
+				break;
+			}
+			usleep(IDLE_SLEEP_MICROS);
+		}
+	}
+
+	return 0;
+}
+
+}
+}
+}
@@ -0,0 +1,136 @@
+// See COPYRIGHT for copyright
+#ifndef SAMPLEPIPELINE_H_
+#define SAMPLEPIPELINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "EventSet.h"
+#include "EventSink.h"
+#include "SampleRing.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Decouples reading the perf mmap buffers from delivering samples.
+ *
+ * The polling thread passes producer() to HardwareEventManager::poll; each channel's raw records
+ * are copied into that channel's SampleRing (lock-free, single producer / single consumer).
+ * Consumer threads drain the rings in batches and hand the records to the downstream sink.
+ * Each ring belongs to exactly one consumer, so records from a channel stay in order.
+ * With more than one consumer, the downstream sink is called concurrently.
+ *
+ * If a ring is full the record is dropped (and counted), rather than stalling the reader
+ * and letting the kernel's buffer overflow instead. Drops are passed downstream as lost records,
+ * in the same way as the kernel's own PERF_RECORD_LOST.
+ */
+class SamplePipeline {
+public:
+	static const size_t DEFAULT_RING_SIZE = 256 * 1024;
+
+	struct Stats {
+		/// Samples taken from the kernel's buffers
+		uint64_t read;
+		/// Samples handed to the downstream sink
+		uint64_t delivered;
+		/// Samples dropped because a ring was full
+		uint64_t dropped;
+	};
+
+	SamplePipeline(EventSink& downstream, const vector<EventChannelSet::key_t>& channels, int consumers, size_t ringSize = DEFAULT_RING_SIZE);
+	~SamplePipeline();
+
+	/// The sink to poll into
+	EventSink& producer() {
+		return producer_;
+	}
+
+	void start();
+
+	/// Stop the consumers, once they have delivered everything already queued.
+	/// The producer must already have stopped.
+	void stop();
+
+	Stats stats() const;
+
+	/// The CPU time the consumer threads have used; only between start() and stop()
+	uint64_t consumerCpuNanos() const;
+
+private:
+	class RingSink: public EventSink {
+	public:
+		RingSink(SamplePipeline& pipeline, size_t ringSize) :
+			EventSink(pipeline.downstream_.format()), pipeline_(pipeline), ring_(ringSize), dropped_(0), reported_dropped_(0) {
+		}
+
+		virtual void HandleRecordSample(PerfEvent event);
+		virtual void HandleRecordLost(uint64_t lost);
+
+		SampleRing& ring() {
+			return ring_;
+		}
+
+	private:
+		friend class SamplePipeline;
+
+		SamplePipeline& pipeline_;
+		SampleRing ring_;
+
+		/// Written by the producer
+		atomic<uint64_t> dropped_;
+		/// How much of dropped_ the consumer has passed downstream
+		uint64_t reported_dropped_;
+	};
+
+	class ProducerSink: public EventSink {
+	public:
+		ProducerSink(SamplePipeline& pipeline) :
+			EventSink(pipeline.downstream_.format()), pipeline_(pipeline) {
+		}
+
+		virtual EventSink& ChannelSink(const EventChannelSet::key_t& channel);
+
+	private:
+		SamplePipeline& pipeline_;
+	};
+
+	struct Consumer {
+		SamplePipeline * pipeline;
+		size_t index;
+		pthread_t thread;
+	};
+
+	static const size_t MAX_BATCH = 256;
+	static const int IDLE_SLEEP_MICROS = 1000;
+
+	static void * ConsumerMain(void * arg);
+
+	size_t drain(RingSink& sink, size_t max);
+
+	EventSink& downstream_;
+	ProducerSink producer_;
+
+	// Only used by the producer; channels added later share the existing rings
+	map<EventChannelSet::key_t, RingSink *> channel_sinks_;
+	vector<unique_ptr<RingSink> > rings_;
+	vector<Consumer> consumers_;
+
+	atomic<bool> stopping_;
+
+	atomic<uint64_t> read_;
+	atomic<uint64_t> delivered_;
+};
+
+}
+}
+}
+
+#endif /* SAMPLEPIPELINE_H_ */
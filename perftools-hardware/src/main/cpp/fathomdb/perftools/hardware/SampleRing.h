@@ -0,0 +1,120 @@
+// See COPYRIGHT for copyright
+#ifndef SAMPLERING_H_
+#define SAMPLERING_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+
+#include <glog/logging.h>
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Lock-free single-producer / single-consumer ring of variable-sized records.
+ *
+ * Each record is stored contiguously as a 64 bit length followed by the data, padded to 8 bytes.
+ * If a record doesn't fit before the end of the buffer, the producer writes a wrap marker and
+ * starts again at the beginning, so the consumer never sees a split record.
+ *
+ * head_ is only written by the producer and tail_ only by the consumer; each publishes with a
+ * release store and reads the other's position with an acquire load.
+ */
+class SampleRing {
+public:
+	/// capacity must be a power of two (and a multiple of 8)
+	SampleRing(size_t capacity) :
+		buffer_(new uint64_t[capacity / sizeof(uint64_t)]), capacity_(capacity), mask_(capacity - 1), head_(0), tail_(0) {
+		// Otherwise mask_ doesn't wrap offsets, and records silently overwrite each other
+		CHECK(capacity >= sizeof(uint64_t) && (capacity & (capacity - 1)) == 0) << "SampleRing capacity must be a power of two (and a multiple of 8): " << capacity;
+	}
+
+	/// Producer: copy a record in. Returns false if there isn't room; the record is then dropped.
+	bool push(const void * data, size_t size) {
+		size_t needed = sizeof(uint64_t) + align(size);
+
+		uint64_t head = head_.load(memory_order_relaxed);
+		uint64_t tail = tail_.load(memory_order_acquire);
+
+		size_t offset = head & mask_;
+		size_t contiguous = capacity_ - offset;
+		size_t total = (contiguous < needed) ? contiguous + needed : needed;
+		if (capacity_ - (head - tail) < total) {
+			return false;
+		}
+
+		char * base = (char *) buffer_.get();
+		if (contiguous < needed) {
+			*((uint64_t *) (base + offset)) = WRAP_MARKER;
+			head += contiguous;
+			offset = 0;
+		}
+
+		*((uint64_t *) (base + offset)) = size;
+		memcpy(base + offset + sizeof(uint64_t), data, size);
+
+		head_.store(head + needed, memory_order_release);
+		return true;
+	}
+
+	/// Consumer: the oldest record, or NULL if the ring is empty. Valid until pop().
+	const void * front(size_t * size) {
+		uint64_t tail = tail_.load(memory_order_relaxed);
+		uint64_t head = head_.load(memory_order_acquire);
+		if (tail == head) {
+			return NULL;
+		}
+
+		char * base = (char *) buffer_.get();
+		size_t offset = tail & mask_;
+		uint64_t length = *((uint64_t *) (base + offset));
+		if (length == WRAP_MARKER) {
+			tail += capacity_ - offset;
+			tail_.store(tail, memory_order_release);
+			offset = 0;
+			length = *((uint64_t *) base);
+		}
+
+		*size = length;
+		return base + offset + sizeof(uint64_t);
+	}
+
+	/// Consumer: release the record returned by front().
+	void pop(size_t size) {
+		uint64_t tail = tail_.load(memory_order_relaxed);
+		tail_.store(tail + sizeof(uint64_t) + align(size), memory_order_release);
+	}
+
+	size_t capacity() const {
+		return capacity_;
+	}
+
+private:
+	static const uint64_t WRAP_MARKER = ~((uint64_t) 0);
+
+	static size_t align(size_t size) {
+		return (size + 7) & ~((size_t) 7);
+	}
+
+	unique_ptr<uint64_t[]> buffer_;
+	size_t capacity_;
+	size_t mask_;
+
+	// Keep the producer's and consumer's positions on separate cache lines
+	char pad0_[64];
+	atomic<uint64_t> head_;
+	char pad1_[64];
+	atomic<uint64_t> tail_;
+	char pad2_[64];
+};
+
+}
+}
+}
+
+#endif /* SAMPLERING_H_ */
@@ -0,0 +1,152 @@
+// See COPYRIGHT for copyright
+#include "StackAggregator.h"
+
+#include <limits.h>
+#include <time.h>
+
+#include <algorithm>
+
+using namespace std;
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+static uint64_t monotonicMillis() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+size_t StackAggregator::StackHash::operator()(const stack_t& stack) const {
+	size_t hash = stack.size();
+	for (auto it = stack.begin(); it != stack.end(); it++) {
+		hash = hash * 31 + (*it >> 4) + (*it << 7);
+	}
+	return hash;
+}
+
+StackAggregator::StackAggregator(ProfileRecordCallback callback, mutex& mergeMutex, const shared_ptr<AddressSpace>& addressSpace,
+		size_t maxStacks) :
+	callback_(callback), merge_mutex_(mergeMutex), address_space_(addressSpace), max_stacks_(maxStacks), last_flush_ms_(monotonicMillis()),
+			samples_(0), merges_(0) {
+}
+
+void StackAggregator::add(int count, void ** stack, int depth, uint64_t time) {
+	counts_t full;
+	{
+		lock_guard<mutex> lock(mutex_);
+
+		samples_ += count;
+
+		scratch_.assign((uintptr_t *) stack, (uintptr_t *) stack + depth);
+		auto it = counts_.find(scratch_);
+		if (it != counts_.end()) {
+			StackCount& existing = it->second;
+			existing.count += count;
+			// Records from different channels can arrive out of order
+			existing.first_time = min(existing.first_time, time);
+			existing.last_time = max(existing.last_time, time);
+			return;
+		}
+		StackCount added = { (uint64_t) count, time, time };
+		counts_.insert(make_pair(scratch_, added));
+
+		if (counts_.size() < max_stacks_)
+			return;
+
+		full.swap(counts_);
+		last_flush_ms_ = monotonicMillis();
+	}
+
+	merge(full);
+}
+
+void StackAggregator::flush() {
+	counts_t counts;
+	{
+		lock_guard<mutex> lock(mutex_);
+		counts.swap(counts_);
+		last_flush_ms_ = monotonicMillis();
+	}
+
+	merge(counts);
+}
+
+void StackAggregator::flushIfDue() {
+	{
+		lock_guard<mutex> lock(mutex_);
+		if (monotonicMillis() < last_flush_ms_ + FLUSH_INTERVAL_MS)
+			return;
+	}
+
+	flush();
+}
+
+void StackAggregator::merge(const counts_t& counts) {
+	if (counts.empty())
+		return;
+
+	if (address_space_) {
+		markSampled(counts);
+	}
+
+	uint64_t merges = 0;
+	{
+		lock_guard<mutex> lock(merge_mutex_);
+		for (auto it = counts.begin(); it != counts.end(); it++) {
+			void ** stack = (void **) &it->first[0];
+			uint64_t count = it->second.count;
+			while (count > 0) {
+				int n = (int) min(count, (uint64_t) INT_MAX);
+				callback_(n, stack, it->first.size());
+				count -= n;
+				merges++;
+			}
+		}
+	}
+
+	lock_guard<mutex> lock(mutex_);
+	merges_ += merges;
+}
+
+void StackAggregator::markSampled(const counts_t& counts) {
+	// Most stacks share most of their frames
+	unordered_map<uintptr_t, AddressSpace::SampledAddress> frames;
+	for (auto it = counts.begin(); it != counts.end(); it++) {
+		const StackCount& stackCount = it->second;
+		for (auto frame = it->first.begin(); frame != it->first.end(); frame++) {
+			auto inserted = frames.insert(make_pair(*frame, AddressSpace::SampledAddress()));
+			AddressSpace::SampledAddress& address = inserted.first->second;
+			if (inserted.second) {
+				address.addr = *frame;
+				address.first_time = stackCount.first_time;
+				address.last_time = stackCount.last_time;
+			} else {
+				address.first_time = min(address.first_time, stackCount.first_time);
+				address.last_time = max(address.last_time, stackCount.last_time);
+			}
+		}
+	}
+
+	vector<AddressSpace::SampledAddress> addresses;
+	addresses.reserve(frames.size());
+	for (auto it = frames.begin(); it != frames.end(); it++) {
+		addresses.push_back(it->second);
+	}
+	address_space_->markSampled(addresses);
+}
+
+uint64_t StackAggregator::sampleCount() const {
+	lock_guard<mutex> lock(mutex_);
+	return samples_;
+}
+
+uint64_t StackAggregator::mergeCount() const {
+	lock_guard<mutex> lock(mutex_);
+	return merges_;
+}
+
+}
+}
+}
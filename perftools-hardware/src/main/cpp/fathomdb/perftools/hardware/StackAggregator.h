@@ -0,0 +1,98 @@
+// See COPYRIGHT for copyright
+#ifndef STACKAGGREGATOR_H_
+#define STACKAGGREGATOR_H_
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "google/profiler_extension.h"
+
+#include "AddressSpace.h"
+
+namespace fathomdb {
+namespace perftools {
+namespace hardware {
+
+using namespace std;
+
+/**
+ * Counts identical stacks locally, and merges them into the profile with one callback per distinct
+ * stack (with its count), when the table fills or at least every FLUSH_INTERVAL_MS.
+ *
+ * Each NUMA shard's samples go through its own aggregator (as do a shard's, when several consumer
+ * threads deliver them), so they only meet when they merge, under a lock shared by every aggregator
+ * feeding the same callback; the profiler's callback is never called concurrently, and is called far
+ * less often.
+ *
+ * Each distinct stack's frames are resolved against the address space when it merges, marking the
+ * mappings they hit (over the span of time the stack was sampled), rather than on every sample.
+ *
+ * Safe to use from several threads.
+ */
+class StackAggregator {
+public:
+	static const size_t DEFAULT_MAX_STACKS = 4096;
+	static const uint64_t FLUSH_INTERVAL_MS = 100;
+
+	/// mergeMutex is held while calling callback. addressSpace may be NULL.
+	StackAggregator(ProfileRecordCallback callback, mutex& mergeMutex, const shared_ptr<AddressSpace>& addressSpace,
+			size_t maxStacks = DEFAULT_MAX_STACKS);
+
+	/// time is the sample's, in perf clock time
+	void add(int count, void ** stack, int depth, uint64_t time);
+
+	/// Merges everything counted so far into the profile
+	void flush();
+
+	/// Flushes if it hasn't for FLUSH_INTERVAL_MS
+	void flushIfDue();
+
+	/// Samples added, and callbacks made for them
+	uint64_t sampleCount() const;
+	uint64_t mergeCount() const;
+
+private:
+	typedef vector<uintptr_t> stack_t;
+
+	struct StackHash {
+		size_t operator()(const stack_t& stack) const;
+	};
+
+	struct StackCount {
+		uint64_t count;
+		uint64_t first_time;
+		uint64_t last_time;
+	};
+
+	typedef unordered_map<stack_t, StackCount, StackHash> counts_t;
+
+	/// Merges counts; called without mutex_ held
+	void merge(const counts_t& counts);
+
+	/// Marks the mappings the stacks' frames hit; called without mutex_ held
+	void markSampled(const counts_t& counts);
+
+	ProfileRecordCallback callback_;
+	mutex& merge_mutex_;
+	shared_ptr<AddressSpace> address_space_;
+	size_t max_stacks_;
+
+	counts_t counts_;
+	/// For lookups, so that counting a stack we've seen doesn't allocate
+	stack_t scratch_;
+	uint64_t last_flush_ms_;
+
+	uint64_t samples_;
+	uint64_t merges_;
+
+	mutable mutex mutex_;
+};
+
+}
+}
+}
+
+#endif /* STACKAGGREGATOR_H_ */
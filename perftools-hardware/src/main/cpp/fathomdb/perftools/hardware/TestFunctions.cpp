@@ -1,14 +1,25 @@
 // See COPYRIGHT for copyright
 #include "TestFunctions.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include <string>
+#include <vector>
 #include <algorithm>
+#include <fstream>
+#include <stdexcept>
 
 #include <glog/logging.h>
 
 #include "HardwareEventManager.h"
 #include "SampleFormat.h"
 #include "EventSink.h"
+#include "SampleDecoder.h"
+#include "PmuRegistry.h"
 
 using namespace fathomdb::perftools::hardware;
 using namespace std;
@@ -90,3 +101,225 @@ void TestGoogleProfiler() {
 		LOG(INFO) << "Completed sort " << j;
 	}
 }
+
+static double monotonicSeconds() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Builds samples of the hardware profiler's format (ip, tid, time, callchain) and reports how many
+// per second PerfEvent::decode and the specialised SampleDecoder get through
+void BenchmarkSampleDecoding() {
+	const int SAMPLE_COUNT = 4096;
+	const int CALLCHAIN_DEPTH = 16;
+	const int ITERATIONS = 2000;
+
+	SampleFormat format(PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN);
+
+	// header, ip, pid/tid, time, nr, ips[nr]
+	size_t words = 1 + 1 + 1 + 1 + 1 + CALLCHAIN_DEPTH;
+	vector<uint64_t> buffer(words * SAMPLE_COUNT);
+	for (int i = 0; i < SAMPLE_COUNT; i++) {
+		uint64_t * record = &buffer[i * words];
+		perf_event_header header;
+		header.type = PERF_RECORD_SAMPLE;
+		header.misc = PERF_RECORD_MISC_USER;
+		header.size = words * sizeof(uint64_t);
+		memcpy(record, &header, sizeof(header));
+
+		record[1] = 0x400000 + i;
+		record[2] = ((uint64_t) (1000 + i % 8) << 32) | 1000;
+		record[3] = i;
+		record[4] = CALLCHAIN_DEPTH;
+		for (int j = 0; j < CALLCHAIN_DEPTH; j++) {
+			record[5 + j] = 0x400000 + i + j;
+		}
+	}
+
+	// Sum some fields so the decoding can't be optimised away
+	uint64_t checksum = 0;
+
+	double start = monotonicSeconds();
+	for (int n = 0; n < ITERATIONS; n++) {
+		for (int i = 0; i < SAMPLE_COUNT; i++) {
+			PerfEvent event((perf_event_header *) &buffer[i * words]);
+			DecodedPerfEvent decoded;
+			event.decode(format, decoded);
+			checksum += decoded.ip + decoded.tid + decoded.time + decoded.callchain[decoded.callchain_size - 1];
+		}
+	}
+	double generic = monotonicSeconds() - start;
+
+	SampleDecoder decoder(format);
+	CHECK(decoder.isSpecialised());
+
+	start = monotonicSeconds();
+	for (int n = 0; n < ITERATIONS; n++) {
+		for (int i = 0; i < SAMPLE_COUNT; i++) {
+			PerfEvent event((perf_event_header *) &buffer[i * words]);
+			ProfileSample decoded;
+			decoder.decode(event, decoded);
+			checksum -= decoded.ip + decoded.tid + decoded.time + decoded.callchain[decoded.callchain_size - 1];
+		}
+	}
+	double specialised = monotonicSeconds() - start;
+
+	// Both decoders should have seen the same values
+	CHECK_EQ(checksum, 0);
+
+	double samples = (double) SAMPLE_COUNT * ITERATIONS;
+	LOG(INFO) << "PerfEvent::decode: " << (uint64_t) (samples / generic) << " samples/sec";
+	LOG(INFO) << "SampleDecoder: " << (uint64_t) (samples / specialised) << " samples/sec";
+}
+
+// A PMU tree in sysfs layout, in a temporary directory that is removed again with the object
+class FakeSysfs {
+public:
+	FakeSysfs() {
+		char dir[] = "/tmp/pmu-test.XXXXXX";
+		CHECK(mkdtemp(dir) != NULL);
+		root_ = dir;
+	}
+
+	~FakeSysfs() {
+		for (auto it = paths_.rbegin(); it != paths_.rend(); it++) {
+			remove(it->c_str());
+		}
+		rmdir(root_.c_str());
+	}
+
+	const string& root() const {
+		return root_;
+	}
+
+	/// Writes path (relative to the root, creating its directories) with contents and a newline, as sysfs does
+	void write(const string& path, const string& contents) {
+		for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1)) {
+			string dir = root_ + "/" + path.substr(0, slash);
+			if (mkdir(dir.c_str(), 0755) == 0) {
+				paths_.push_back(dir);
+			}
+		}
+
+		string file = root_ + "/" + path;
+		ofstream out(file.c_str());
+		out << contents << "\n";
+		CHECK(!out.fail()) << file;
+		paths_.push_back(file);
+	}
+
+private:
+	string root_;
+	vector<string> paths_;
+};
+
+static bool fillFails(const PmuRegistry& pmus, const string& pmu, const string& terms) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	try {
+		pmus.fillAttributes(pmu, terms, &attr);
+	} catch (invalid_argument& e) {
+		return true;
+	}
+	return false;
+}
+
+static perf_event_attr fill(const PmuRegistry& pmus, const string& pmu, const string& terms) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	pmus.fillAttributes(pmu, terms, &attr);
+	return attr;
+}
+
+void TestPmuRegistry() {
+	FakeSysfs sysfs;
+	sysfs.write("cpu/type", "4");
+	sysfs.write("cpu/format/event", "config:0-7");
+	sysfs.write("cpu/format/umask", "config:8-15");
+	sysfs.write("cpu/format/edge", "config:18");
+	sysfs.write("cpu/format/cmask", "config:24-31");
+	// A field split over two ranges, filled from its low bits up
+	sysfs.write("cpu/format/split", "config:32-35,40-43");
+	sysfs.write("cpu/format/ldlat", "config1:0-15");
+	sysfs.write("cpu/events/mem-loads", "event=0xcd,umask=0x1,ldlat=3");
+	sysfs.write("cpu/events/mem-loads.scale", "1");
+	sysfs.write("uncore_imc/type", "17");
+	sysfs.write("uncore_imc/format/event", "config:0-7");
+	sysfs.write("uncore_imc/format/umask", "config:8-15");
+	sysfs.write("uncore_imc/events/cas_count_read", "event=0x04,umask=0x03");
+	sysfs.write("uncore_imc/events/needs_umask", "event=0x01,umask=?");
+	sysfs.write("broken/format/event", "config:0-7");
+
+	PmuRegistry pmus(sysfs.root());
+
+	// A PMU without a type is ignored, as are an event's .scale and .unit files
+	CHECK_EQ(pmus.pmus().size(), (size_t) 2);
+	CHECK(pmus.findPmu("broken") == NULL);
+	const PmuRegistry::Pmu * cpu = pmus.findPmu("cpu");
+	CHECK(cpu != NULL);
+	CHECK_EQ(cpu->type, 4u);
+	CHECK_EQ(cpu->formats.size(), (size_t) 6);
+	CHECK_EQ(cpu->events.size(), (size_t) 1);
+
+	CHECK_EQ(pmus.findEvent("mem-loads"), cpu);
+	CHECK_EQ(pmus.findEvent("cas_count_read"), pmus.findPmu("uncore_imc"));
+	CHECK(pmus.findEvent("nope") == NULL);
+
+	perf_event_attr attr = fill(pmus, "cpu", "event=0x3c,umask=0x1,edge,cmask=2");
+	CHECK_EQ(attr.type, 4u);
+	CHECK_EQ(attr.config, 0x0204013cULL);
+
+	// Multi-range formats
+	CHECK_EQ(fill(pmus, "cpu", "split=0xab").config, 0x0a0b00000000ULL);
+	CHECK_EQ(fill(pmus, "cpu", "split=0xff,event=1").config, 0x0f0f00000001ULL);
+
+	// Named events, with later terms overriding theirs
+	attr = fill(pmus, "cpu", "mem-loads");
+	CHECK_EQ(attr.config, 0x1cdULL);
+	CHECK_EQ(attr.config1, 3ULL);
+	attr = fill(pmus, "cpu", "mem-loads,ldlat=30,umask=0x2");
+	CHECK_EQ(attr.config, 0x2cdULL);
+	CHECK_EQ(attr.config1, 30ULL);
+
+	// Raw config fields
+	attr = fill(pmus, "cpu", "config=0x123,config1=5");
+	CHECK_EQ(attr.config, 0x123ULL);
+	CHECK_EQ(attr.config1, 5ULL);
+
+	// Parameters the event needs a value for ("?")
+	CHECK(fillFails(pmus, "uncore_imc", "needs_umask"));
+
+	// Values too wide for their fields
+	CHECK(fillFails(pmus, "cpu", "event=0x100"));
+	CHECK(fillFails(pmus, "cpu", "edge=2"));
+	CHECK(fillFails(pmus, "cpu", "split=0x100"));
+
+	// Unknown PMUs and terms, bad values, and events named inside an event's terms
+	CHECK(fillFails(pmus, "gpu", "event=1"));
+	CHECK(fillFails(pmus, "cpu", "bogus=1"));
+	CHECK(fillFails(pmus, "cpu", "event=x"));
+	CHECK(fillFails(pmus, "cpu", "mem-loads=1"));
+
+	// Commas inside pmu/terms/ separate terms, and outside them events
+	EventSetSpecifier spec = EventSetSpecifier::parse("cpu/event=0x3c,umask=0x1/,uncore_imc/cas_count_read/,{cpu/mem-loads,ldlat=30/,cpu/edge,event=2/}", pmus);
+	CHECK_EQ(spec.size(), (size_t) 4);
+	CHECK_EQ(spec[0].attr().type, 4u);
+	CHECK_EQ(spec[0].attr().config, 0x13cULL);
+	CHECK_EQ(spec[0].group(), -1);
+	CHECK_EQ(spec[1].attr().type, 17u);
+	CHECK_EQ(spec[1].attr().config, 0x304ULL);
+	CHECK_EQ(spec[2].attr().config, 0x1cdULL);
+	CHECK_EQ(spec[2].attr().config1, 30ULL);
+	CHECK_EQ(spec[2].group(), 0);
+	CHECK_EQ(spec[3].attr().config, 0x40002ULL);
+	CHECK_EQ(spec[3].group(), 0);
+
+	// A sysfs event name alone finds its PMU
+	spec = EventSetSpecifier::parse("cas_count_read,mem-loads", pmus);
+	CHECK_EQ(spec.size(), (size_t) 2);
+	CHECK_EQ(spec[0].attr().type, 17u);
+	CHECK_EQ(spec[1].attr().config, 0x1cdULL);
+
+	LOG(INFO) << "PmuRegistry tests passed";
+}
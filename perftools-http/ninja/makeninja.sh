@@ -17,3 +17,5 @@ find src/main/cpp ! -name "TestMain.cpp" -and -name "*.cpp" -or -name "*.c" -or
 
 cat .ninja/src_files | ${HELPER} libfathomdb-perftools-http.a >> build.ninja
 
+echo "src/main/cpp/TestMain.cpp"  | ${HELPER} test-fathomdb-perftools-http "+bin/libfathomdb-perftools-http.a"  "extralibs = -lfathomdb-perftools-http -lfathomdb-http -lfathomdb-perftools-extensions" >> build.ninja
+
@@ -2,18 +2,25 @@
 #include "TestMain.h"
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <memory>
 #include <exception>
+#include <vector>
 
 #include "fathomdb/http/HttpServer.h"
 
 #include "fathomdb/perftools/PerftoolsRequestHandler.h"
+#include "fathomdb/perftools/AddressToLine.h"
 #include "fathomdb/http/HttpRequestHandler.h"
 
 using namespace std;
 
 using fathomdb::perftools::PerftoolsRequestHandler;
+using fathomdb::perftools::AddressToLine;
 using fathomdb::http::HttpServer;
 using fathomdb::http::HttpRequestHandler;
 
@@ -39,10 +46,127 @@ int main_http() {
 	return 0;
 }
 
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+// Addresses spread evenly over the executable mappings of this process, as a profile would have them
+static vector<string> sampleAddresses(size_t count) {
+	vector<pair<uintptr_t, uintptr_t> > ranges;
+	uintptr_t total = 0;
+	{
+		ifstream maps("/proc/self/maps");
+		string line;
+		while (getline(maps, line)) {
+			uintptr_t start, end;
+			char perms[5];
+			if (sscanf(line.c_str(), "%lx-%lx %4s", &start, &end, perms) == 3 && perms[2] == 'x' && line.find('/') != string::npos) {
+				ranges.push_back(make_pair(start, end));
+				total += end - start;
+			}
+		}
+	}
+
+	vector<string> addresses;
+	uintptr_t step = total / count;
+	for (size_t i = 0; i < count; i++) {
+		uintptr_t target = i * step;
+		for (auto it = ranges.begin(); it != ranges.end(); it++) {
+			uintptr_t size = it->second - it->first;
+			if (target < size) {
+				ostringstream s;
+				s << "0x" << hex << (it->first + target);
+				addresses.push_back(s.str());
+				break;
+			}
+			target -= size;
+		}
+	}
+	return addresses;
+}
+
+static void benchmarkSymbolizer(const vector<string>& addresses, bool usePprof, const string& label) {
+	AddressToLine addressToLine;
+
+	double start = now();
+	vector<string> lines;
+	try {
+		if (usePprof) {
+			lines = addressToLine.mapAddressesToLinesWithPprof(addresses);
+		} else {
+			lines = addressToLine.mapAddressesToLines(addresses);
+		}
+	} catch (exception& e) {
+		cout << label << ": failed (" << e.what() << ")" << endl;
+		return;
+	}
+	double elapsed = now() - start;
+
+	size_t resolved = 0;
+	for (size_t i = 0; i < lines.size(); i++) {
+		if (lines[i] != addresses[i]) {
+			resolved++;
+		}
+	}
+
+	cout << label << ": " << addresses.size() << " addresses (" << resolved << " resolved) in "
+			<< elapsed << "s = " << (addresses.size() / elapsed) << " symbols/sec" << endl;
+}
+
+// The in-process symbolizer should name each address as pprof does
+static void compareSymbolizerWithPprof(const vector<string>& addresses) {
+	AddressToLine addressToLine;
+
+	vector<string> expected;
+	try {
+		expected = addressToLine.mapAddressesToLinesWithPprof(addresses);
+	} catch (exception& e) {
+		cout << "compare with pprof: skipped (" << e.what() << ")" << endl;
+		return;
+	}
+	vector<string> actual = addressToLine.mapAddressesToLines(addresses);
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < addresses.size() && i < expected.size(); i++) {
+		if (actual[i] == expected[i])
+			continue;
+
+		if (mismatches < 10) {
+			cout << "  " << addresses[i] << ": pprof " << expected[i] << ", in-process " << actual[i] << endl;
+		}
+		mismatches++;
+	}
+
+	if (expected.size() != addresses.size()) {
+		cout << "compare with pprof: pprof returned " << expected.size() << " names for " << addresses.size() << " addresses" << endl;
+	}
+	cout << "compare with pprof: " << mismatches << " of " << addresses.size() << " names differ" << endl;
+}
+
+void BenchmarkSymbolizer() {
+	compareSymbolizerWithPprof(sampleAddresses(1000));
+
+	size_t counts[] = { 100, 1000, 10000, 100000 };
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		vector<string> addresses = sampleAddresses(counts[i]);
+		benchmarkSymbolizer(addresses, false, "in-process");
+		// A second pprof session asking for the same addresses is answered by the SymbolCache
+		benchmarkSymbolizer(addresses, false, "in-process (repeat)");
+		benchmarkSymbolizer(addresses, true, "pprof");
+	}
+}
+
 extern void TestHardwarePerformanceEvents();
 extern void TestGoogleProfiler();
 
-int main() {
+int main(int argc, char ** argv) {
+	if (argc > 1 && string(argv[1]) == "benchmark-symbolize") {
+		BenchmarkSymbolizer();
+		return 0;
+	}
+
 //	TestHardwarePerformanceEvents();
 	TestGoogleProfiler();
 
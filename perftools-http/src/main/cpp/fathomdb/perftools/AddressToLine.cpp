@@ -1,5 +1,7 @@
 // See COPYRIGHT for copyright
 #include "AddressToLine.h"
+#include "SymbolCache.h"
+#include <stdlib.h>
 #include <iostream>
 #include <sstream>
 #include <glog/logging.h>
@@ -145,6 +147,36 @@ return stdout;
 }
 
 vector<string> AddressToLine::mapAddressesToLines(const vector<string>& addresses) {
+	if (addresses.empty()) {
+		return vector<string>();
+	}
+
+	vector<uintptr_t> values;
+	values.reserve(addresses.size());
+	for (auto it = addresses.begin(); it != addresses.end(); it++) {
+		const char * start = it->c_str();
+		if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+			start += 2;
+		}
+		char * firstBad = NULL;
+		uintptr_t address = strtoull(start, &firstBad, 16);
+		if (*start == 0 || *firstBad != 0) {
+			address = 0;
+		}
+		values.push_back(address);
+	}
+
+	vector<string> lines = SymbolCache::instance().symbolize(values);
+	for (size_t i = 0; i < lines.size(); i++) {
+		if (lines[i].empty()) {
+			lines[i] = addresses[i];
+		}
+	}
+
+	return lines;
+}
+
+vector<string> AddressToLine::mapAddressesToLinesWithPprof(const vector<string>& addresses) {
 if (addresses.empty()) {
 	return vector<string>();
 }
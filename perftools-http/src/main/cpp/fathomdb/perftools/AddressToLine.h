@@ -20,8 +20,13 @@ public:
 	AddressToLine();
 	~AddressToLine();
 
+	/// Maps each hex address to the name of the function containing it, in-process (see SymbolCache).
+	/// Addresses that can't be resolved map to themselves, as they do with pprof.
 	vector<string> mapAddressesToLines(const vector<string>& addresses);
 
+	/// The original implementation: forks /usr/local/bin/pprof --symbols. Much slower on large binaries.
+	vector<string> mapAddressesToLinesWithPprof(const vector<string>& addresses);
+
 private:
 	string executePprof( const vector<string>& argv, const string& stdin);
 };
@@ -0,0 +1,430 @@
+// See COPYRIGHT for copyright
+#include "ElfSymbolizer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cxxabi.h>
+#include <glog/logging.h>
+#include <boost/filesystem/path.hpp>
+
+using namespace std;
+using boost::filesystem::path;
+
+namespace fathomdb {
+namespace perftools {
+
+extern string readWholeFile(const path& filePath, int reserve);
+
+namespace {
+
+// A read-only mapping of a whole file, for the lifetime of the object
+class MappedFile {
+public:
+	MappedFile(const string& path) {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			throw invalid_argument("Unable to open ELF file");
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			throw invalid_argument("Unable to stat ELF file");
+		}
+
+		size_ = st.st_size;
+		void * data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			throw invalid_argument("Unable to map ELF file");
+		}
+		data_ = (const char *) data;
+	}
+
+	~MappedFile() {
+		munmap((void *) data_, size_);
+	}
+
+	const char * data() const {
+		return data_;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+private:
+	const char * data_;
+	size_t size_;
+};
+
+} // namespace
+
+static const ElfW(Ehdr) * checkElfHeader(const char * data, size_t size) {
+	if (size < sizeof(ElfW(Ehdr))) {
+		throw invalid_argument("File too short to be ELF");
+	}
+
+	const ElfW(Ehdr) * ehdr = (const ElfW(Ehdr) *) data;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) {
+		throw invalid_argument("Not an ELF file");
+	}
+	if (ehdr->e_ident[EI_CLASS] != (__ELF_NATIVE_CLASS == 64 ? ELFCLASS64 : ELFCLASS32)) {
+		throw invalid_argument("ELF file is not of the native class");
+	}
+
+	if (ehdr->e_phoff + (uint64_t) ehdr->e_phnum * sizeof(ElfW(Phdr)) > size) {
+		throw invalid_argument("ELF program headers are truncated");
+	}
+	return ehdr;
+}
+
+ElfSymbolTable::ElfSymbolTable(const string& path) {
+	MappedFile file(path);
+	load(file.data(), file.size());
+}
+
+string ElfSymbolTable::readBuildId(const string& path) {
+	MappedFile file(path);
+	checkElfHeader(file.data(), file.size());
+	return findBuildId(file.data(), file.size());
+}
+
+// The GNU build-id (hex) in a PT_NOTE segment's notes, or an empty string
+static string findBuildIdNote(const char * p, const char * end) {
+	// Notes are a header, then the name and the descriptor, each padded to 4 bytes
+	while (p + sizeof(ElfW(Nhdr)) <= end) {
+		const ElfW(Nhdr) * note = (const ElfW(Nhdr) *) p;
+		const char * name = p + sizeof(ElfW(Nhdr));
+		const char * desc = name + ((note->n_namesz + 3) & ~3);
+		const char * next = desc + ((note->n_descsz + 3) & ~3);
+		if (next > end) {
+			break;
+		}
+
+		if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+			static const char hex[] = "0123456789abcdef";
+			string id;
+			for (size_t j = 0; j < note->n_descsz; j++) {
+				unsigned char c = desc[j];
+				id.push_back(hex[c >> 4]);
+				id.push_back(hex[c & 0xf]);
+			}
+			return id;
+		}
+		p = next;
+	}
+	return string();
+}
+
+string ElfSymbolTable::findBuildId(const char * data, size_t size) {
+	const ElfW(Ehdr) * ehdr = (const ElfW(Ehdr) *) data;
+	const ElfW(Phdr) * phdrs = (const ElfW(Phdr) *) (data + ehdr->e_phoff);
+
+	for (size_t i = 0; i < ehdr->e_phnum; i++) {
+		if (phdrs[i].p_type != PT_NOTE || phdrs[i].p_offset + phdrs[i].p_filesz > size) {
+			continue;
+		}
+
+		const char * notes = data + phdrs[i].p_offset;
+		string id = findBuildIdNote(notes, notes + phdrs[i].p_filesz);
+		if (!id.empty()) {
+			return id;
+		}
+	}
+	return string();
+}
+
+void ElfSymbolTable::load(const char * data, size_t size) {
+	const ElfW(Ehdr) * ehdr = checkElfHeader(data, size);
+
+	buildId_ = findBuildId(data, size);
+
+	const ElfW(Phdr) * phdrs = (const ElfW(Phdr) *) (data + ehdr->e_phoff);
+	for (size_t i = 0; i < ehdr->e_phnum; i++) {
+		if (phdrs[i].p_type != PT_LOAD) {
+			continue;
+		}
+		Segment segment;
+		segment.offset = phdrs[i].p_offset;
+		segment.filesz = phdrs[i].p_filesz;
+		segment.vaddr = phdrs[i].p_vaddr;
+		segments_.push_back(segment);
+	}
+
+	if (ehdr->e_shoff + (uint64_t) ehdr->e_shnum * sizeof(ElfW(Shdr)) > size) {
+		throw invalid_argument("ELF section headers are truncated");
+	}
+	const ElfW(Shdr) * shdrs = (const ElfW(Shdr) *) (data + ehdr->e_shoff);
+
+	// .dynsym is a subset of .symtab; we only need it when the object is stripped
+	uint32_t wanted = SHT_DYNSYM;
+	for (size_t i = 0; i < ehdr->e_shnum; i++) {
+		if (shdrs[i].sh_type == SHT_SYMTAB) {
+			wanted = SHT_SYMTAB;
+		}
+	}
+
+	for (size_t i = 0; i < ehdr->e_shnum; i++) {
+		const ElfW(Shdr)& section = shdrs[i];
+		if (section.sh_type != wanted || section.sh_link >= ehdr->e_shnum) {
+			continue;
+		}
+
+		const ElfW(Shdr)& strtab = shdrs[section.sh_link];
+		if (section.sh_offset + section.sh_size > size || strtab.sh_offset + strtab.sh_size > size) {
+			LOG(WARNING) << "Skipping truncated ELF symbol table";
+			continue;
+		}
+
+		const ElfW(Sym) * syms = (const ElfW(Sym) *) (data + section.sh_offset);
+		size_t count = section.sh_size / sizeof(ElfW(Sym));
+		const char * strings = data + strtab.sh_offset;
+
+		for (size_t j = 0; j < count; j++) {
+			const ElfW(Sym)& sym = syms[j];
+			int type = ELF64_ST_TYPE(sym.st_info);
+			if (type != STT_FUNC
+#ifdef STT_GNU_IFUNC
+					&& type != STT_GNU_IFUNC
+#endif
+					) {
+				continue;
+			}
+			if (sym.st_shndx == SHN_UNDEF || sym.st_value == 0 || sym.st_name == 0 || sym.st_name >= strtab.sh_size) {
+				continue;
+			}
+
+			const char * name = strings + sym.st_name;
+			size_t length = strnlen(name, strtab.sh_size - sym.st_name);
+
+			Symbol symbol;
+			symbol.start = sym.st_value;
+			symbol.end = sym.st_value + sym.st_size;
+			symbol.name = names_.size();
+			names_.append(name, length);
+			names_.push_back('\0');
+			symbols_.push_back(symbol);
+		}
+	}
+
+	stable_sort(symbols_.begin(), symbols_.end());
+
+	// Aliases share an address; keep the first. Zero-sized symbols (hand-written assembly) extend
+	// to the next symbol.
+	size_t out = 0;
+	for (size_t i = 0; i < symbols_.size(); i++) {
+		if (out != 0 && symbols_[out - 1].start == symbols_[i].start) {
+			continue;
+		}
+		symbols_[out++] = symbols_[i];
+	}
+	symbols_.resize(out);
+
+	for (size_t i = 0; i < symbols_.size(); i++) {
+		if (symbols_[i].end == symbols_[i].start) {
+			symbols_[i].end = (i + 1 < symbols_.size()) ? symbols_[i + 1].start : symbols_[i].start + 1;
+		}
+	}
+}
+
+const char * ElfSymbolTable::lookup(uintptr_t vaddr) const {
+	Symbol key;
+	key.start = vaddr;
+	auto it = upper_bound(symbols_.begin(), symbols_.end(), key);
+	if (it == symbols_.begin()) {
+		return NULL;
+	}
+	--it;
+	if (vaddr >= it->end) {
+		return NULL;
+	}
+	return names_.c_str() + it->name;
+}
+
+bool ElfSymbolTable::fileOffsetToVaddr(uint64_t offset, uintptr_t * vaddr) const {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	for (auto it = segments_.begin(); it != segments_.end(); it++) {
+		// The kernel maps from the page containing p_offset
+		uint64_t first = it->offset & ~(uint64_t) (pageSize - 1);
+		if (offset >= first && offset < it->offset + it->filesz) {
+			*vaddr = it->vaddr + (offset - it->offset);
+			return true;
+		}
+	}
+	return false;
+}
+
+string demangle(const char * name) {
+	int status = 0;
+	char * demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+	if (status != 0 || demangled == NULL) {
+		return name;
+	}
+	string s(demangled);
+	free(demangled);
+	return s;
+}
+
+ElfSymbolizer::ElfSymbolizer() {
+	parseMaps(readWholeFile("/proc/self/maps", 128 * 1024));
+}
+
+ElfSymbolizer::ElfSymbolizer(const string& maps, const TableLoader& loader) :
+		loader_(loader) {
+	parseMaps(maps);
+}
+
+void ElfSymbolizer::parseMaps(const string& maps) {
+	forEachExecutableMapping(maps, [this](const string& line, const Mapping& mapping) {
+		mappings_.push_back(mapping);
+	});
+
+	sort(mappings_.begin(), mappings_.end(), [](const Mapping& a, const Mapping& b) {
+		return a.start < b.start;
+	});
+}
+
+/*static*/string ElfSymbolizer::executableMaps(const string& maps) {
+	string executable;
+	forEachExecutableMapping(maps, [&executable](const string& line, const Mapping& mapping) {
+		executable += line;
+		executable += '\n';
+	});
+	return executable;
+}
+
+/*static*/void ElfSymbolizer::forEachExecutableFile(const string& maps,
+		const function<void(const string&, uintptr_t, uintptr_t)>& visit) {
+	forEachExecutableMapping(maps, [&visit](const string& line, const Mapping& mapping) {
+		visit(mapping.path, mapping.start, mapping.end);
+	});
+}
+
+static int addLoadedObject(dl_phdr_info * info, size_t size, void * data) {
+	vector<ElfSymbolizer::LoadedObject> * objects = (vector<ElfSymbolizer::LoadedObject> *) data;
+
+	ElfSymbolizer::LoadedObject object;
+	object.start = ~((uintptr_t) 0);
+	object.end = 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+		if (phdr.p_type == PT_LOAD) {
+			object.start = min(object.start, start);
+			object.end = max(object.end, (uintptr_t) (start + phdr.p_memsz));
+		} else if (phdr.p_type == PT_NOTE && object.build_id.empty()) {
+			// The notes are loaded, and the loader's lock keeps them there while we look
+			object.build_id = findBuildIdNote((const char *) start, (const char *) start + phdr.p_memsz);
+		}
+	}
+
+	if (object.end != 0) {
+		objects->push_back(object);
+	}
+	return 0;
+}
+
+/*static*/vector<ElfSymbolizer::LoadedObject> ElfSymbolizer::loadedObjects() {
+	vector<LoadedObject> objects;
+	dl_iterate_phdr(addLoadedObject, &objects);
+	sort(objects.begin(), objects.end(), [](const LoadedObject& a, const LoadedObject& b) {
+		return a.start < b.start;
+	});
+	return objects;
+}
+
+/*static*/void ElfSymbolizer::forEachExecutableMapping(const string& maps, const function<void(const string&, const Mapping&)>& visit) {
+	size_t pos = 0;
+	while (pos < maps.size()) {
+		size_t eol = maps.find('\n', pos);
+		if (eol == string::npos) {
+			eol = maps.size();
+		}
+		string line = maps.substr(pos, eol - pos);
+		pos = eol + 1;
+
+		// 00400000-0040b000 r-xp 00000000 08:01 1234    /usr/bin/foo
+		uintptr_t start, end;
+		uint64_t offset;
+		char perms[5];
+		int pathStart = 0;
+		if (sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR " %4s %" SCNx64 " %*s %*s %n", &start, &end, perms, &offset, &pathStart) < 4) {
+			continue;
+		}
+		if (perms[2] != 'x' || pathStart == 0 || line[pathStart] != '/') {
+			continue;
+		}
+
+		Mapping mapping;
+		mapping.start = start;
+		mapping.end = end;
+		mapping.offset = offset;
+		mapping.path = line.substr(pathStart);
+		mapping.resolved = false;
+		mapping.bias = 0;
+		visit(line, mapping);
+	}
+}
+
+void ElfSymbolizer::resolve(Mapping& mapping) {
+	mapping.resolved = true;
+
+	auto it = tables_.find(mapping.path);
+	if (it == tables_.end()) {
+		shared_ptr<ElfSymbolTable> table;
+		if (loader_) {
+			table = loader_(mapping.path, mapping.start, mapping.end);
+		} else {
+			try {
+				table.reset(new ElfSymbolTable(mapping.path));
+			} catch (exception& e) {
+				LOG(WARNING) << "Unable to load symbols from " << mapping.path << ": " << e.what();
+			}
+		}
+		it = tables_.insert(make_pair(mapping.path, table)).first;
+	}
+
+	uintptr_t vaddr;
+	if (it->second && it->second->fileOffsetToVaddr(mapping.offset, &vaddr)) {
+		mapping.table = it->second;
+		mapping.bias = mapping.start - vaddr;
+	}
+}
+
+string ElfSymbolizer::symbolize(uintptr_t address) {
+	auto it = upper_bound(mappings_.begin(), mappings_.end(), address, [](uintptr_t a, const Mapping& m) {
+		return a < m.start;
+	});
+	if (it == mappings_.begin()) {
+		return string();
+	}
+	--it;
+	if (address >= it->end) {
+		return string();
+	}
+
+	if (!it->resolved) {
+		resolve(*it);
+	}
+	if (!it->table) {
+		return string();
+	}
+
+	const char * name = it->table->lookup(address - it->bias);
+	if (name == NULL) {
+		return string();
+	}
+	return demangle(name);
+}
+
+}
+}
@@ -0,0 +1,130 @@
+// See COPYRIGHT for copyright
+#ifndef ELFSYMBOLIZER_H_
+#define ELFSYMBOLIZER_H_
+
+#include <string>
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+
+namespace fathomdb {
+namespace perftools {
+using namespace std;
+
+/// The function symbols (.symtab, or .dynsym if stripped) of one ELF object, sorted by address.
+/// The file is mapped only while the tables are built; names are copied into a single pool.
+class ElfSymbolTable {
+public:
+	/// Throws invalid_argument if the file can't be read or isn't a native ELF object.
+	ElfSymbolTable(const string& path);
+
+	/// Returns the (mangled) name of the function containing vaddr, or NULL.
+	const char * lookup(uintptr_t vaddr) const;
+
+	/// Maps a file offset to the link-time virtual address it is loaded at, using the PT_LOAD headers.
+	bool fileOffsetToVaddr(uint64_t offset, uintptr_t * vaddr) const;
+
+	size_t size() const {
+		return symbols_.size();
+	}
+
+	/// The GNU build-id (hex), or an empty string if the object doesn't have one.
+	const string& buildId() const {
+		return buildId_;
+	}
+
+	/// Reads just the GNU build-id of an ELF file, without loading its symbols.
+	static string readBuildId(const string& path);
+
+private:
+	struct Symbol {
+		uintptr_t start;
+		uintptr_t end;
+		uint32_t name;
+
+		bool operator<(const Symbol& other) const {
+			return start < other.start;
+		}
+	};
+
+	struct Segment {
+		uint64_t offset;
+		uint64_t filesz;
+		uintptr_t vaddr;
+	};
+
+	void load(const char * data, size_t size);
+
+	static string findBuildId(const char * data, size_t size);
+
+	vector<Symbol> symbols_;
+	vector<Segment> segments_;
+	string names_;
+	string buildId_;
+};
+
+/// Maps addresses in this process to function names, without leaving the process: the executable
+/// mappings come from /proc/self/maps, and each mapped object's symbol table is loaded on first use.
+class ElfSymbolizer {
+public:
+	/// Gets the symbol table of the object at path, mapped (executable) at [start, end)
+	typedef function<shared_ptr<ElfSymbolTable>(const string& path, uintptr_t start, uintptr_t end)> TableLoader;
+
+	/// An object the dynamic loader has loaded, and the build-id in its loaded image (empty if it has none)
+	struct LoadedObject {
+		uintptr_t start;
+		uintptr_t end;
+		string build_id;
+	};
+
+	/// Snapshots /proc/self/maps; symbol tables are loaded as needed and owned by this symbolizer.
+	ElfSymbolizer();
+
+	/// Uses the given maps text, and gets symbol tables from loader (which may return NULL).
+	ElfSymbolizer(const string& maps, const TableLoader& loader);
+
+	/// Returns the demangled name of the function containing address, or an empty string if unknown.
+	string symbolize(uintptr_t address);
+
+	/// Just the lines of maps for the file-backed executable mappings, the only ones we symbolize. Unlike
+	/// the whole text, this doesn't change as the heap grows or threads come and go.
+	static string executableMaps(const string& maps);
+
+	/// Calls visit(path, start, end) for each file-backed executable mapping in maps
+	static void forEachExecutableFile(const string& maps, const function<void(const string&, uintptr_t, uintptr_t)>& visit);
+
+	/// The objects the dynamic loader has loaded (as dl_iterate_phdr lists them), sorted by start
+	static vector<LoadedObject> loadedObjects();
+
+private:
+	struct Mapping {
+		uintptr_t start;
+		uintptr_t end;
+		uint64_t offset;
+		string path;
+
+		bool resolved;
+		shared_ptr<ElfSymbolTable> table;
+		uintptr_t bias;
+	};
+
+	void parseMaps(const string& maps);
+	void resolve(Mapping& mapping);
+
+	/// Calls visit(line, mapping) for each file-backed executable mapping in maps
+	static void forEachExecutableMapping(const string& maps, const function<void(const string&, const Mapping&)>& visit);
+
+	vector<Mapping> mappings_;
+	map<string, shared_ptr<ElfSymbolTable> > tables_;
+	TableLoader loader_;
+};
+
+/// Demangles a C++ symbol name, returning it unchanged if it isn't mangled.
+string demangle(const char * name);
+
+}
+}
+
+#endif /* ELFSYMBOLIZER_H_ */
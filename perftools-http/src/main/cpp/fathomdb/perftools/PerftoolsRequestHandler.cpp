@@ -12,19 +12,68 @@
 #include "google/profiler.h"
 
 #include "fathomdb/http/HttpResponse.h"
+#include "fathomdb/http/HttpResponseBody.h"
 #include "fathomdb/http/HttpRequest.h"
 #include "fathomdb/http/HttpException.h"
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include "AddressToLine.h"
+#include "fathomdb/perftools/hardware/HardwareEventManager.h"
+#include "fathomdb/perftools/hardware/HardwarePerftoolsEventSource.h"
+#include "fathomdb/perftools/hardware/BranchProfile.h"
+#include "fathomdb/perftools/hardware/DataAccessProfile.h"
+#include "fathomdb/perftools/hardware/OverheadController.h"
 
 using namespace std;
 using boost::filesystem::path;
 using fathomdb::perftools::AddressToLine;
+using fathomdb::perftools::hardware::CounterSet;
+using fathomdb::perftools::hardware::HardwareEventManager;
+using fathomdb::perftools::hardware::HardwarePerftoolsEventSource;
+using fathomdb::perftools::hardware::AddressSpace;
+using fathomdb::perftools::hardware::BranchProfile;
+using fathomdb::perftools::hardware::DataAccessProfile;
+using fathomdb::perftools::hardware::OverheadController;
+using fathomdb::perftools::hardware::SampleRate;
 
 namespace fathomdb {
 namespace perftools {
 
+static const char * DEFAULT_COUNTER_EVENTS =
+		"{cycles,instructions},{cache-references,cache-misses},{branch-instructions,branch-misses},"
+		"task-clock,context-switches,cpu-migrations,page-faults";
+
+// Counters hold cpus * threads * events descriptors for this long, at most
+static const int MAX_COUNTING_SECONDS = 3600;
+
+// Suspends a /pprof/counters request while the counters run, and holds them until we resume
+class CountingResponse: public SuspendProcessing {
+public:
+	CountingResponse(int sleepMilliseconds, unique_ptr<CounterSet> counters, CounterSet::Breakdown breakdown) :
+		SuspendProcessing(sleepMilliseconds), counters(move(counters)), breakdown(breakdown) {
+	}
+
+	unique_ptr<CounterSet> counters;
+	CounterSet::Breakdown breakdown;
+};
+
+static void appendReading(ostringstream& out, const CounterSet::Reading& reading) {
+	for (auto it = reading.counters.begin(); it != reading.counters.end(); it++) {
+		out << "\t" << (uint64_t) (it->scaled + 0.5) << "\t" << it->name;
+		if (it->time_running == 0) {
+			out << "\t(not counted)";
+		} else if (it->time_running != it->time_enabled) {
+			out << "\t(" << (it->running() * 100) << "% counted)";
+		}
+		out << "\n";
+	}
+
+	vector<pair<string, double> > ratios = CounterSet::ratios(reading.counters);
+	for (auto it = ratios.begin(); it != ratios.end(); it++) {
+		out << "\t" << it->second << "\t" << it->first << "\n";
+	}
+}
+
 PerftoolsRequestHandler::PerftoolsRequestHandler() {
 
 }
@@ -70,6 +119,19 @@ static void appendMaps(string& content) {
 	content.append(maps);
 }
 
+// A hardware profile tracks the code mapped while it ran, so it can include libraries that have
+// since been unloaded; other profiles get the current /proc/self/maps
+static void appendProfiledMaps(string& content) {
+	shared_ptr<AddressSpace> addressSpace = HardwarePerftoolsEventSource::profiledAddressSpace();
+	if (!addressSpace) {
+		appendMaps(content);
+		return;
+	}
+
+	content.append("\nMAPPED_LIBRARIES:\n");
+	content.append(addressSpace->formatMaps());
+}
+
 void PerftoolsRequestHandler::handleSymbolRequest(const HttpRequest& request, HttpResponse& response) {
 	//			This means that after the HTTP headers, pprof will pass in a list of hex addresses connected by +, like so:
 	//
@@ -149,8 +211,13 @@ unique_ptr<HttpResponse> PerftoolsRequestHandler::handleRequest(const HttpReques
 		}
 
 		if (request.method == "POST") {
-			handleSymbolRequest(request, *response);
-			return response;
+			// Symbolizing can take a while; keep it off the io threads
+			return unique_ptr<HttpResponse>(new DeferredResponse([this, &request]() {
+				unique_ptr<HttpResponse> response(new HttpResponse());
+				response->setContentType(HttpResponse::CONTENT_TYPE_TEXT);
+				handleSymbolRequest(request, *response);
+				return response;
+			}));
 		}
 
 		throw HttpException(HttpResponse::method_not_supported);
@@ -167,28 +234,37 @@ unique_ptr<HttpResponse> PerftoolsRequestHandler::handleRequest(const HttpReques
 	}
 
 	if (requestPath == "/pprof/heap") {
-		response->content.reserve(1 << 20);
+		// Walking the heap sample takes the allocator's locks; do it on a worker thread
+		return unique_ptr<HttpResponse>(new DeferredResponse([]() {
+			unique_ptr<HttpResponse> response(new HttpResponse());
+			response->setContentType(HttpResponse::CONTENT_TYPE_TEXT);
+			response->content.reserve(1 << 20);
 
-		// TODO: Could call GetHeapProfile first,
-		// and only fall back to GetHeapSample if
-		// the former returns an empty string?
-		MallocExtension::instance()->GetHeapSample(&response->content);
+			// TODO: Could call GetHeapProfile first,
+			// and only fall back to GetHeapSample if
+			// the former returns an empty string?
+			MallocExtension::instance()->GetHeapSample(&response->content);
 
-		// It looks like this is already in the heap sample now??
-		//		appendMaps(response->content);
+			// It looks like this is already in the heap sample now??
+			//		appendMaps(response->content);
 
-		return response;
+			return response;
+		}));
 	}
 
 	if (requestPath == "/pprof/growth") {
-		response->content.reserve(1 << 20);
+		return unique_ptr<HttpResponse>(new DeferredResponse([]() {
+			unique_ptr<HttpResponse> response(new HttpResponse());
+			response->setContentType(HttpResponse::CONTENT_TYPE_TEXT);
+			response->content.reserve(1 << 20);
 
-		MallocExtension::instance()->GetHeapGrowthStacks(&response->content);
+			MallocExtension::instance()->GetHeapGrowthStacks(&response->content);
 
-		// It looks like this is already in the output now??
-		//appendMaps(response->content);
+			// It looks like this is already in the output now??
+			//appendMaps(response->content);
 
-		return response;
+			return response;
+		}));
 	}
 
 	if (requestPath == "/pprof/heapstats") {
@@ -203,6 +279,106 @@ unique_ptr<HttpResponse> PerftoolsRequestHandler::handleRequest(const HttpReques
 		return response;
 	}
 
+	if (requestPath == "/pprof/branches") {
+		shared_ptr<BranchProfile> branches = HardwarePerftoolsEventSource::profiledBranches();
+		if (!branches) {
+			throw invalid_argument("No branch profile (profile with the branches: hardware option first)");
+		}
+
+		string format = request.getQueryParameter("format", "autofdo");
+		if (format == "autofdo") {
+			// For AutoFDO's --profile (text format); the main executable unless object= names a library
+			response->content = branches->formatAutoFdo(request.getQueryParameter("object", ""));
+		} else if (format == "edges") {
+			int n = boost::lexical_cast<int>(request.getQueryParameter("n", "100"));
+
+			ostringstream out;
+			out << "# " << branches->sampleCount() << " samples; count, mispredicted, from -> to\n";
+			vector<BranchProfile::Edge> edges = branches->hottestEdges(n);
+			for (auto it = edges.begin(); it != edges.end(); it++) {
+				out << it->count << "\t" << it->mispredicted << "\t0x" << hex << it->from << " -> 0x" << it->to << dec << "\n";
+			}
+			response->content = out.str();
+		} else {
+			throw invalid_argument("Unknown format (expected autofdo or edges)");
+		}
+		return response;
+	}
+
+	if (requestPath == "/pprof/heatmap") {
+		shared_ptr<DataAccessProfile> dataAccesses = HardwarePerftoolsEventSource::profiledDataAccesses();
+		if (!dataAccesses) {
+			throw invalid_argument("No data addresses (profile with a 'd' event modifier first, e.g. l1d-read-miss:ppd)");
+		}
+
+		// The hottest n cache lines of each mapping
+		int n = boost::lexical_cast<int>(request.getQueryParameter("n", "20"));
+		response->content = dataAccesses->formatHeatmap(n);
+		return response;
+	}
+
+	if (requestPath == "/pprof/overhead") {
+		shared_ptr<OverheadController> overhead = HardwarePerftoolsEventSource::profiledOverhead();
+		if (!overhead) {
+			throw invalid_argument("No overhead budget (profile with budget=PERCENT% first, e.g. perthread:budget=1%:cycles)");
+		}
+
+		OverheadController::Stats stats = overhead->stats();
+		ostringstream out;
+		out << "budget: " << (stats.budget * 100) << "%\n";
+		out << "overhead: " << (stats.overhead * 100) << "%\n";
+		out << "rate_scale: " << stats.rate_scale << "\n";
+		out << "poll_cpu_ms: " << (stats.poll_cpu_ns / 1000000) << "\n";
+		out << "consumer_cpu_ms: " << (stats.consumer_cpu_ns / 1000000) << "\n";
+		out << "throttled: " << stats.throttled << "\n";
+		out << "adjustments: " << stats.adjustments << "\n";
+		for (auto it = stats.rates.begin(); it != stats.rates.end(); it++) {
+			const SampleRate& rate = *it;
+			out << "rate: " << rate.event << " " << (rate.freq ? "freq=" : "period=") << rate.value << "\n";
+		}
+		response->content = out.str();
+		return response;
+	}
+
+	if (requestPath == "/pprof/counters") {
+		string events = request.getQueryParameter("events", DEFAULT_COUNTER_EVENTS);
+
+		int n = 10;
+		{
+			string value = request.getQueryParameter("seconds", "");
+			if (!value.empty()) {
+				n = boost::lexical_cast<int>(value);
+			}
+		}
+		if (n <= 0 || n > MAX_COUNTING_SECONDS) {
+			ostringstream message;
+			message << "seconds must be between 1 and " << MAX_COUNTING_SECONDS;
+			throw invalid_argument(message.str());
+		}
+
+		CounterSet::Breakdown breakdown;
+		string by = request.getQueryParameter("by", "cpu");
+		if (by == "cpu") {
+			breakdown = CounterSet::BY_CPU;
+		} else if (by == "thread") {
+			breakdown = CounterSet::BY_THREAD;
+		} else {
+			throw invalid_argument("Unknown breakdown (expected cpu or thread)");
+		}
+
+		bool excludeKernel = request.getQueryParameter("kernel", "0") != "1";
+
+		LOG(WARNING) << "HTTP request to count " << events << " for " << n << " seconds";
+
+		// Opening cpus * threads * events counters takes a while; do it on a worker thread
+		return unique_ptr<HttpResponse>(new DeferredResponse([events, breakdown, excludeKernel, n]() {
+			unique_ptr<CounterSet> counters = HardwareEventManager::openCounters(events, breakdown, excludeKernel);
+			counters->start();
+
+			return unique_ptr<HttpResponse>(new CountingResponse(n * 1000, move(counters), breakdown));
+		}));
+	}
+
 	if (requestPath == "/pprof/profile") {
 		{
 			ostringstream s;
@@ -240,7 +416,37 @@ unique_ptr<HttpResponse> PerftoolsRequestHandler::handleRequest(const HttpReques
 	throw HttpException(HttpResponse::not_found);
 }
 
+unique_ptr<HttpResponse> PerftoolsRequestHandler::finishCounting(CountingResponse& counting) {
+	counting.counters->stop();
+	vector<CounterSet::Reading> readings = counting.counters->read();
+
+	ostringstream out;
+	out << "# Counts for " << (counting.sleepMilliseconds() / 1000) << " seconds, scaled for multiplexing\n";
+
+	out << "total:\n";
+	appendReading(out, CounterSet::total(readings));
+
+	for (auto it = readings.begin(); it != readings.end(); it++) {
+		if (counting.breakdown == CounterSet::BY_CPU) {
+			out << "cpu " << it->cpu << ":\n";
+		} else {
+			out << "thread " << it->tid << ":\n";
+		}
+		appendReading(out, *it);
+	}
+
+	unique_ptr<HttpResponse> response(new HttpResponse());
+	response->setContentType(HttpResponse::CONTENT_TYPE_TEXT);
+	response->content = out.str();
+	return response;
+}
+
 unique_ptr<HttpResponse> PerftoolsRequestHandler::resumeRequest(const HttpRequest& request, HttpResponse& previousResponse) {
+	CountingResponse * counting = dynamic_cast<CountingResponse*>(&previousResponse);
+	if (counting) {
+		return finishCounting(*counting);
+	}
+
 	LOG(WARNING) << "Finishing profiling";
 
 	ProfilerStop();
@@ -249,10 +455,18 @@ unique_ptr<HttpResponse> PerftoolsRequestHandler::resumeRequest(const HttpReques
 	unique_ptr<HttpResponse> response(new HttpResponse());
 	response->setContentType(HttpResponse::CONTENT_TYPE_TEXT);
 
-	response->content = readWholeFile(profilepath_, 0);
-	boost::filesystem::remove(profilepath_);
+	// Send the profile file straight from disk (sendfile), then the maps as a second buffer;
+	// profiles can be tens of MB. Reading the maps up front gives us a Content-Length.
+	string trailer;
+	appendProfiledMaps(trailer);
 
-	appendMaps(response->content);
+	unique_ptr<CompositeResponseBody> body(new CompositeResponseBody());
+	body->add(unique_ptr<HttpResponseBody>(new FileResponseBody(profilepath_)));
+	body->add(unique_ptr<HttpResponseBody>(new StringResponseBody(trailer)));
+	response->body = move(body);
+
+	// We hold the file open, so it can go now
+	boost::filesystem::remove(profilepath_);
 
 	return response;
 }
@@ -10,6 +10,8 @@ namespace perftools {
 using namespace std;
 using namespace fathomdb::http;
 
+class CountingResponse;
+
 class PerftoolsRequestHandler : public HttpRequestHandler {
 	string profilepath_;
 
@@ -22,6 +24,7 @@ public:
 
 private:
 	void handleSymbolRequest(const HttpRequest& request, HttpResponse& response);
+	unique_ptr<HttpResponse> finishCounting(CountingResponse& counting);
 };
 
 }
@@ -0,0 +1,173 @@
+// See COPYRIGHT for copyright
+#include "SymbolCache.h"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <glog/logging.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem/path.hpp>
+
+using namespace std;
+using boost::filesystem::path;
+
+namespace fathomdb {
+namespace perftools {
+
+extern string readWholeFile(const path& filePath, int reserve);
+
+SymbolCache& SymbolCache::instance() {
+	static SymbolCache instance;
+	return instance;
+}
+
+SymbolCache::SymbolCache() {
+}
+
+void SymbolCache::refresh() {
+	// Only the code mappings matter; the heap, thread stacks etc. change all the time
+	string maps = ElfSymbolizer::executableMaps(readWholeFile("/proc/self/maps", 128 * 1024));
+	if (symbolizer_ && maps == maps_) {
+		return;
+	}
+
+	if (symbolizer_) {
+		LOG(INFO) << "Code mappings changed; refreshing symbol cache";
+	}
+
+	bool changed = (symbolizer_ != NULL);
+	maps_ = maps;
+	loaded_ = ElfSymbolizer::loadedObjects();
+	symbolizer_.reset(new ElfSymbolizer(maps_, boost::bind(&SymbolCache::loadTable, this, _1, _2, _3)));
+	names_.clear();
+
+	if (changed) {
+		// Drop the tables of objects that are no longer mapped (e.g. after dlclose)
+		set<pair<string, string> > mapped;
+		ElfSymbolizer::forEachExecutableFile(maps_, [this, &mapped](const string& path, uintptr_t start, uintptr_t end) {
+			pair<string, string> key;
+			string file;
+			if (identify(path, start, end, key, file)) {
+				mapped.insert(key);
+			}
+		});
+		for (auto it = tables_.begin(); it != tables_.end();) {
+			if (mapped.count(it->first)) {
+				++it;
+			} else {
+				tables_.erase(it++);
+			}
+		}
+	}
+}
+
+// The build-id of the loaded image containing address, or an empty string if the loader doesn't know it
+static string loadedBuildId(const vector<ElfSymbolizer::LoadedObject>& loaded, uintptr_t address) {
+	auto it = upper_bound(loaded.begin(), loaded.end(), address, [](uintptr_t a, const ElfSymbolizer::LoadedObject& object) {
+		return a < object.start;
+	});
+	if (it == loaded.begin()) {
+		return string();
+	}
+	--it;
+	return (address < it->end) ? it->build_id : string();
+}
+
+// The mapped file itself, even if its path has since been replaced or deleted
+static string mapFilesPath(uintptr_t start, uintptr_t end) {
+	ostringstream s;
+	s << "/proc/self/map_files/" << hex << start << "-" << end;
+	return s.str();
+}
+
+static string readBuildId(const string& file) {
+	try {
+		return ElfSymbolTable::readBuildId(file);
+	} catch (exception& e) {
+		LOG(WARNING) << "Unable to read " << file << ": " << e.what();
+		return string();
+	}
+}
+
+bool SymbolCache::identify(const string& path, uintptr_t start, uintptr_t end, pair<string, string>& key, string& file) {
+	static const string DELETED = " (deleted)";
+	bool deleted = path.size() > DELETED.size() && path.compare(path.size() - DELETED.size(), DELETED.size(), DELETED) == 0;
+
+	string loadedId = loadedBuildId(loaded_, start);
+	file = deleted ? mapFilesPath(start, end) : path;
+	string fileId = readBuildId(file);
+	if (!deleted && !loadedId.empty() && fileId != loadedId) {
+		// The file has been replaced since it was loaded
+		file = mapFilesPath(start, end);
+		fileId = readBuildId(file);
+	}
+	if (!loadedId.empty() && fileId != loadedId) {
+		LOG(WARNING) << "Can't read the loaded version of " << path << "; not symbolizing it";
+		return false;
+	}
+
+	string version = fileId;
+	if (version.empty()) {
+		struct stat st;
+		if (stat(file.c_str(), &st) != 0) {
+			return false;
+		}
+		ostringstream s;
+		s << "size=" << st.st_size << ",mtime=" << st.st_mtime;
+		version = s.str();
+	}
+
+	key = make_pair(path, version);
+	return true;
+}
+
+shared_ptr<ElfSymbolTable> SymbolCache::loadTable(const string& path, uintptr_t start, uintptr_t end) {
+	pair<string, string> key;
+	string file;
+	if (!identify(path, start, end, key, file)) {
+		return shared_ptr<ElfSymbolTable>();
+	}
+
+	auto it = tables_.find(key);
+	if (it != tables_.end()) {
+		return it->second;
+	}
+
+	shared_ptr<ElfSymbolTable> table;
+	try {
+		table.reset(new ElfSymbolTable(file));
+		LOG(INFO) << "Loaded " << table->size() << " symbols from " << file;
+	} catch (exception& e) {
+		LOG(WARNING) << "Unable to load symbols from " << file << ": " << e.what();
+	}
+	tables_[key] = table;
+	return table;
+}
+
+vector<string> SymbolCache::symbolize(const vector<uintptr_t>& addresses) {
+	vector<string> names;
+	names.reserve(addresses.size());
+
+	lock_guard<mutex> lock(mutex_);
+
+	refresh();
+
+	if (names_.size() + addresses.size() > MAX_CACHED_ADDRESSES) {
+		names_.clear();
+	}
+
+	for (auto it = addresses.begin(); it != addresses.end(); it++) {
+		auto cached = names_.find(*it);
+		if (cached == names_.end()) {
+			cached = names_.insert(make_pair(*it, symbolizer_->symbolize(*it))).first;
+		}
+		names.push_back(cached->second);
+	}
+
+	return names;
+}
+
+}
+}
@@ -0,0 +1,67 @@
+// See COPYRIGHT for copyright
+#ifndef SYMBOLCACHE_H_
+#define SYMBOLCACHE_H_
+
+#include <string>
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "ElfSymbolizer.h"
+
+namespace fathomdb {
+namespace perftools {
+using namespace std;
+
+/// Process-lifetime symbol state shared by all /pprof/symbol requests.
+/// Symbol tables are kept per mapped object, keyed by path and GNU build-id, so a replaced file
+/// is never confused with the one we loaded. The build-id is the loaded image's where the dynamic
+/// loader has one: if the file on disk has since been replaced or deleted, we read the mapped file
+/// through /proc/self/map_files, or don't symbolize it at all. Resolved addresses are remembered until
+/// the executable mappings in /proc/self/maps change (e.g. after dlopen/dlclose), so repeated pprof
+/// sessions are answered from memory; tables for objects no longer mapped are dropped then too.
+class SymbolCache {
+public:
+	static SymbolCache& instance();
+
+	/// Returns the demangled function name for each address; empty if the address is unknown.
+	vector<string> symbolize(const vector<uintptr_t>& addresses);
+
+private:
+	SymbolCache();
+
+	/// Re-reads /proc/self/maps, and starts a new generation if the executable mappings changed.
+	/// Called with mutex_ held.
+	void refresh();
+
+	shared_ptr<ElfSymbolTable> loadTable(const string& path, uintptr_t start, uintptr_t end);
+
+	/// Finds the (path, version) key of the object mapped at [start, end), and the file to read its symbols
+	/// from; false if we can't read the object that is actually mapped. Called with mutex_ held.
+	bool identify(const string& path, uintptr_t start, uintptr_t end, pair<string, string>& key, string& file);
+
+	/// Bound on remembered addresses; the cache is cleared when it gets this big.
+	static const size_t MAX_CACHED_ADDRESSES = 1024 * 1024;
+
+	mutex mutex_;
+
+	/// The executable mappings (see ElfSymbolizer::executableMaps) of this generation
+	string maps_;
+	unique_ptr<ElfSymbolizer> symbolizer_;
+
+	/// What the dynamic loader had loaded when maps_ was read
+	vector<ElfSymbolizer::LoadedObject> loaded_;
+
+	/// Keyed by (path, build-id); build-id falls back to size and mtime if the object has none
+	map<pair<string, string>, shared_ptr<ElfSymbolTable> > tables_;
+
+	unordered_map<uintptr_t, string> names_;
+};
+
+}
+}
+
+#endif /* SYMBOLCACHE_H_ */